@@ -0,0 +1,1027 @@
+/*
+  Copyright 2012 Alexandre Rostovtsev
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Benchmarks for utils.c. By default each one runs briefly on small
+ * inputs, so that make check keeps them working; run with -m perf (or make
+ * bench) for full-size measurements, and --verbose to see the results. */
+
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <signal.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#endif
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "utils.h"
+
+#include "config.h"
+
+static gchar *bench_dir = NULL;
+
+#ifdef __GLIBC__
+/* Allocation counting. These replace the C library's allocator entry points
+ * for the whole process, GLib included, and count calls while
+ * bench_alloc_counting is set. Frees are not counted. */
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static gboolean bench_alloc_counting = FALSE;
+static guint64 bench_allocs = 0;
+
+void *
+malloc (size_t size)
+{
+    if (bench_alloc_counting)
+        bench_allocs++;
+    return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb,
+        size_t size)
+{
+    if (bench_alloc_counting)
+        bench_allocs++;
+    return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr,
+         size_t size)
+{
+    if (bench_alloc_counting)
+        bench_allocs++;
+    return __libc_realloc (ptr, size);
+}
+#endif
+
+static GFile *
+bench_file_new (const gchar *name,
+                const gchar *contents)
+{
+    gchar *filename;
+    GFile *ret;
+
+    filename = g_build_filename (bench_dir, name, NULL);
+    g_assert_true (g_file_set_contents (filename, contents, -1, NULL));
+    ret = g_file_new_for_path (filename);
+    g_free (filename);
+    return ret;
+}
+
+typedef gchar *(*BenchSourceVarFunc) (GFile *file, const gchar *variable, GError **error);
+
+/* The implementation that shell_source_var replaced, which had sh source
+ * the file and echo the expression */
+static gchar *
+bench_shell_source_var_fork (GFile *file,
+                             const gchar *variable,
+                             GError **error)
+{
+    gchar *argv[4] = { "sh", "-c", NULL, NULL };
+    gchar *filename = NULL, *quoted_filename = NULL;
+    gchar *output = NULL;
+    GFileInfo *info;
+
+    filename = g_file_get_path (file);
+    if ((info = g_file_query_info (file, G_FILE_ATTRIBUTE_STANDARD_TYPE "," G_FILE_ATTRIBUTE_ACCESS_CAN_READ, G_FILE_QUERY_INFO_NONE, NULL, error)) == NULL) {
+        g_prefix_error (error, "Unable to source '%s': ", filename);
+        goto out;
+    }
+
+    if (g_file_info_get_file_type (info) != G_FILE_TYPE_REGULAR &&
+        g_file_info_get_file_type (info) != G_FILE_TYPE_SYMBOLIC_LINK) {
+        g_propagate_error (error,
+                           g_error_new (G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                                        "Unable to source '%s': not a regular file", filename));
+        goto out;
+    }
+
+    if (!g_file_info_get_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ)) {
+        g_propagate_error (error,
+                           g_error_new (G_FILE_ERROR, G_FILE_ERROR_ACCES,
+                                        "Unable to source '%s': permission denied", filename));
+        goto out;
+    }
+
+    quoted_filename = g_shell_quote (filename);
+    argv[2] = g_strdup_printf (". %s; echo -n %s", quoted_filename, variable);
+
+    if (!g_spawn_sync (NULL, argv, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, &output, NULL, NULL, error)) {
+        g_prefix_error (error, "Unable to source '%s': ", filename);
+    }
+
+  out:
+    g_free (filename);
+    g_free (quoted_filename);
+    if (info != NULL)
+        g_object_unref (info);
+    if (argv[2] != NULL)
+        g_free (argv[2]);
+    return output;
+}
+
+/* The expressions hostnamed_init evaluates at startup; file 0 stands for
+ * /etc/conf.d/hostname, and file 1 for /etc/machine-info */
+static const struct {
+    guint file;
+    const gchar *expression;
+} bench_hostnamed_vars[] = {
+    { 0, "${hostname-${HOSTNAME-localhost}}" },
+    { 1, "${PRETTY_HOSTNAME}" },
+    { 1, "${CHASSIS}" },
+    { 1, "${ICON_NAME}" },
+    { 1, "${DEPLOYMENT}" },
+    { 1, "${LOCATION}" },
+};
+
+/* Returns the seconds taken by one evaluation of all of
+ * bench_hostnamed_vars, averaged over rounds; values receives the results
+ * of the last round */
+static gdouble
+bench_source_hostnamed_vars (BenchSourceVarFunc func,
+                             GFile **files,
+                             guint rounds,
+                             gchar **values)
+{
+    gdouble elapsed = 0;
+    guint round, i;
+
+    for (round = 0; round < rounds; round++) {
+        /* As at startup, nothing has been parsed yet */
+        utils_destroy ();
+        g_test_timer_start ();
+        for (i = 0; i < G_N_ELEMENTS (bench_hostnamed_vars); i++) {
+            GError *err = NULL;
+
+            g_free (values[i]);
+            values[i] = func (files[bench_hostnamed_vars[i].file], bench_hostnamed_vars[i].expression, &err);
+            g_assert_no_error (err);
+        }
+        elapsed += g_test_timer_elapsed ();
+    }
+    return elapsed / rounds;
+}
+
+static void
+bench_shell_source_var_startup (void)
+{
+    gchar *in_process_values[G_N_ELEMENTS (bench_hostnamed_vars)] = { NULL };
+    gchar *fork_values[G_N_ELEMENTS (bench_hostnamed_vars)] = { NULL };
+    GFile *files[2];
+    gdouble in_process, forked;
+    guint rounds, i;
+
+    files[0] = bench_file_new ("hostname",
+                               "# Set to the hostname of this machine\n"
+                               "hostname=\"bench\"\n");
+    files[1] = bench_file_new ("machine-info",
+                               "PRETTY_HOSTNAME=\"Bench machine\"\n"
+                               "CHASSIS=\"laptop\"\n"
+                               "ICON_NAME=\"computer-laptop\"\n"
+                               "DEPLOYMENT=\"development\"\n"
+                               "LOCATION='Rack 1, shelf 2'\n");
+    rounds = g_test_perf () ? 500 : 2;
+
+    in_process = bench_source_hostnamed_vars (shell_source_var, files, rounds, in_process_values);
+    forked = bench_source_hostnamed_vars (bench_shell_source_var_fork, files, rounds, fork_values);
+    for (i = 0; i < G_N_ELEMENTS (bench_hostnamed_vars); i++) {
+        g_assert_cmpstr (in_process_values[i], ==, fork_values[i]);
+        g_free (in_process_values[i]);
+        g_free (fork_values[i]);
+    }
+
+    g_test_minimized_result (in_process, "hostnamed_init variables in-process: %.1f us", in_process * 1e6);
+    g_test_minimized_result (forked, "hostnamed_init variables with sh -c: %.1f us", forked * 1e6);
+    g_test_message ("in-process evaluation is %.0f times faster", forked / in_process);
+
+    g_object_unref (files[0]);
+    g_object_unref (files[1]);
+}
+
+/* Generates a settings file of at least size bytes, in the styles that
+ * conf.d files use */
+static gchar *
+bench_conf_d_new (gsize size)
+{
+    GString *s;
+    guint i;
+
+    s = g_string_sized_new (size + 128);
+    for (i = 0; s->len < size; i++) {
+        switch (i % 8) {
+        case 0:
+            g_string_append_printf (s, "# Setting %u is described here, and the next line sets it\n", i);
+            break;
+        case 1:
+            g_string_append_printf (s, "VAR_%u=\"double quoted ${VAR_%u} value\"\n", i, i - 1);
+            break;
+        case 2:
+            g_string_append_printf (s, "VAR_%u='single quoted value'\n", i);
+            break;
+        case 3:
+            g_string_append_printf (s, "VAR_%u=unquoted_value_%u\n", i, i);
+            break;
+        case 4:
+            g_string_append (s, "\n");
+            break;
+        case 5:
+            g_string_append_printf (s, "  INDENTED_%u=\"x\" ; NEXT_%u='y'\n", i, i);
+            break;
+        case 6:
+            g_string_append_printf (s, "ESCAPED_%u=\"a \\\"quoted\\\" word\"\n", i);
+            break;
+        case 7:
+            g_string_append_printf (s, "CONTINUED_%u=\"first line\\\nsecond line\"\n", i);
+            break;
+        }
+    }
+    return g_string_free (s, FALSE);
+}
+
+/* Parses from memory, so that only the scanner and the variable index are
+ * measured, not reading the file */
+static void
+bench_shell_parser_throughput (void)
+{
+    static const gsize perf_sizes[] = { 64 << 10, 1 << 20, 16 << 20 };
+    static const gsize quick_sizes[] = { 64 << 10 };
+    const gsize *sizes;
+    guint n_sizes, i;
+    GFile *file;
+
+    if (g_test_perf ()) {
+        sizes = perf_sizes;
+        n_sizes = G_N_ELEMENTS (perf_sizes);
+    } else {
+        sizes = quick_sizes;
+        n_sizes = G_N_ELEMENTS (quick_sizes);
+    }
+    file = g_file_new_for_path ("/nonexistent/bench.conf");
+
+    for (i = 0; i < n_sizes; i++) {
+        gchar *contents;
+        gsize length;
+        gdouble elapsed = 0;
+        guint rounds, round;
+
+        contents = bench_conf_d_new (sizes[i]);
+        length = strlen (contents);
+        /* About 64 MiB in all for each size */
+        rounds = g_test_perf () ? MAX ((64 << 20) / length, 1) : 1;
+        for (round = 0; round < rounds; round++) {
+            GError *err = NULL;
+            ShellParser *parser;
+
+            g_test_timer_start ();
+            parser = shell_parser_new_from_string (file, contents, &err);
+            elapsed += g_test_timer_elapsed ();
+            g_assert_no_error (err);
+            g_assert_nonnull (parser);
+            g_assert_false (shell_parser_is_empty (parser));
+            shell_parser_free (parser);
+        }
+        g_test_maximized_result (length * rounds / elapsed / 1e6, "parsed a %" G_GSIZE_FORMAT " KiB file at %.1f MB/s",
+                                 length >> 10, length * rounds / elapsed / 1e6);
+        g_free (contents);
+    }
+    g_object_unref (file);
+}
+
+/* Gentoo's /etc/conf.d/keymaps, as localed reads it */
+static const gchar bench_keymaps[] =
+    "# Use keymap to specify the default console keymap.  There is a complete tree\n"
+    "# of keymaps in /usr/share/keymaps to choose from.\n"
+    "keymap=\"us\"\n"
+    "\n"
+    "# Should we first load the 'windowkeys' console keymap?  Most x86 users will\n"
+    "# say \"yes\" here.  Note that non-x86 users should leave it as \"no\".\n"
+    "# Loading this keymap will enable VT switching (like ALT+Left/Right)\n"
+    "# using the special windows keys on the linux console.\n"
+    "windowkeys=\"YES\"\n"
+    "\n"
+    "# The maps to load for extended keyboards.  Most users will leave this as is.\n"
+    "extended_keymaps=\"\"\n"
+    "#extended_keymaps=\"backspace keypad euro2\"\n"
+    "\n"
+    "# Tell dumpkeys(1) to interpret character action codes to be\n"
+    "# from the specified character set.\n"
+    "# This only matters if you set unicode=\"yes\" in /etc/rc.conf.\n"
+    "# For a list of valid sets, run `dumpkeys --help`\n"
+    "dumpkeys_charset=\"\"\n"
+    "\n"
+    "# Some fonts map AltGr-E to the currency symbol instead of the Euro.\n"
+    "# To fix this, set to \"yes\"\n"
+    "fix_euro=\"NO\"\n";
+
+#ifdef __GLIBC__
+/* Returns the number of allocations made by parsing file from disk, with
+ * an empty parser cache */
+static guint64
+bench_count_parse_allocs (GFile *file)
+{
+    GError *err = NULL;
+    ShellParser *parser;
+    guint64 ret;
+
+    utils_destroy ();
+    bench_allocs = 0;
+    bench_alloc_counting = TRUE;
+    parser = shell_parser_new (file, &err);
+    bench_alloc_counting = FALSE;
+    ret = bench_allocs;
+    g_assert_no_error (err);
+    g_assert_nonnull (parser);
+    shell_parser_free (parser);
+    return ret;
+}
+
+/* Returns the number of allocations made by parsing contents from memory */
+static guint64
+bench_count_parse_string_allocs (GFile *file,
+                                 const gchar *contents)
+{
+    GError *err = NULL;
+    ShellParser *parser;
+    guint64 ret;
+
+    bench_allocs = 0;
+    bench_alloc_counting = TRUE;
+    parser = shell_parser_new_from_string (file, contents, &err);
+    bench_alloc_counting = FALSE;
+    ret = bench_allocs;
+    g_assert_no_error (err);
+    g_assert_nonnull (parser);
+    shell_parser_free (parser);
+    return ret;
+}
+#endif
+
+static void
+bench_shell_parser_allocations (void)
+{
+#ifdef __GLIBC__
+    GFile *file;
+    GString *repeated;
+    guint64 from_disk, from_string, from_string_repeated;
+    guint i;
+
+    file = bench_file_new ("keymaps", bench_keymaps);
+    /* The first parse also sets up GIO */
+    bench_count_parse_allocs (file);
+
+    from_disk = bench_count_parse_allocs (file);
+    from_string = bench_count_parse_string_allocs (file, bench_keymaps);
+    repeated = g_string_new (NULL);
+    for (i = 0; i < 16; i++)
+        g_string_append (repeated, bench_keymaps);
+    from_string_repeated = bench_count_parse_string_allocs (file, repeated->str);
+
+    g_test_minimized_result (from_disk, "conf.d/keymaps read and parsed with %" G_GUINT64_FORMAT " allocations", from_disk);
+    g_test_minimized_result (from_string, "conf.d/keymaps parsed from memory with %" G_GUINT64_FORMAT " allocations", from_string);
+    g_test_minimized_result (from_string_repeated, "16 copies of conf.d/keymaps parsed from memory with %" G_GUINT64_FORMAT " allocations",
+                             from_string_repeated);
+    /* Entries point into the buffer, so allocations must not grow with
+     * their number, only with the occasional regrowth of an array or the
+     * variable index */
+    g_assert_cmpuint (from_string_repeated, <, from_string + 16);
+
+    g_string_free (repeated, TRUE);
+    g_object_unref (file);
+#else
+    g_test_skip ("Allocations are only counted with the GNU C library");
+#endif
+}
+
+/* How shell_parser_save wrote settings files before file_write_atomic: in
+ * place through g_file_replace, with one write per entry. Each line is
+ * written as an entry followed by its newline. */
+static gboolean
+bench_save_replace (GFile *file,
+                    const gchar *contents,
+                    GError **error)
+{
+    GFileOutputStream *os;
+    const gchar *line, *newline;
+    gboolean ret = FALSE;
+    gsize written;
+
+    if ((os = g_file_replace (file, NULL, FALSE, G_FILE_CREATE_NONE, NULL, error)) == NULL)
+        return FALSE;
+    for (line = contents; *line != '\0'; line = newline + 1) {
+        if ((newline = strchr (line, '\n')) == NULL)
+            newline = line + strlen (line) - 1;
+        else if (newline > line &&
+                 !g_output_stream_write_all (G_OUTPUT_STREAM (os), line, newline - line, &written, NULL, error))
+            goto out;
+        if (!g_output_stream_write_all (G_OUTPUT_STREAM (os), newline, 1, &written, NULL, error))
+            goto out;
+    }
+    if (!g_output_stream_close (G_OUTPUT_STREAM (os), NULL, error)) {
+        g_output_stream_close (G_OUTPUT_STREAM (os), NULL, NULL);
+        goto out;
+    }
+    ret = TRUE;
+
+  out:
+    g_object_unref (os);
+    return ret;
+}
+
+#define BENCH_SAVE_TRACED_ROUNDS 10
+
+struct bench_save {
+    GFile *file;
+    gchar *filename;
+    const gchar *contents;
+    gboolean atomic; /* file_write_atomic rather than bench_save_replace */
+    guint rounds;
+};
+
+static void
+bench_save_run (gpointer _save,
+                gpointer unused)
+{
+    struct bench_save *save = (struct bench_save *) _save;
+    guint round;
+
+    for (round = 0; round < save->rounds; round++) {
+        GError *err = NULL;
+
+        if (save->atomic)
+            file_write_atomic (save->filename, save->contents, strlen (save->contents), NULL, NULL, &err);
+        else
+            bench_save_replace (save->file, save->contents, &err);
+        g_assert_no_error (err);
+    }
+}
+
+/* Runs func in a child process traced with ptrace, and returns the number
+ * of system calls that it made, or -1 if they cannot be counted */
+static gint64
+bench_count_syscalls (GFunc func,
+                      gpointer data)
+{
+#ifdef __linux__
+    pid_t pid;
+    gint status;
+    gint64 ret = 0;
+    gboolean entering = TRUE;
+
+    if ((pid = fork ()) < 0)
+        return -1;
+    if (pid == 0) {
+        if (ptrace (PTRACE_TRACEME, 0, NULL, NULL) < 0)
+            _exit (1);
+        raise (SIGSTOP);
+        func (data, NULL);
+        _exit (0);
+    }
+
+    if (waitpid (pid, &status, 0) < 0 || !WIFSTOPPED (status) ||
+        ptrace (PTRACE_SETOPTIONS, pid, NULL, PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL) < 0) {
+        kill (pid, SIGKILL);
+        waitpid (pid, &status, 0);
+        return -1;
+    }
+    /* Each call stops the child once on entry and once on exit, except for
+     * the exit_group that ends it, which is not counted */
+    for (;;) {
+        if (ptrace (PTRACE_SYSCALL, pid, NULL, NULL) < 0 || waitpid (pid, &status, 0) < 0)
+            return -1;
+        if (WIFEXITED (status))
+            return WEXITSTATUS (status) == 0 ? ret - 1 : -1;
+        if (WIFSIGNALED (status))
+            return -1;
+        if (WSTOPSIG (status) == (SIGTRAP | 0x80)) {
+            if (entering)
+                ret++;
+            entering = !entering;
+        }
+    }
+#else
+    return -1;
+#endif
+}
+
+static void
+bench_file_write_atomic (void)
+{
+    struct bench_save save = { NULL };
+    gdouble elapsed[2];
+    gint64 syscalls[2];
+    gchar *contents;
+    guint i;
+
+    save.file = bench_file_new ("keymaps-save", bench_keymaps);
+    save.filename = g_file_get_path (save.file);
+    save.contents = bench_keymaps;
+    for (i = 0; i < 2; i++) {
+        save.atomic = i == 1;
+        /* Outside the child, so that it does not count setting up GIO */
+        save.rounds = 1;
+        bench_save_run (&save, NULL);
+
+        save.rounds = g_test_perf () ? 200 : 2;
+        g_test_timer_start ();
+        bench_save_run (&save, NULL);
+        elapsed[i] = g_test_timer_elapsed () / save.rounds;
+
+        save.rounds = BENCH_SAVE_TRACED_ROUNDS;
+        syscalls[i] = bench_count_syscalls (bench_save_run, &save);
+
+        g_assert_true (g_file_get_contents (save.filename, &contents, NULL, NULL));
+        g_assert_cmpstr (contents, ==, bench_keymaps);
+        g_free (contents);
+    }
+
+    g_test_minimized_result (elapsed[0], "saved with g_file_replace in %.1f us", elapsed[0] * 1e6);
+    g_test_minimized_result (elapsed[1], "saved with file_write_atomic in %.1f us", elapsed[1] * 1e6);
+    if (syscalls[0] >= 0 && syscalls[1] >= 0) {
+        g_test_minimized_result (syscalls[0] / (gdouble) BENCH_SAVE_TRACED_ROUNDS, "g_file_replace makes %.1f system calls per save",
+                                 syscalls[0] / (gdouble) BENCH_SAVE_TRACED_ROUNDS);
+        g_test_minimized_result (syscalls[1] / (gdouble) BENCH_SAVE_TRACED_ROUNDS, "file_write_atomic makes %.1f system calls per save",
+                                 syscalls[1] / (gdouble) BENCH_SAVE_TRACED_ROUNDS);
+        g_assert_cmpint (syscalls[1], <, syscalls[0]);
+    } else
+        g_test_message ("System calls cannot be counted here");
+
+    g_free (save.filename);
+    g_object_unref (save.file);
+}
+
+/* How kbd_model_map_lookup_x11 found the best entry before it had the
+ * layout index: by scoring every entry in the map */
+static const struct kbd_model_map_entry *
+bench_kbd_model_map_lookup_x11_scan (const struct kbd_model_map *map,
+                                     const struct kbd_model_map_query *query)
+{
+    const struct kbd_model_map_entry *best_entry = NULL;
+    unsigned int best_failure_score = UINT_MAX;
+    guint i;
+
+    for (i = 0; i < map->n_entries; i++) {
+        unsigned int failure_score = 0;
+
+        if (kbd_model_map_entry_matches_x11 (map, &map->entries[i], query, &failure_score) &&
+            failure_score < best_failure_score) {
+            best_entry = &map->entries[i];
+            best_failure_score = failure_score;
+        }
+    }
+    return best_entry;
+}
+
+static gchar **
+bench_x11_settings_new (const gchar *layout,
+                        const gchar *model,
+                        const gchar *variant,
+                        const gchar *options)
+{
+    gchar **ret;
+
+    ret = g_new0 (gchar *, 5);
+    ret[0] = g_strdup (layout);
+    ret[1] = g_strdup (model);
+    ret[2] = g_strdup (variant);
+    ret[3] = g_strdup (options);
+    return ret;
+}
+
+/* Returns xkb settings to look up, each a strv of layout, model, variant
+ * and options: for every entry of map, its own settings, its layout with
+ * another model, and its layout combined with "us" either way round; and a
+ * few that match nothing */
+static GPtrArray *
+bench_kbd_model_map_queries_new (const struct kbd_model_map *map)
+{
+    GPtrArray *queries;
+    guint i;
+
+    queries = g_ptr_array_new_with_free_func ((GDestroyNotify)g_strfreev);
+    for (i = 0; i < map->n_entries; i++) {
+        const struct kbd_model_map_entry *entry = &map->entries[i];
+        gchar *layout;
+
+        g_ptr_array_add (queries, bench_x11_settings_new (entry->x11_layout, entry->x11_model, entry->x11_variant, entry->x11_options));
+        g_ptr_array_add (queries, bench_x11_settings_new (entry->x11_layout, "pc104", "", ""));
+        layout = g_strconcat ("us,", entry->x11_layout, NULL);
+        g_ptr_array_add (queries, bench_x11_settings_new (layout, "", "", "grp:alt_shift_toggle"));
+        g_free (layout);
+        layout = g_strconcat (entry->x11_layout, ",us", NULL);
+        g_ptr_array_add (queries, bench_x11_settings_new (layout, "", entry->x11_variant, ""));
+        g_free (layout);
+    }
+    g_ptr_array_add (queries, bench_x11_settings_new ("xx", "pc105", "", ""));
+    g_ptr_array_add (queries, bench_x11_settings_new ("", "", "", ""));
+    g_ptr_array_add (queries, bench_x11_settings_new ("xx,yy,zz", "", "", ""));
+    return queries;
+}
+
+/* Returns the seconds taken by rounds of interning all queries for map */
+static gdouble
+bench_kbd_model_map_init_queries (const struct kbd_model_map *map,
+                                  GPtrArray *queries,
+                                  guint rounds,
+                                  struct kbd_model_map_query *interned)
+{
+    gdouble elapsed = 0;
+    guint round, i;
+
+    for (round = 0; round < rounds; round++) {
+        if (round > 0)
+            for (i = 0; i < queries->len; i++)
+                kbd_model_map_query_clear (&interned[i]);
+        g_test_timer_start ();
+        for (i = 0; i < queries->len; i++) {
+            gchar **x11 = g_ptr_array_index (queries, i);
+
+            kbd_model_map_query_init (&interned[i], map, x11[0], x11[1], x11[2], x11[3]);
+        }
+        elapsed += g_test_timer_elapsed ();
+    }
+    return elapsed;
+}
+
+/* Returns the seconds taken by rounds lookups of all n interned queries,
+ * storing the results in best */
+static gdouble
+bench_kbd_model_map_lookup_queries (const struct kbd_model_map *map,
+                                    const struct kbd_model_map_query *interned,
+                                    guint n,
+                                    gboolean scan,
+                                    guint rounds,
+                                    const struct kbd_model_map_entry **best)
+{
+    guint round, i;
+
+    g_test_timer_start ();
+    for (round = 0; round < rounds; round++)
+        for (i = 0; i < n; i++)
+            best[i] = scan ? bench_kbd_model_map_lookup_x11_scan (map, &interned[i]) : kbd_model_map_lookup_x11 (map, &interned[i]);
+    return g_test_timer_elapsed ();
+}
+
+static void
+bench_kbd_model_map_lookup (void)
+{
+    struct kbd_model_map *maps[2];
+    const struct kbd_model_map_entry **best[2], **best_scan;
+    struct kbd_model_map_query *interned;
+    gchar *filename, *contents = NULL, *copy_contents;
+    GPtrArray *queries;
+    GFile *file, *copy;
+    GError *err = NULL;
+    guint rounds, i, m;
+
+    /* The shipped file loads as the compiled-in table; a copy with an extra
+     * comment has to be parsed */
+    filename = g_build_filename (TEST_DATADIR, "kbd-model-map", NULL);
+    file = g_file_new_for_path (filename);
+    g_assert_true (g_file_get_contents (filename, &contents, NULL, NULL));
+    copy_contents = g_strconcat (contents, "# not the shipped file\n", NULL);
+    copy = bench_file_new ("kbd-model-map", copy_contents);
+    maps[0] = kbd_model_map_load (file, &err);
+    g_assert_no_error (err);
+    g_assert_true (maps[0]->builtin);
+    maps[1] = kbd_model_map_load (copy, &err);
+    g_assert_no_error (err);
+    g_assert_false (maps[1]->builtin);
+    g_assert_cmpuint (maps[0]->n_entries, ==, maps[1]->n_entries);
+
+    queries = bench_kbd_model_map_queries_new (maps[0]);
+    rounds = g_test_perf () ? 1000 : 1;
+    interned = g_new0 (struct kbd_model_map_query, queries->len);
+    best_scan = g_new0 (const struct kbd_model_map_entry *, queries->len);
+    for (m = 0; m < G_N_ELEMENTS (maps); m++) {
+        gdouble init, indexed, scanned;
+
+        best[m] = g_new0 (const struct kbd_model_map_entry *, queries->len);
+        init = bench_kbd_model_map_init_queries (maps[m], queries, rounds, interned);
+        indexed = bench_kbd_model_map_lookup_queries (maps[m], interned, queries->len, FALSE, rounds, best[m]);
+        scanned = bench_kbd_model_map_lookup_queries (maps[m], interned, queries->len, TRUE, rounds, best_scan);
+        /* The index must find the same entries as scoring all of them */
+        for (i = 0; i < queries->len; i++) {
+            g_assert_true (best[m][i] == best_scan[i]);
+            kbd_model_map_query_clear (&interned[i]);
+        }
+
+        g_test_minimized_result (indexed / rounds / queries->len * 1e9,
+                                 "%s map, %u queries against %u entries: %.0f ns per lookup with the layout index, "
+                                 "%.0f ns scoring every entry; interning a query takes %.0f ns",
+                                 maps[m]->builtin ? "compiled-in" : "parsed", queries->len, maps[m]->n_entries,
+                                 indexed / rounds / queries->len * 1e9, scanned / rounds / queries->len * 1e9,
+                                 init / rounds / queries->len * 1e9);
+    }
+
+    /* Both maps agree, and all but the queries made up to match nothing find
+     * an entry */
+    for (i = 0, m = 0; i < queries->len; i++) {
+        g_assert_true ((best[0][i] == NULL) == (best[1][i] == NULL));
+        if (best[0][i] != NULL) {
+            g_assert_cmpuint (best[0][i] - maps[0]->entries, ==, best[1][i] - maps[1]->entries);
+            m++;
+        }
+    }
+    g_assert_cmpuint (m, ==, queries->len - 3);
+
+    g_free (best[0]);
+    g_free (best[1]);
+    g_free (best_scan);
+    g_free (interned);
+    g_ptr_array_free (queries, TRUE);
+    kbd_model_map_unref (maps[0]);
+    kbd_model_map_unref (maps[1]);
+    g_object_unref (copy);
+    g_object_unref (file);
+    g_free (copy_contents);
+    g_free (contents);
+    g_free (filename);
+}
+
+/* The patterns the xorg.conf.d parser tried in turn on each line before
+ * xorg_confd_line_classify; for the Xkb options, group 2 is the value */
+static const struct {
+    const gchar *pattern;
+    enum XORG_CONFD_LINE_TYPE type;
+} bench_xorg_confd_patterns[] = {
+    { "^\\s*#", XORG_CONFD_LINE_TYPE_COMMENT },
+    { "^\\s*Section\\s+\"InputClass\"", XORG_CONFD_LINE_TYPE_SECTION_INPUT_CLASS },
+    { "^\\s*Section\\s+\"([^\"])\"", XORG_CONFD_LINE_TYPE_SECTION_OTHER },
+    { "^\\s*EndSection", XORG_CONFD_LINE_TYPE_END_SECTION },
+    { "^\\s*MatchIsKeyboard(?:\\s*$|\\s+\"(?:1|on|true|yes)\")", XORG_CONFD_LINE_TYPE_MATCH_IS_KEYBOARD },
+    { "^(\\s*Option\\s+\"XkbLayout\"\\s+)\"([^\"]*)\"", XORG_CONFD_LINE_TYPE_XKB_LAYOUT },
+    { "^(\\s*Option\\s+\"XkbModel\"\\s+)\"([^\"]*)\"", XORG_CONFD_LINE_TYPE_XKB_MODEL },
+    { "^(\\s*Option\\s+\"XkbVariant\"\\s+)\"([^\"]*)\"", XORG_CONFD_LINE_TYPE_XKB_VARIANT },
+    { "^(\\s*Option\\s+\"XkbOptions\"\\s+)\"([^\"]*)\"", XORG_CONFD_LINE_TYPE_XKB_OPTIONS },
+};
+
+static enum XORG_CONFD_LINE_TYPE
+bench_xorg_confd_line_classify_regex (GRegex **regexes,
+                                      const gchar *line,
+                                      gchar **value)
+{
+    enum XORG_CONFD_LINE_TYPE type = XORG_CONFD_LINE_TYPE_UNKNOWN;
+    GMatchInfo *match_info = NULL;
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS (bench_xorg_confd_patterns); i++) {
+        if (g_regex_match (regexes[i], line, 0, &match_info)) {
+            type = bench_xorg_confd_patterns[i].type;
+            if (type >= XORG_CONFD_LINE_TYPE_XKB_LAYOUT)
+                *value = g_match_info_fetch (match_info, 2);
+            break;
+        }
+        _g_match_info_clear (&match_info);
+    }
+    _g_match_info_clear (&match_info);
+    return type;
+}
+
+static enum XORG_CONFD_LINE_TYPE
+bench_xorg_confd_line_classify (const gchar *line,
+                                gchar **value)
+{
+    enum XORG_CONFD_LINE_TYPE type;
+    gsize value_offset = 0, value_length = 0;
+
+    type = xorg_confd_line_classify (line, &value_offset, &value_length);
+    if (type >= XORG_CONFD_LINE_TYPE_XKB_LAYOUT)
+        *value = g_strndup (line + value_offset + 1, value_length);
+    return type;
+}
+
+/* Generates an xorg.conf.d file of at least size bytes, with keyboard
+ * InputClass sections among other sections, in varying case and
+ * indentation */
+static gchar *
+bench_xorg_conf_new (gsize size)
+{
+    GString *contents;
+    guint i;
+
+    contents = g_string_sized_new (size + 512);
+    for (i = 0; contents->len < size; i++) {
+        switch (i % 4) {
+        case 0:
+            g_string_append_printf (contents,
+                                    "# Keyboard %u, written by localed\n"
+                                    "Section \"InputClass\"\n"
+                                    "        Identifier \"keyboard-all-%u\"\n"
+                                    "        MatchIsKeyboard \"on\"\n"
+                                    "        Option \"XkbLayout\" \"us,de\"\n"
+                                    "        Option \"XkbModel\" \"pc105\"\n"
+                                    "        Option \"XkbVariant\" \",nodeadkeys\"\n"
+                                    "        Option \"XkbOptions\" \"grp:alt_shift_toggle\"\n"
+                                    "EndSection\n\n", i, i);
+            break;
+        case 1:
+            g_string_append_printf (contents,
+                                    "Section \"Device\"\n"
+                                    "\tIdentifier \"card%u\"\n"
+                                    "\tDriver \"modesetting\"\n"
+                                    "\tOption \"AccelMethod\" \"glamor\"\n"
+                                    "EndSection\n\n", i);
+            break;
+        case 2:
+            g_string_append_printf (contents,
+                                    "Section \"InputClass\"\n"
+                                    "    Identifier \"touchpad-%u\"\n"
+                                    "    MatchIsTouchpad \"on\"\n"
+                                    "    MatchDevicePath \"/dev/input/event*\"\n"
+                                    "    Option \"Tapping\" \"on\"  # tap to click\n"
+                                    "EndSection\n\n", i);
+            break;
+        case 3:
+            g_string_append_printf (contents,
+                                    "section \"inputclass\"\n"
+                                    "\tidentifier \"keyboard-%u\"\n"
+                                    "\tmatchiskeyboard\n"
+                                    "\toption \"xkblayout\" \"fr\"\n"
+                                    "\toption \"xkbmodel\" \"\"\n"
+                                    "endsection\n\n", i);
+            break;
+        }
+    }
+    return g_string_free (contents, FALSE);
+}
+
+/* Returns the seconds taken by rounds classifications of all lines, with the
+ * regexes if they are given, storing the types and values of the first
+ * round */
+static gdouble
+bench_xorg_confd_classify_lines (GRegex **regexes,
+                                 gchar **lines,
+                                 guint rounds,
+                                 enum XORG_CONFD_LINE_TYPE *types,
+                                 gchar **values)
+{
+    gdouble elapsed = 0;
+    guint round, i;
+
+    for (round = 0; round < rounds; round++) {
+        if (round > 0)
+            for (i = 0; lines[i] != NULL; i++)
+                g_clear_pointer (&values[i], g_free);
+        g_test_timer_start ();
+        for (i = 0; lines[i] != NULL; i++)
+            types[i] = regexes != NULL ? bench_xorg_confd_line_classify_regex (regexes, lines[i], &values[i])
+                                       : bench_xorg_confd_line_classify (lines[i], &values[i]);
+        elapsed += g_test_timer_elapsed ();
+    }
+    return elapsed;
+}
+
+/* Classifies generated files line by line, as the xorg.conf.d parser does,
+ * with xorg_confd_line_classify and with the regexes it replaced. Both must
+ * agree, except on non-InputClass sections: the old pattern for those only
+ * accepted one-character names. */
+static void
+bench_xorg_confd_line_classify_throughput (void)
+{
+    static const gsize perf_sizes[] = { 64 << 10, 1 << 20, 16 << 20 };
+    static const gsize quick_sizes[] = { 16 << 10 };
+    GRegex *regexes[G_N_ELEMENTS (bench_xorg_confd_patterns)];
+    const gsize *sizes;
+    guint n_sizes, i, j;
+
+    if (g_test_perf ()) {
+        sizes = perf_sizes;
+        n_sizes = G_N_ELEMENTS (perf_sizes);
+    } else {
+        sizes = quick_sizes;
+        n_sizes = G_N_ELEMENTS (quick_sizes);
+    }
+    for (j = 0; j < G_N_ELEMENTS (bench_xorg_confd_patterns); j++) {
+        regexes[j] = g_regex_new (bench_xorg_confd_patterns[j].pattern, G_REGEX_ANCHORED|G_REGEX_CASELESS, 0, NULL);
+        g_assert_nonnull (regexes[j]);
+    }
+
+    for (i = 0; i < n_sizes; i++) {
+        enum XORG_CONFD_LINE_TYPE *types, *regex_types;
+        gchar *contents, **lines, **values, **regex_values;
+        gdouble elapsed, regex_elapsed;
+        guint n_lines, n_sections = 0, rounds;
+        gsize length;
+
+        contents = bench_xorg_conf_new (sizes[i]);
+        length = strlen (contents);
+        lines = g_strsplit (contents, "\n", -1);
+        n_lines = g_strv_length (lines);
+        types = g_new0 (enum XORG_CONFD_LINE_TYPE, n_lines);
+        regex_types = g_new0 (enum XORG_CONFD_LINE_TYPE, n_lines);
+        values = g_new0 (gchar *, n_lines);
+        regex_values = g_new0 (gchar *, n_lines);
+
+        /* About 64 MiB in all for each size; the regexes get one pass */
+        rounds = g_test_perf () ? MAX ((64 << 20) / length, 1) : 1;
+        elapsed = bench_xorg_confd_classify_lines (NULL, lines, rounds, types, values);
+        regex_elapsed = bench_xorg_confd_classify_lines (regexes, lines, 1, regex_types, regex_values);
+
+        for (j = 0; j < n_lines; j++) {
+            if (types[j] == XORG_CONFD_LINE_TYPE_SECTION_OTHER && regex_types[j] == XORG_CONFD_LINE_TYPE_UNKNOWN) {
+                n_sections++;
+                continue;
+            }
+            g_assert_cmpint (types[j], ==, regex_types[j]);
+            g_assert_cmpstr (values[j], ==, regex_values[j]);
+        }
+        g_assert_cmpuint (n_sections, >, 0);
+
+        g_test_maximized_result (length * rounds / elapsed / 1e6,
+                                 "classified %u lines (%" G_GSIZE_FORMAT " KiB) at %.1f MB/s, against %.1f MB/s with the regexes",
+                                 n_lines, length >> 10, length * rounds / elapsed / 1e6, length / regex_elapsed / 1e6);
+
+        for (j = 0; j < n_lines; j++) {
+            g_free (values[j]);
+            g_free (regex_values[j]);
+        }
+        g_free (values);
+        g_free (regex_values);
+        g_free (types);
+        g_free (regex_types);
+        g_strfreev (lines);
+        g_free (contents);
+    }
+
+    for (j = 0; j < G_N_ELEMENTS (bench_xorg_confd_patterns); j++)
+        g_regex_unref (regexes[j]);
+}
+
+static void
+bench_dir_remove (const gchar *dirname)
+{
+    GDir *dir;
+    const gchar *name;
+
+    if ((dir = g_dir_open (dirname, 0, NULL)) == NULL)
+        return;
+    while ((name = g_dir_read_name (dir)) != NULL) {
+        gchar *filename;
+
+        filename = g_build_filename (dirname, name, NULL);
+        unlink (filename);
+        g_free (filename);
+    }
+    g_dir_close (dir);
+    rmdir (dirname);
+}
+
+/* --verbose enables debug messages, which would be timed along with the
+ * code that logs them */
+static void
+bench_log_ignore (const gchar *log_domain,
+                  GLogLevelFlags log_level,
+                  const gchar *message,
+                  gpointer user_data)
+{
+}
+
+gint
+main (gint argc, gchar *argv[])
+{
+    gint ret;
+
+    /* So that GLib's small allocations are counted too */
+    g_setenv ("G_SLICE", "always-malloc", TRUE);
+    g_test_init (&argc, &argv, NULL);
+    g_log_set_handler (NULL, G_LOG_LEVEL_DEBUG, bench_log_ignore, NULL);
+
+    bench_dir = g_dir_make_tmp ("openrc-settingsd-bench-XXXXXX", NULL);
+    g_assert_nonnull (bench_dir);
+
+    g_test_add_func ("/utils/bench/shell-source-var/startup", bench_shell_source_var_startup);
+    g_test_add_func ("/utils/bench/shell-parser/throughput", bench_shell_parser_throughput);
+    g_test_add_func ("/utils/bench/shell-parser/allocations", bench_shell_parser_allocations);
+    g_test_add_func ("/utils/bench/file-write-atomic/save", bench_file_write_atomic);
+    g_test_add_func ("/utils/bench/kbd-model-map/lookup", bench_kbd_model_map_lookup);
+    g_test_add_func ("/utils/bench/xorg-confd/line-classify", bench_xorg_confd_line_classify_throughput);
+
+    ret = g_test_run ();
+
+    utils_destroy ();
+    bench_dir_remove (bench_dir);
+    g_free (bench_dir);
+    return ret;
+}
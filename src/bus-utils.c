@@ -16,10 +16,524 @@
   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
+#include <stdarg.h>
+#include <string.h>
+
+#include <dbus/dbus-protocol.h>
 #include <glib.h>
 #include <gio/gio.h>
-#include <polkit/polkit.h>
 
 #include "bus-utils.h"
 
+/* Watches on the same peer share a single NameOwnerChanged subscription,
+ * so that a client with many requests in flight costs the bus one match
+ * rule rather than one per request */
+struct bus_peer {
+    GDBusConnection *connection;
+    gchar *unique_name;
+    guint subscription_id;
+    GList *watches;
+};
+
+struct bus_peer_watch_data {
+    gint refcount;
+    struct bus_peer *peer;
+    BusPeerVanishedFunc func;
+    gpointer user_data;
+    GDestroyNotify user_data_free_func;
+};
+
+static GHashTable *bus_peers = NULL; /* struct bus_peer -> itself */
+static GHashTable *bus_peer_watches = NULL; /* id -> struct bus_peer_watch_data */
+static guint bus_peer_watch_last_id = 0;
+G_LOCK_DEFINE_STATIC (bus_peer_watch);
+
+static guint
+bus_peer_hash (gconstpointer key)
+{
+    const struct bus_peer *peer = (const struct bus_peer *) key;
+
+    return g_str_hash (peer->unique_name) ^ g_direct_hash (peer->connection);
+}
+
+static gboolean
+bus_peer_equal (gconstpointer a,
+                gconstpointer b)
+{
+    const struct bus_peer *peer_a = (const struct bus_peer *) a;
+    const struct bus_peer *peer_b = (const struct bus_peer *) b;
+
+    return peer_a->connection == peer_b->connection && !strcmp (peer_a->unique_name, peer_b->unique_name);
+}
+
+static void
+bus_peer_watch_data_unref (struct bus_peer_watch_data *data)
+{
+    if (!g_atomic_int_dec_and_test (&data->refcount))
+        return;
+    if (data->user_data_free_func != NULL)
+        data->user_data_free_func (data->user_data);
+    g_free (data);
+}
+
+static void
+bus_peer_vanished (GDBusConnection *connection,
+                   const gchar *name)
+{
+    struct bus_peer key, *peer;
+    GList *watches = NULL, *curr;
+
+    /* The callbacks run without the lock, since they may unwatch */
+    key.connection = connection;
+    key.unique_name = (gchar *) name;
+    G_LOCK (bus_peer_watch);
+    if (bus_peers != NULL && (peer = g_hash_table_lookup (bus_peers, &key)) != NULL) {
+        watches = g_list_copy (peer->watches);
+        for (curr = watches; curr != NULL; curr = curr->next)
+            g_atomic_int_inc (&((struct bus_peer_watch_data *) curr->data)->refcount);
+    }
+    G_UNLOCK (bus_peer_watch);
+
+    for (curr = watches; curr != NULL; curr = curr->next) {
+        struct bus_peer_watch_data *data = (struct bus_peer_watch_data *) curr->data;
+
+        data->func (name, data->user_data);
+        bus_peer_watch_data_unref (data);
+    }
+    g_list_free (watches);
+}
+
+static void
+bus_peer_name_owner_changed_cb (GDBusConnection *connection,
+                                const gchar *sender_name,
+                                const gchar *object_path,
+                                const gchar *interface_name,
+                                const gchar *signal_name,
+                                GVariant *parameters,
+                                gpointer user_data)
+{
+    const gchar *name, *old_owner, *new_owner;
+
+    g_variant_get (parameters, "(&s&s&s)", &name, &old_owner, &new_owner);
+    if (*new_owner == '\0')
+        bus_peer_vanished (connection, name);
+}
+
+/* A peer that disconnected before its subscription was made never gets a
+ * NameOwnerChanged signal, so every new subscription is followed by a
+ * GetNameOwner; unique names are never reused, so if that fails, the peer
+ * has gone */
+static void
+bus_peer_get_name_owner_cb (GObject *source_object,
+                            GAsyncResult *res,
+                            gpointer _unique_name)
+{
+    gchar *unique_name = (gchar *) _unique_name;
+    GVariant *reply;
+    GError *err = NULL;
+
+    if ((reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), res, &err)) != NULL)
+        g_variant_unref (reply);
+    else {
+        if (g_error_matches (err, G_DBUS_ERROR, G_DBUS_ERROR_NAME_HAS_NO_OWNER)) {
+            g_debug ("%s disconnected before it could be watched", unique_name);
+            bus_peer_vanished (G_DBUS_CONNECTION (source_object), unique_name);
+        }
+        g_error_free (err);
+    }
+    g_free (unique_name);
+}
+
+/* Calls func when the peer with the given unique name disconnects from the
+ * bus, or soon after this call if it already has; func may be called more
+ * than once. Returns an id for bus_peer_unwatch, which frees user_data with
+ * user_data_free_func */
+guint
+bus_peer_watch_full (GDBusConnection *connection,
+                     const gchar *unique_name,
+                     BusPeerVanishedFunc func,
+                     gpointer user_data,
+                     GDestroyNotify user_data_free_func)
+{
+    struct bus_peer key, *peer;
+    struct bus_peer_watch_data *data;
+    gboolean subscribed = FALSE;
+    guint id;
+
+    data = g_new0 (struct bus_peer_watch_data, 1);
+    data->refcount = 1;
+    data->func = func;
+    data->user_data = user_data;
+    data->user_data_free_func = user_data_free_func;
+
+    key.connection = connection;
+    key.unique_name = (gchar *) unique_name;
+    G_LOCK (bus_peer_watch);
+    if (bus_peers == NULL) {
+        bus_peers = g_hash_table_new (bus_peer_hash, bus_peer_equal);
+        bus_peer_watches = g_hash_table_new (g_direct_hash, g_direct_equal);
+    }
+    if ((peer = g_hash_table_lookup (bus_peers, &key)) == NULL) {
+        peer = g_new0 (struct bus_peer, 1);
+        peer->connection = g_object_ref (connection);
+        peer->unique_name = g_strdup (unique_name);
+        peer->subscription_id = g_dbus_connection_signal_subscribe (connection,
+                                                                    "org.freedesktop.DBus",
+                                                                    "org.freedesktop.DBus",
+                                                                    "NameOwnerChanged",
+                                                                    "/org/freedesktop/DBus",
+                                                                    unique_name,
+                                                                    G_DBUS_SIGNAL_FLAGS_NONE,
+                                                                    bus_peer_name_owner_changed_cb,
+                                                                    NULL,
+                                                                    NULL);
+        g_hash_table_insert (bus_peers, peer, peer);
+        subscribed = TRUE;
+    }
+    data->peer = peer;
+    peer->watches = g_list_prepend (peer->watches, data);
+    do
+        id = ++bus_peer_watch_last_id;
+    while (id == 0 || g_hash_table_lookup (bus_peer_watches, GUINT_TO_POINTER (id)) != NULL);
+    g_hash_table_insert (bus_peer_watches, GUINT_TO_POINTER (id), data);
+    G_UNLOCK (bus_peer_watch);
+
+    if (subscribed)
+        g_dbus_connection_call (connection,
+                                "org.freedesktop.DBus",
+                                "/org/freedesktop/DBus",
+                                "org.freedesktop.DBus",
+                                "GetNameOwner",
+                                g_variant_new ("(s)", unique_name),
+                                G_VARIANT_TYPE ("(s)"),
+                                G_DBUS_CALL_FLAGS_NONE,
+                                -1,
+                                NULL,
+                                bus_peer_get_name_owner_cb,
+                                g_strdup (unique_name));
+    return id;
+}
+
+guint
+bus_peer_watch (GDBusConnection *connection,
+                const gchar *unique_name,
+                BusPeerVanishedFunc func,
+                gpointer user_data)
+{
+    return bus_peer_watch_full (connection, unique_name, func, user_data, NULL);
+}
+
+/* The peer's subscription is dropped with its last watch */
+void
+bus_peer_unwatch (GDBusConnection *connection,
+                  guint watch_id)
+{
+    struct bus_peer_watch_data *data = NULL;
+    struct bus_peer *peer;
+
+    G_LOCK (bus_peer_watch);
+    if (bus_peer_watches != NULL && (data = g_hash_table_lookup (bus_peer_watches, GUINT_TO_POINTER (watch_id))) != NULL) {
+        g_hash_table_remove (bus_peer_watches, GUINT_TO_POINTER (watch_id));
+        peer = data->peer;
+        peer->watches = g_list_remove (peer->watches, data);
+        if (peer->watches == NULL) {
+            g_hash_table_remove (bus_peers, peer);
+            g_dbus_connection_signal_unsubscribe (peer->connection, peer->subscription_id);
+            g_object_unref (peer->connection);
+            g_free (peer->unique_name);
+            g_free (peer);
+        }
+    }
+    G_UNLOCK (bus_peer_watch);
+    if (data != NULL)
+        bus_peer_watch_data_unref (data);
+}
+
+/* Each invocation that asks for it gets a cancellable which is cancelled
+ * when its sender disconnects, so that work nobody will receive a reply for
+ * can be abandoned. The watch lives as long as the invocation does. */
+struct bus_invocation_cancel {
+    GDBusConnection *connection;
+    guint watch_id;
+    GCancellable *cancellable;
+};
+
+G_LOCK_DEFINE_STATIC (bus_invocation_cancel);
+
+static GQuark
+bus_invocation_cancel_quark (void)
+{
+    return g_quark_from_static_string ("openrc-settingsd-invocation-cancel");
+}
+
+static void
+bus_invocation_cancel_free (struct bus_invocation_cancel *cancel)
+{
+    if (cancel->connection != NULL) {
+        bus_peer_unwatch (cancel->connection, cancel->watch_id);
+        g_object_unref (cancel->connection);
+    }
+    g_object_unref (cancel->cancellable);
+    g_free (cancel);
+}
+
+static void
+bus_invocation_sender_vanished_cb (const gchar *unique_name,
+                                   gpointer user_data)
+{
+    GCancellable *cancellable = G_CANCELLABLE (user_data);
+
+    if (!g_cancellable_is_cancelled (cancellable)) {
+        g_debug ("%s disconnected, cancelling its pending request", unique_name);
+        g_cancellable_cancel (cancellable);
+    }
+}
+
+/* Returns the invocation's cancellable (owned by the invocation), creating it
+ * on first use */
+GCancellable *
+bus_invocation_get_cancellable (GDBusMethodInvocation *invocation)
+{
+    struct bus_invocation_cancel *cancel;
+    GDBusConnection *connection;
+    const gchar *sender;
+
+    G_LOCK (bus_invocation_cancel);
+    cancel = g_object_get_qdata (G_OBJECT (invocation), bus_invocation_cancel_quark ());
+    if (cancel == NULL) {
+        cancel = g_new0 (struct bus_invocation_cancel, 1);
+        cancel->cancellable = g_cancellable_new ();
+        connection = g_dbus_method_invocation_get_connection (invocation);
+        sender = g_dbus_method_invocation_get_sender (invocation);
+        if (connection != NULL && sender != NULL) {
+            cancel->connection = g_object_ref (connection);
+            cancel->watch_id = bus_peer_watch_full (connection, sender, bus_invocation_sender_vanished_cb,
+                                                    g_object_ref (cancel->cancellable), g_object_unref);
+        }
+        g_object_set_qdata_full (G_OBJECT (invocation), bus_invocation_cancel_quark (), cancel,
+                                 (GDestroyNotify)bus_invocation_cancel_free);
+    }
+    G_UNLOCK (bus_invocation_cancel);
+    return cancel->cancellable;
+}
+
+/* Joining of identical requests. A setter that is idempotent marks its
+ * invocation joinable. Once authorized, the invocation is registered with
+ * the scope (the work queue) it will run on: if the request last registered
+ * in that scope is identical and has not finished yet, the new invocation
+ * follows it instead of repeating the work. Since a scope runs its requests
+ * in registration order, nothing else can run between the two. A follower
+ * is answered with success if its leader succeeded, and otherwise carries
+ * out the request itself.
+ *
+ * Only the work is shared, not the authorization: every invocation is
+ * authorized on its own before it is registered, since callers may differ
+ * in what they are allowed to do. A burst of identical calls therefore
+ * still costs one polkit check each, unless the polkit cache or local
+ * authorization answers them. */
+struct bus_join_record {
+    gint refcount;
+    gchar *key;
+    gconstpointer scope;
+    gboolean done;
+    gboolean succeeded;
+};
+
+struct bus_invocation_join {
+    struct bus_join_record *record; /* NULL until authorized */
+    gboolean leader;
+};
+
+static GHashTable *bus_join_records = NULL; /* scope -> struct bus_join_record */
+static guint64 bus_join_count = 0;
+G_LOCK_DEFINE_STATIC (bus_join);
+
+static GQuark
+bus_invocation_join_quark (void)
+{
+    return g_quark_from_static_string ("openrc-settingsd-invocation-join");
+}
+
+/* Must be called with the bus_join lock held */
+static void
+bus_join_record_unref (struct bus_join_record *record)
+{
+    if (--record->refcount > 0)
+        return;
+    g_free (record->key);
+    g_free (record);
+}
+
+/* Must be called with the bus_join lock held; the record stops accepting
+ * followers */
+static void
+bus_join_record_close (struct bus_join_record *record)
+{
+    record->done = TRUE;
+    if (bus_join_records != NULL && g_hash_table_lookup (bus_join_records, record->scope) == record)
+        g_hash_table_remove (bus_join_records, record->scope);
+}
+
+static void
+bus_invocation_join_free (struct bus_invocation_join *join)
+{
+    G_LOCK (bus_join);
+    if (join->record != NULL) {
+        if (join->leader)
+            bus_join_record_close (join->record);
+        bus_join_record_unref (join->record);
+    }
+    G_UNLOCK (bus_join);
+    g_free (join);
+}
+
+static gchar *
+bus_invocation_join_key (GDBusMethodInvocation *invocation)
+{
+    gchar *params, *key;
+
+    params = g_variant_print (g_dbus_method_invocation_get_parameters (invocation), FALSE);
+    key = g_strdup_printf ("%s %s.%s%s",
+                           g_dbus_method_invocation_get_object_path (invocation),
+                           g_dbus_method_invocation_get_interface_name (invocation),
+                           g_dbus_method_invocation_get_method_name (invocation),
+                           params);
+    g_free (params);
+    return key;
+}
+
+/* Allows invocation to be joined to an identical request; call before
+ * authorizing it */
+void
+bus_invocation_set_joinable (GDBusMethodInvocation *invocation)
+{
+    g_object_set_qdata_full (G_OBJECT (invocation), bus_invocation_join_quark (),
+                             g_new0 (struct bus_invocation_join, 1),
+                             (GDestroyNotify)bus_invocation_join_free);
+}
+
+/* Registers an authorized invocation that is about to be queued on scope */
+void
+bus_invocation_join (GDBusMethodInvocation *invocation,
+                     gconstpointer scope)
+{
+    struct bus_invocation_join *join;
+    struct bus_join_record *record;
+    gchar *key = NULL;
+
+    join = g_object_get_qdata (G_OBJECT (invocation), bus_invocation_join_quark ());
+    if (join != NULL)
+        key = bus_invocation_join_key (invocation);
+
+    G_LOCK (bus_join);
+    if (bus_join_records == NULL)
+        bus_join_records = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)bus_join_record_unref);
+    record = g_hash_table_lookup (bus_join_records, scope);
+    if (join == NULL) {
+        /* Anything else on the scope ends the chance to join */
+        if (record != NULL)
+            g_hash_table_remove (bus_join_records, scope);
+    } else if (record != NULL && !record->done && g_strcmp0 (record->key, key) == 0) {
+        g_debug ("Joining %s from %s to an identical request in progress",
+                 g_dbus_method_invocation_get_method_name (invocation),
+                 g_dbus_method_invocation_get_sender (invocation));
+        record->refcount++;
+        join->record = record;
+        bus_join_count++;
+    } else {
+        record = g_new0 (struct bus_join_record, 1);
+        record->refcount = 2; /* one for the table, one for the leader */
+        record->key = key;
+        record->scope = scope;
+        key = NULL;
+        g_hash_table_replace (bus_join_records, (gpointer)scope, record);
+        join->record = record;
+        join->leader = TRUE;
+    }
+    G_UNLOCK (bus_join);
+    g_free (key);
+}
+
+/* Records that a leader has completed successfully; call just before
+ * replying to it */
+void
+bus_invocation_set_succeeded (GDBusMethodInvocation *invocation)
+{
+    struct bus_invocation_join *join;
+
+    join = g_object_get_qdata (G_OBJECT (invocation), bus_invocation_join_quark ());
+    if (join == NULL || !join->leader || join->record == NULL)
+        return;
+
+    G_LOCK (bus_join);
+    join->record->succeeded = TRUE;
+    bus_join_record_close (join->record);
+    G_UNLOCK (bus_join);
+}
+
+/* TRUE if invocation followed an identical request that succeeded, in which
+ * case the caller should simply complete it */
+gboolean
+bus_invocation_joined_succeeded (GDBusMethodInvocation *invocation)
+{
+    struct bus_invocation_join *join;
+    gboolean ret = FALSE;
+
+    join = g_object_get_qdata (G_OBJECT (invocation), bus_invocation_join_quark ());
+    if (join == NULL || join->leader || join->record == NULL)
+        return FALSE;
+
+    G_LOCK (bus_join);
+    ret = join->record->done && join->record->succeeded;
+    G_UNLOCK (bus_join);
+    return ret;
+}
+
+guint64
+bus_invocation_join_count (void)
+{
+    guint64 ret;
+
+    G_LOCK (bus_join);
+    ret = bus_join_count;
+    G_UNLOCK (bus_join);
+    return ret;
+}
+
+/* Pre-authorization argument check: if valid is FALSE, replies to invocation
+ * with InvalidArgs so that malformed calls never reach polkit. Returns valid */
+gboolean
+bus_invocation_check_args (GDBusMethodInvocation *invocation,
+                           gboolean valid,
+                           const gchar *format,
+                           ...)
+{
+    va_list ap;
+    gchar *message;
+
+    if (valid)
+        return TRUE;
+
+    va_start (ap, format);
+    message = g_strdup_vprintf (format, ap);
+    va_end (ap);
+    g_dbus_method_invocation_return_dbus_error (invocation, DBUS_ERROR_INVALID_ARGS, message);
+    g_free (message);
+    return FALSE;
+}
+
+/* TRUE if value is NULL or valid UTF-8 free of control characters */
+gboolean
+bus_string_is_printable (const gchar *value)
+{
+    const gchar *p;
 
+    if (value == NULL)
+        return TRUE;
+    if (!g_utf8_validate (value, -1, NULL))
+        return FALSE;
+    for (p = value; *p != '\0'; p = g_utf8_next_char (p))
+        if (g_unichar_iscntrl (g_utf8_get_char (p)))
+            return FALSE;
+    return TRUE;
+}
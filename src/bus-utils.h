@@ -20,7 +20,54 @@
 #define _BUS_UTILS_H_
 
 #include <glib.h>
+#include <gio/gio.h>
 
+typedef void (*BusPeerVanishedFunc) (const gchar *unique_name,
+                                     gpointer user_data);
 
+guint
+bus_peer_watch (GDBusConnection *connection,
+                const gchar *unique_name,
+                BusPeerVanishedFunc func,
+                gpointer user_data);
+
+guint
+bus_peer_watch_full (GDBusConnection *connection,
+                     const gchar *unique_name,
+                     BusPeerVanishedFunc func,
+                     gpointer user_data,
+                     GDestroyNotify user_data_free_func);
+
+void
+bus_peer_unwatch (GDBusConnection *connection,
+                  guint watch_id);
+
+GCancellable *
+bus_invocation_get_cancellable (GDBusMethodInvocation *invocation);
+
+void
+bus_invocation_set_joinable (GDBusMethodInvocation *invocation);
+
+void
+bus_invocation_join (GDBusMethodInvocation *invocation,
+                     gconstpointer scope);
+
+void
+bus_invocation_set_succeeded (GDBusMethodInvocation *invocation);
+
+gboolean
+bus_invocation_joined_succeeded (GDBusMethodInvocation *invocation);
+
+guint64
+bus_invocation_join_count (void);
+
+gboolean
+bus_invocation_check_args (GDBusMethodInvocation *invocation,
+                           gboolean valid,
+                           const gchar *format,
+                           ...) G_GNUC_PRINTF (3, 4);
+
+gboolean
+bus_string_is_printable (const gchar *value);
 
 #endif
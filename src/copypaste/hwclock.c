@@ -59,13 +59,11 @@ static int rtc_open(int flags) {
 
         for (;;) {
                 char *p, *v;
-                struct dirent buf, *de;
+                struct dirent *de;
                 int r;
 
-                r = readdir_r(d, &buf, &de);
-                if (r != 0)
-                        goto fallback;
-
+                /* The end of the directory and errors both fall back */
+                de = readdir(d);
                 if (!de)
                         goto fallback;
 
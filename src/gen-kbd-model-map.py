@@ -0,0 +1,205 @@
+#!/usr/bin/env python3
+#
+#  Copyright 2012 Alexandre Rostovtsev
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 2 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program; if not, write to the Free Software
+#  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+"""Compile a kbd-model-map file into a C table.
+
+Usage: gen-kbd-model-map.py MAP-FILE OUTPUT-PREFIX
+
+Writes OUTPUT-PREFIX.c and OUTPUT-PREFIX.h. The table holds the entries in
+file order, the size and SHA-256 checksum of the file they were compiled
+from, and a minimal perfect hash from each vconsole keymap to its first
+entry. The file is parsed the same way localed parses it at runtime.
+"""
+
+import hashlib
+import os
+import sys
+
+FNV_OFFSET = 2166136261
+FNV_PRIME = 16777619
+MAX_DISPLACEMENT = 1 << 20
+
+
+def fnv1a(seed, key):
+    h = FNV_OFFSET ^ seed
+    for b in key:
+        h ^= b
+        h = (h * FNV_PRIME) & 0xffffffff
+    return h
+
+
+def parse(path, contents):
+    entries = []
+    for number, line in enumerate(contents.split(b"\n"), 1):
+        # Any ASCII whitespace separates fields, as g_ascii_isspace does
+        fields = line.split()
+        if not fields or fields[0].startswith(b"#"):
+            continue
+        if len(fields) < 5:
+            sys.exit("Failed to parse line %u in '%s'" % (number, path))
+        # "-" stands for an empty string
+        entries.append([b"" if f == b"-" else f for f in fields[:5]])
+    return entries
+
+
+def perfect_hash(keys):
+    """Hash and displace: each key goes to a bucket by fnv1a(0, key), and
+    each bucket gets the smallest seed that sends all its keys to free
+    slots by fnv1a(seed, key)."""
+    n = len(keys)
+    buckets = [[] for _ in range(n)]
+    for key in keys:
+        buckets[fnv1a(0, key) % n].append(key)
+
+    displacements = [0] * n
+    slots = [None] * n
+    for bucket in sorted(range(n), key=lambda b: -len(buckets[b])):
+        if not buckets[bucket]:
+            break
+        for seed in range(1, MAX_DISPLACEMENT):
+            taken = set(fnv1a(seed, key) % n for key in buckets[bucket])
+            if len(taken) == len(buckets[bucket]) and all(slots[s] is None for s in taken):
+                break
+        else:
+            sys.exit("Failed to find a perfect hash for %u keymaps" % n)
+        displacements[bucket] = seed
+        for key in buckets[bucket]:
+            slots[fnv1a(seed, key) % n] = key
+    return displacements, slots
+
+
+def c_string(s):
+    out = '"'
+    for b in s:
+        c = chr(b)
+        if c in '"\\':
+            out += "\\" + c
+        elif 32 <= b < 127:
+            out += c
+        else:
+            out += "\\%03o" % b
+    return out + '"'
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit(__doc__)
+    path, prefix = sys.argv[1], sys.argv[2]
+    with open(path, "rb") as f:
+        contents = f.read()
+    entries = parse(path, contents)
+
+    first = {}
+    for index, entry in enumerate(entries):
+        first.setdefault(entry[0], index)
+    keys = list(first)
+    displacements, slots = perfect_hash(keys) if keys else ([], [])
+    header = os.path.basename(prefix) + ".h"
+    guard = os.path.basename(prefix).upper().replace("-", "_") + "_H"
+
+    with open(prefix + ".h", "w") as h:
+        h.write("""/* Generated by gen-kbd-model-map.py from %s, do not edit */
+
+#ifndef %s
+#define %s
+
+#include <stddef.h>
+
+struct kbd_model_map_builtin_entry {
+    const char *vconsole_keymap;
+    const char *x11_layout;
+    const char *x11_model;
+    const char *x11_variant;
+    const char *x11_options;
+};
+
+/* The entries in file order */
+extern const struct kbd_model_map_builtin_entry kbd_model_map_builtin_entries[];
+extern const unsigned int kbd_model_map_builtin_n_entries;
+
+/* Size and lowercase hex SHA-256 checksum of the file the entries were
+ * compiled from */
+extern const size_t kbd_model_map_builtin_size;
+extern const char kbd_model_map_builtin_sha256[];
+
+/* Returns the index of the first entry for the keymap, or -1 */
+int
+kbd_model_map_builtin_lookup (const char *vconsole_keymap);
+
+#endif
+""" % (os.path.basename(path), guard, guard))
+
+    with open(prefix + ".c", "w") as c:
+        c.write("""/* Generated by gen-kbd-model-map.py from %s, do not edit */
+
+#include <string.h>
+
+#include "%s"
+
+const struct kbd_model_map_builtin_entry kbd_model_map_builtin_entries[] = {
+""" % (os.path.basename(path), header))
+        for entry in entries:
+            c.write("    { %s },\n" % ", ".join(c_string(f) for f in entry))
+        if not entries:
+            c.write("    { NULL }\n")
+        c.write("};\n\n")
+        c.write("const unsigned int kbd_model_map_builtin_n_entries = %u;\n\n" % len(entries))
+        c.write("const size_t kbd_model_map_builtin_size = %u;\n" % len(contents))
+        c.write('const char kbd_model_map_builtin_sha256[] = "%s";\n\n' % hashlib.sha256(contents).hexdigest())
+
+        c.write("static const unsigned int displacements[] = {")
+        for i, d in enumerate(displacements or [0]):
+            c.write("%s%u," % ("\n    " if i % 8 == 0 else " ", d))
+        c.write("\n};\n\n")
+        c.write("/* Index of the first entry for the keymap in each slot */\n")
+        c.write("static const int slots[] = {")
+        for i, key in enumerate(slots or [None]):
+            c.write("%s%d," % ("\n    " if i % 8 == 0 else " ", -1 if key is None else first[key]))
+        c.write("\n};\n\n")
+
+        c.write("""static unsigned int
+fnv1a (unsigned int seed,
+       const char *key)
+{
+    unsigned int h = %uU ^ seed;
+
+    for (; *key != '\\0'; key++) {
+        h ^= (unsigned char) *key;
+        h = (h * %uU) & 0xffffffffU;
+    }
+    return h;
+}
+
+int
+kbd_model_map_builtin_lookup (const char *vconsole_keymap)
+{
+    const unsigned int n = %u;
+    int index;
+
+    if (n == 0 || vconsole_keymap == NULL)
+        return -1;
+    index = slots[fnv1a (displacements[fnv1a (0, vconsole_keymap) %% n], vconsole_keymap) %% n];
+    if (index < 0 || strcmp (kbd_model_map_builtin_entries[index].vconsole_keymap, vconsole_keymap) != 0)
+        return -1;
+    return index;
+}
+""" % (FNV_OFFSET, FNV_PRIME, len(keys)))
+
+
+if __name__ == "__main__":
+    main()
@@ -20,6 +20,7 @@
 */
 
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -33,6 +34,7 @@
 #include <rc.h>
 #endif
 
+#include "bus-utils.h"
 #include "hostnamed.h"
 #include "hostname1-generated.h"
 #include "main.h"
@@ -40,9 +42,6 @@
 
 #include "config.h"
 
-#define QUOTE(macro) #macro
-#define STR(macro) QUOTE(macro)
-
 struct invoked_name {
     GDBusMethodInvocation *invocation;
     gchar *name; /* newly allocated */
@@ -53,10 +52,14 @@ gboolean read_only = FALSE;
 
 static OpenrcSettingsdHostnamedHostname1 *hostname1 = NULL;
 
+/* Each resource has its own work queue, so that the blocking part of its
+ * setters runs off the main loop, one call at a time */
 static gchar *hostname = NULL;
+static WorkQueue *hostname_queue = NULL;
 G_LOCK_DEFINE_STATIC (hostname);
 static gchar *static_hostname = NULL;
 static GFile *static_hostname_file = NULL;
+static WorkQueue *static_hostname_queue = NULL;
 G_LOCK_DEFINE_STATIC (static_hostname);
 static gchar *pretty_hostname = NULL;
 static gchar *icon_name = NULL;
@@ -64,16 +67,40 @@ static gchar *chassis = NULL;
 static gchar *deployment = NULL;
 static gchar *location = NULL;
 static GFile *machine_info_file = NULL;
+static guint machine_info_commit_delay = 0; /* in ms */
+static WorkQueue *machine_info_queue = NULL;
+/* machine_info guards the pending setters and the commit source, and is
+ * only held briefly since the main loop takes it; machine_info_file guards
+ * /etc/machine-info and the values above for the length of a commit */
 G_LOCK_DEFINE_STATIC (machine_info);
+G_LOCK_DEFINE_STATIC (machine_info_file);
+
+/* TRUE if value is made of letters, digits, '_', '.' and '-' only */
+static gboolean
+word_chars_are_valid (const gchar *value)
+{
+    const gchar *p;
+
+    for (p = value; *p != '\0'; p++)
+        if (!g_ascii_isalnum (*p) && *p != '_' && *p != '.' && *p != '-')
+            return FALSE;
+    return TRUE;
+}
 
 static gboolean
 hostname_is_valid (const gchar *name)
 {
-    if (name == NULL)
+    if (name == NULL || *name == '\0' || strlen (name) > HOST_NAME_MAX)
         return FALSE;
 
-    return g_regex_match_simple ("^[a-zA-Z0-9_.-]{1," STR(HOST_NAME_MAX) "}$",
-                                 name, G_REGEX_MULTILINE, 0);
+    return word_chars_are_valid (name);
+}
+
+/* An empty name asks for the default, so only reject non-empty invalid ones */
+static gboolean
+hostname_arg_is_valid (const gchar *name)
+{
+    return name == NULL || *name == '\0' || hostname_is_valid (name);
 }
 
 static gchar *
@@ -177,27 +204,38 @@ on_handle_set_hostname_authorized_cb (GObject *source_object,
         goto out;
     }
 
+    /* An identical request queued just before this one has done the work */
+    if (bus_invocation_joined_succeeded (data->invocation)) {
+        g_free (data->name);
+        openrc_settingsd_hostnamed_hostname1_complete_set_hostname (hostname1, data->invocation);
+        goto out;
+    }
+
     G_LOCK (hostname);
-    /* Don't allow an empty or invalid hostname */
+    /* Don't allow an empty or invalid hostname. static_hostname belongs to
+     * the static hostname queue, so only read it under its lock. */
     if (!hostname_is_valid (data->name)) {
         if (data->name != NULL)
             g_free (data->name);
 
+        G_LOCK (static_hostname);
         if (hostname_is_valid (static_hostname))
             data->name = g_strdup (static_hostname);
         else
             data->name = g_strdup ("localhost");
+        G_UNLOCK (static_hostname);
     }
     if (sethostname (data->name, strlen(data->name))) {
         int errsv = errno;
         g_dbus_method_invocation_return_dbus_error (data->invocation,
                                                     DBUS_ERROR_FAILED,
-                                                    strerror (errsv));
+                                                    g_strerror (errsv));
         G_UNLOCK (hostname);
         goto out;
     }
     g_free (hostname);
     hostname = data->name; /* data->name is g_strdup-ed already */;
+    bus_invocation_set_succeeded (data->invocation);
     openrc_settingsd_hostnamed_hostname1_complete_set_hostname (hostname1, data->invocation);
     openrc_settingsd_hostnamed_hostname1_set_hostname (hostname1, hostname);
     G_UNLOCK (hostname);
@@ -219,12 +257,13 @@ on_handle_set_hostname (OpenrcSettingsdHostnamedHostname1 *hostname1,
         g_dbus_method_invocation_return_dbus_error (invocation,
                                                     DBUS_ERROR_NOT_SUPPORTED,
                                                     "openrc-settingsd hostnamed is in read-only mode");
-    else {
+    else if (bus_invocation_check_args (invocation, hostname_arg_is_valid (name), "Invalid hostname '%s'", name)) {
         struct invoked_name *data;
         data = g_new0 (struct invoked_name, 1);
         data->invocation = invocation;
         data->name = g_strdup (name);
-        check_polkit_async (g_dbus_method_invocation_get_sender (invocation), "org.freedesktop.hostname1.set-hostname", user_interaction, on_handle_set_hostname_authorized_cb, data);
+        bus_invocation_set_joinable (invocation);
+        check_polkit_async (invocation, "org.freedesktop.hostname1.set-hostname", user_interaction, hostname_queue, on_handle_set_hostname_authorized_cb, data);
     }
 
     return TRUE;
@@ -244,6 +283,13 @@ on_handle_set_static_hostname_authorized_cb (GObject *source_object,
         goto out;
     }
 
+    /* An identical request queued just before this one has done the work */
+    if (bus_invocation_joined_succeeded (data->invocation)) {
+        g_free (data->name);
+        openrc_settingsd_hostnamed_hostname1_complete_set_static_hostname (hostname1, data->invocation);
+        goto out;
+    }
+
     G_LOCK (static_hostname);
     /* Don't allow an empty or invalid hostname */
     if (!hostname_is_valid (data->name)) {
@@ -253,7 +299,7 @@ on_handle_set_static_hostname_authorized_cb (GObject *source_object,
         data->name = g_strdup ("localhost");
     }
 
-    if (!shell_parser_set_and_save (static_hostname_file, &err, "hostname", "HOSTNAME", data->name, NULL)) {
+    if (!shell_parser_set_and_save (static_hostname_file, bus_invocation_get_cancellable (data->invocation), &err, "hostname", "HOSTNAME", data->name, NULL)) {
         g_dbus_method_invocation_return_gerror (data->invocation, err);
         G_UNLOCK (static_hostname);
         goto out;
@@ -261,6 +307,7 @@ on_handle_set_static_hostname_authorized_cb (GObject *source_object,
 
     g_free (static_hostname);
     static_hostname = data->name; /* data->name is g_strdup-ed already */;
+    bus_invocation_set_succeeded (data->invocation);
     openrc_settingsd_hostnamed_hostname1_complete_set_static_hostname (hostname1, data->invocation);
     openrc_settingsd_hostnamed_hostname1_set_static_hostname (hostname1, static_hostname);
     G_UNLOCK (static_hostname);
@@ -282,307 +329,256 @@ on_handle_set_static_hostname (OpenrcSettingsdHostnamedHostname1 *hostname1,
         g_dbus_method_invocation_return_dbus_error (invocation,
                                                     DBUS_ERROR_NOT_SUPPORTED,
                                                     "openrc-settingsd hostnamed is in read-only mode");
-    else {
+    else if (bus_invocation_check_args (invocation, hostname_arg_is_valid (name), "Invalid hostname '%s'", name)) {
         struct invoked_name *data;
         data = g_new0 (struct invoked_name, 1);
         data->invocation = invocation;
         data->name = g_strdup (name);
-        check_polkit_async (g_dbus_method_invocation_get_sender (invocation), "org.freedesktop.hostname1.set-static-hostname", user_interaction, on_handle_set_static_hostname_authorized_cb, data);
+        bus_invocation_set_joinable (invocation);
+        check_polkit_async (invocation, "org.freedesktop.hostname1.set-static-hostname", user_interaction, static_hostname_queue, on_handle_set_static_hostname_authorized_cb, data);
     }
 
     return TRUE; /* Always return TRUE to indicate signal has been handled */
 }
 
-static void
-on_handle_set_pretty_hostname_authorized_cb (GObject *source_object,
-                                             GAsyncResult *res,
-                                             gpointer user_data)
-{
-    GError *err = NULL;
-    struct invoked_name *data;
-    
-    data = (struct invoked_name *) user_data;
-    if (!check_polkit_finish (res, &err)) {
-        g_dbus_method_invocation_return_gerror (data->invocation, err);
-        goto out;
-    }
-
-    G_LOCK (machine_info);
-    /* Don't allow a null pretty hostname */
-    if (data->name == NULL)
-        data->name = g_strdup ("");
-
-    if (!shell_parser_set_and_save (machine_info_file, &err, "PRETTY_HOSTNAME", NULL, data->name, NULL)) {
-        g_dbus_method_invocation_return_gerror (data->invocation, err);
-        G_UNLOCK (machine_info);
-        goto out;
-    }
-
-    g_free (pretty_hostname);
-    pretty_hostname = data->name; /* data->name is g_strdup-ed already */
-    openrc_settingsd_hostnamed_hostname1_complete_set_pretty_hostname (hostname1, data->invocation);
-    openrc_settingsd_hostnamed_hostname1_set_pretty_hostname (hostname1, pretty_hostname);
-    G_UNLOCK (machine_info);
+/* Fields of /etc/machine-info that can be set over D-Bus */
+struct machine_info_field {
+    const gchar *variable;
+    const gchar *action_id;
+    gchar **value;
+    void (*complete) (OpenrcSettingsdHostnamedHostname1 *object, GDBusMethodInvocation *invocation);
+    void (*set_property) (OpenrcSettingsdHostnamedHostname1 *object, const gchar *value);
+    gboolean (*is_valid) (const gchar *value);
+};
 
-  out:
-    g_free (data);
-    if (err != NULL)
-        g_error_free (err);
+/* The rules below are those of systemd-hostnamed, so that any value it
+ * accepts is accepted here too */
+static gboolean
+chassis_is_valid (const gchar *value)
+{
+    static const gchar * const valid_chassis[] = {
+        "desktop", "laptop", "convertible", "server", "tablet", "handset",
+        "watch", "embedded", "vm", "container", NULL
+    };
+    const gchar * const *c;
+
+    if (value == NULL || *value == '\0')
+        return TRUE;
+    for (c = valid_chassis; *c != NULL; c++)
+        if (g_strcmp0 (*c, value) == 0)
+            return TRUE;
+    return FALSE;
 }
 
+/* An icon name must be usable as a file name */
 static gboolean
-on_handle_set_pretty_hostname (OpenrcSettingsdHostnamedHostname1 *hostname1,
-                               GDBusMethodInvocation *invocation,
-                               const gchar *name,
-                               const gboolean user_interaction,
-                               gpointer user_data)
+icon_name_is_valid (const gchar *value)
 {
-    if (read_only)
-        g_dbus_method_invocation_return_dbus_error (invocation,
-                                                    DBUS_ERROR_NOT_SUPPORTED,
-                                                    "openrc-settingsd hostnamed is in read-only mode");
-    else {
-        struct invoked_name *data;
-        data = g_new0 (struct invoked_name, 1);
-        data->invocation = invocation;
-        data->name = g_strdup (name);
-        check_polkit_async (g_dbus_method_invocation_get_sender (invocation), "org.freedesktop.hostname1.set-static-hostname", user_interaction, on_handle_set_pretty_hostname_authorized_cb, data);
-    }
-
-    return TRUE; /* Always return TRUE to indicate signal has been handled */
+    if (value == NULL || *value == '\0')
+        return TRUE;
+    return strlen (value) <= NAME_MAX && strchr (value, '/') == NULL &&
+           strcmp (value, ".") != 0 && strcmp (value, "..") != 0 &&
+           bus_string_is_printable (value);
 }
 
-static void
-on_handle_set_icon_name_authorized_cb (GObject *source_object,
-                                       GAsyncResult *res,
-                                       gpointer user_data)
+/* Letters, digits, '-', '.' and ':' */
+static gboolean
+deployment_is_valid (const gchar *value)
 {
-    GError *err = NULL;
-    struct invoked_name *data;
-    
-    data = (struct invoked_name *) user_data;
-    if (!check_polkit_finish (res, &err)) {
-        g_dbus_method_invocation_return_gerror (data->invocation, err);
-        goto out;
-    }
+    const gchar *p;
 
-    G_LOCK (machine_info);
-    /* Don't allow a null icon name */
-    if (data->name == NULL)
-        data->name = g_strdup ("");
+    if (value == NULL)
+        return TRUE;
+    for (p = value; *p != '\0'; p++)
+        if (!g_ascii_isalnum (*p) && strchr ("-.:", *p) == NULL)
+            return FALSE;
+    return TRUE;
+}
 
-    if (!shell_parser_set_and_save (machine_info_file, &err, "ICON_NAME", NULL, data->name, NULL)) {
-        g_dbus_method_invocation_return_gerror (data->invocation, err);
-        G_UNLOCK (machine_info);
-        goto out;
-    }
+enum {
+    MACHINE_INFO_PRETTY_HOSTNAME,
+    MACHINE_INFO_ICON_NAME,
+    MACHINE_INFO_CHASSIS,
+    MACHINE_INFO_DEPLOYMENT,
+    MACHINE_INFO_LOCATION,
+};
 
-    g_free (icon_name);
-    icon_name = data->name; /* data->name is g_strdup-ed already */
-    openrc_settingsd_hostnamed_hostname1_complete_set_icon_name (hostname1, data->invocation);
-    openrc_settingsd_hostnamed_hostname1_set_icon_name (hostname1, icon_name);
-    G_UNLOCK (machine_info);
+static const struct machine_info_field machine_info_fields[] = {
+    [MACHINE_INFO_PRETTY_HOSTNAME] = { "PRETTY_HOSTNAME", "org.freedesktop.hostname1.set-static-hostname", &pretty_hostname,
+        openrc_settingsd_hostnamed_hostname1_complete_set_pretty_hostname, openrc_settingsd_hostnamed_hostname1_set_pretty_hostname, bus_string_is_printable },
+    [MACHINE_INFO_ICON_NAME] = { "ICON_NAME", "org.freedesktop.hostname1.set-machine-info", &icon_name,
+        openrc_settingsd_hostnamed_hostname1_complete_set_icon_name, openrc_settingsd_hostnamed_hostname1_set_icon_name, icon_name_is_valid },
+    [MACHINE_INFO_CHASSIS] = { "CHASSIS", "org.freedesktop.hostname1.set-machine-info", &chassis,
+        openrc_settingsd_hostnamed_hostname1_complete_set_chassis, openrc_settingsd_hostnamed_hostname1_set_chassis, chassis_is_valid },
+    [MACHINE_INFO_DEPLOYMENT] = { "DEPLOYMENT", "org.freedesktop.hostname1.set-machine-info", &deployment,
+        openrc_settingsd_hostnamed_hostname1_complete_set_deployment, openrc_settingsd_hostnamed_hostname1_set_deployment, deployment_is_valid },
+    [MACHINE_INFO_LOCATION] = { "LOCATION", "org.freedesktop.hostname1.set-machine-info", &location,
+        openrc_settingsd_hostnamed_hostname1_complete_set_location, openrc_settingsd_hostnamed_hostname1_set_location, bus_string_is_printable },
+};
 
-  out:
-    g_free (data);
-    if (err != NULL)
-        g_error_free (err);
-}
+struct invoked_machine_info {
+    GDBusMethodInvocation *invocation;
+    const struct machine_info_field *field;
+    gchar *value; /* newly allocated */
+};
 
-static gboolean
-on_handle_set_icon_name (OpenrcSettingsdHostnamedHostname1 *hostname1,
-                         GDBusMethodInvocation *invocation,
-                         const gchar *name,
-                         const gboolean user_interaction,
-                         gpointer user_data)
-{
-    if (read_only)
-        g_dbus_method_invocation_return_dbus_error (invocation,
-                                                    DBUS_ERROR_NOT_SUPPORTED,
-                                                    "openrc-settingsd hostnamed is in read-only mode");
-    else {
-        struct invoked_name *data;
-        data = g_new0 (struct invoked_name, 1);
-        data->invocation = invocation;
-        data->name = g_strdup (name);
-        check_polkit_async (g_dbus_method_invocation_get_sender (invocation), "org.freedesktop.hostname1.set-machine-info", user_interaction, on_handle_set_icon_name_authorized_cb, data);
-    }
+/* Authorized machine-info setters waiting for the next group commit */
+static GList *machine_info_pending = NULL;
+static guint machine_info_commit_id = 0;
 
-    return TRUE; /* Always return TRUE to indicate signal has been handled */
+static void
+invoked_machine_info_free (struct invoked_machine_info *data)
+{
+    if (data == NULL)
+        return;
+    g_free (data->value);
+    g_free (data);
 }
 
+/* Applies all pending machine-info setters with one parse and one save of
+ * /etc/machine-info, then completes all of their invocations; runs on
+ * machine_info_queue */
 static void
-on_handle_set_chassis_authorized_cb (GObject *source_object,
-                                     GAsyncResult *res,
-                                     gpointer user_data)
+machine_info_commit (gpointer data,
+                     gpointer unused)
 {
     GError *err = NULL;
-    struct invoked_name *data;
-
-    data = (struct invoked_name *) user_data;
-    if (!check_polkit_finish (res, &err)) {
-        g_dbus_method_invocation_return_gerror (data->invocation, err);
-        goto out;
-    }
+    ShellParser *parser = NULL;
+    GList *pending, *curr, *next;
 
     G_LOCK (machine_info);
-    /* Don't allow a null chassis */
-    if (data->name == NULL)
-        data->name = g_strdup ("");
+    pending = machine_info_pending;
+    machine_info_pending = NULL;
+    G_UNLOCK (machine_info);
 
-    if (!shell_parser_set_and_save (machine_info_file, &err, "CHASSIS", NULL, data->name, NULL)) {
-        g_dbus_method_invocation_return_gerror (data->invocation, err);
-        G_UNLOCK (machine_info);
-        goto out;
+    /* Drop setters whose callers have disconnected in the meantime */
+    for (curr = pending; curr != NULL; curr = next) {
+        struct invoked_machine_info *data = (struct invoked_machine_info *) curr->data;
+
+        next = curr->next;
+        if (g_cancellable_set_error_if_cancelled (bus_invocation_get_cancellable (data->invocation), &err)) {
+            g_dbus_method_invocation_return_gerror (data->invocation, err);
+            g_clear_error (&err);
+            invoked_machine_info_free (data);
+            pending = g_list_delete_link (pending, curr);
+        }
     }
+    if (pending == NULL)
+        goto out;
 
-    g_free (chassis);
-    chassis = data->name; /* data->name is g_strdup-ed already */
-    openrc_settingsd_hostnamed_hostname1_complete_set_chassis (hostname1, data->invocation);
-    openrc_settingsd_hostnamed_hostname1_set_chassis (hostname1, chassis);
-    G_UNLOCK (machine_info);
+    g_debug ("Committing %u machine-info updates", g_list_length (pending));
+    G_LOCK (machine_info_file);
+    if ((parser = shell_parser_new (machine_info_file, &err)) == NULL)
+        goto fail;
 
-  out:
-    g_free (data);
-    if (err != NULL)
-        g_error_free (err);
-}
+    /* Later setters of the same field win, as they would if saved one by one */
+    for (curr = pending; curr != NULL; curr = curr->next) {
+        struct invoked_machine_info *data = (struct invoked_machine_info *) curr->data;
 
-static gboolean
-on_handle_set_chassis (OpenrcSettingsdHostnamedHostname1 *hostname1,
-                       GDBusMethodInvocation *invocation,
-                       const gchar *name,
-                       const gboolean user_interaction,
-                       gpointer user_data)
-{
-    if (read_only)
-        g_dbus_method_invocation_return_dbus_error (invocation,
-                                                    DBUS_ERROR_NOT_SUPPORTED,
-                                                    "openrc-settingsd hostnamed is in read-only mode");
-    else {
-        struct invoked_name *data;
-        data = g_new0 (struct invoked_name, 1);
-        data->invocation = invocation;
-        data->name = g_strdup (name);
-        check_polkit_async (g_dbus_method_invocation_get_sender (invocation), "org.freedesktop.hostname1.set-machine-info", user_interaction, on_handle_set_chassis_authorized_cb, data);
+        if (!shell_parser_set_variable (parser, data->field->variable, data->value, TRUE)) {
+            g_propagate_error (&err,
+                    g_error_new (G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                                "Unable to set %s in '%s'", data->field->variable, parser->filename));
+            goto fail;
+        }
     }
 
-    return TRUE; /* Always return TRUE to indicate signal has been handled */
-}
+    if (!shell_parser_save (parser, NULL, &err))
+        goto fail;
 
-static void
-on_handle_set_deployment_authorized_cb (GObject *source_object,
-                                        GAsyncResult *res,
-                                        gpointer user_data)
-{
-    GError *err = NULL;
-    struct invoked_name *data;
+    for (curr = pending; curr != NULL; curr = curr->next) {
+        struct invoked_machine_info *data = (struct invoked_machine_info *) curr->data;
 
-    data = (struct invoked_name *) user_data;
-    if (!check_polkit_finish (res, &err)) {
-        g_dbus_method_invocation_return_gerror (data->invocation, err);
-        goto out;
+        g_free (*data->field->value);
+        *data->field->value = data->value; /* data->value is g_strdup-ed already */
+        data->value = NULL;
+        data->field->complete (hostname1, data->invocation);
+        data->field->set_property (hostname1, *data->field->value);
     }
+    G_UNLOCK (machine_info_file);
+    goto out;
 
-    G_LOCK (machine_info);
-    /* Don't allow a null deployment */
-    if (data->name == NULL)
-        data->name = g_strdup ("");
+  fail:
+    G_UNLOCK (machine_info_file);
+    for (curr = pending; curr != NULL; curr = curr->next) {
+        struct invoked_machine_info *data = (struct invoked_machine_info *) curr->data;
 
-    if (!shell_parser_set_and_save (machine_info_file, &err, "DEPLOYMENT", NULL, data->name, NULL)) {
         g_dbus_method_invocation_return_gerror (data->invocation, err);
-        G_UNLOCK (machine_info);
-        goto out;
     }
 
-    g_free (deployment);
-    deployment = data->name; /* data->name is g_strdup-ed already */
-    openrc_settingsd_hostnamed_hostname1_complete_set_deployment (hostname1, data->invocation);
-    openrc_settingsd_hostnamed_hostname1_set_deployment (hostname1, deployment);
-    G_UNLOCK (machine_info);
-
   out:
-    g_free (data);
+    shell_parser_free (parser);
+    g_list_free_full (pending, (GDestroyNotify)invoked_machine_info_free);
     if (err != NULL)
         g_error_free (err);
 }
 
 static gboolean
-on_handle_set_deployment (OpenrcSettingsdHostnamedHostname1 *hostname1,
-                          GDBusMethodInvocation *invocation,
-                          const gchar *name,
-                          const gboolean user_interaction,
-                          gpointer user_data)
+machine_info_commit_timeout_cb (gpointer user_data)
 {
-    if (read_only)
-        g_dbus_method_invocation_return_dbus_error (invocation,
-                                                    DBUS_ERROR_NOT_SUPPORTED,
-                                                    "openrc-settingsd hostnamed is in read-only mode");
-    else {
-        struct invoked_name *data;
-        data = g_new0 (struct invoked_name, 1);
-        data->invocation = invocation;
-        data->name = g_strdup (name);
-        check_polkit_async (g_dbus_method_invocation_get_sender (invocation), "org.freedesktop.hostname1.set-machine-info", user_interaction, on_handle_set_deployment_authorized_cb, data);
-    }
-
-    return TRUE; /* Always return TRUE to indicate signal has been handled */
+    G_LOCK (machine_info);
+    machine_info_commit_id = 0;
+    G_UNLOCK (machine_info);
+    work_queue_push (machine_info_queue, machine_info_commit, NULL);
+    return FALSE;
 }
 
 static void
-on_handle_set_location_authorized_cb (GObject *source_object,
-                                      GAsyncResult *res,
-                                      gpointer user_data)
+on_handle_set_machine_info_authorized_cb (GObject *source_object,
+                                          GAsyncResult *res,
+                                          gpointer user_data)
 {
     GError *err = NULL;
-    struct invoked_name *data;
+    struct invoked_machine_info *data;
 
-    data = (struct invoked_name *) user_data;
+    data = (struct invoked_machine_info *) user_data;
     if (!check_polkit_finish (res, &err)) {
         g_dbus_method_invocation_return_gerror (data->invocation, err);
-        goto out;
+        invoked_machine_info_free (data);
+        g_error_free (err);
+        return;
     }
 
-    G_LOCK (machine_info);
-    /* Don't allow a null location */
-    if (data->name == NULL)
-        data->name = g_strdup ("");
+    /* Don't allow a null value */
+    if (data->value == NULL)
+        data->value = g_strdup ("");
 
-    if (!shell_parser_set_and_save (machine_info_file, &err, "LOCATION", NULL, data->name, NULL)) {
-        g_dbus_method_invocation_return_gerror (data->invocation, err);
-        G_UNLOCK (machine_info);
-        goto out;
+    /* Setters arriving within the commit window share one write; if others
+     * are already pending, a commit that will pick this one up is either
+     * scheduled or queued */
+    G_LOCK (machine_info);
+    if (machine_info_pending == NULL) {
+        if (machine_info_commit_delay > 0)
+            machine_info_commit_id = g_timeout_add (machine_info_commit_delay, machine_info_commit_timeout_cb, NULL);
+        else
+            machine_info_commit_id = g_idle_add (machine_info_commit_timeout_cb, NULL);
     }
-
-    g_free (location);
-    location = data->name; /* data->name is g_strdup-ed already */
-    openrc_settingsd_hostnamed_hostname1_complete_set_location (hostname1, data->invocation);
-    openrc_settingsd_hostnamed_hostname1_set_location (hostname1, location);
+    machine_info_pending = g_list_append (machine_info_pending, data);
     G_UNLOCK (machine_info);
-
-  out:
-    g_free (data);
-    if (err != NULL)
-        g_error_free (err);
 }
 
+/* Handles SetPrettyHostname, SetIconName, SetChassis, SetDeployment and
+ * SetLocation; user_data is the machine_info_field being set */
 static gboolean
-on_handle_set_location (OpenrcSettingsdHostnamedHostname1 *hostname1,
-                        GDBusMethodInvocation *invocation,
-                        const gchar *name,
-                        const gboolean user_interaction,
-                        gpointer user_data)
+on_handle_set_machine_info (OpenrcSettingsdHostnamedHostname1 *hostname1,
+                            GDBusMethodInvocation *invocation,
+                            const gchar *name,
+                            const gboolean user_interaction,
+                            gpointer user_data)
 {
+    const struct machine_info_field *field = (const struct machine_info_field *) user_data;
+
     if (read_only)
         g_dbus_method_invocation_return_dbus_error (invocation,
                                                     DBUS_ERROR_NOT_SUPPORTED,
                                                     "openrc-settingsd hostnamed is in read-only mode");
-    else {
-        struct invoked_name *data;
-        data = g_new0 (struct invoked_name, 1);
+    else if (bus_invocation_check_args (invocation, field->is_valid (name), "Invalid %s value '%s'", field->variable, name)) {
+        struct invoked_machine_info *data;
+        data = g_new0 (struct invoked_machine_info, 1);
         data->invocation = invocation;
-        data->name = g_strdup (name);
-        check_polkit_async (g_dbus_method_invocation_get_sender (invocation), "org.freedesktop.hostname1.set-machine-info", user_interaction, on_handle_set_location_authorized_cb, data);
+        data->field = field;
+        data->value = g_strdup (name);
+        check_polkit_async (invocation, field->action_id, user_interaction, NULL, on_handle_set_machine_info_authorized_cb, data);
     }
 
     return TRUE; /* Always return TRUE to indicate signal has been handled */
@@ -593,7 +589,6 @@ on_bus_acquired (GDBusConnection *connection,
                  const gchar     *bus_name,
                  gpointer         user_data)
 {
-    gchar *name;
     GError *err = NULL;
 
     g_debug ("Acquired a message bus connection");
@@ -610,11 +605,11 @@ on_bus_acquired (GDBusConnection *connection,
 
     g_signal_connect (hostname1, "handle-set-hostname", G_CALLBACK (on_handle_set_hostname), NULL);
     g_signal_connect (hostname1, "handle-set-static-hostname", G_CALLBACK (on_handle_set_static_hostname), NULL);
-    g_signal_connect (hostname1, "handle-set-pretty-hostname", G_CALLBACK (on_handle_set_pretty_hostname), NULL);
-    g_signal_connect (hostname1, "handle-set-icon-name", G_CALLBACK (on_handle_set_icon_name), NULL);
-    g_signal_connect (hostname1, "handle-set-chassis", G_CALLBACK (on_handle_set_chassis), NULL);
-    g_signal_connect (hostname1, "handle-set-deployment", G_CALLBACK (on_handle_set_deployment), NULL);
-    g_signal_connect (hostname1, "handle-set-location", G_CALLBACK (on_handle_set_location), NULL);
+    g_signal_connect (hostname1, "handle-set-pretty-hostname", G_CALLBACK (on_handle_set_machine_info), (gpointer) &machine_info_fields[MACHINE_INFO_PRETTY_HOSTNAME]);
+    g_signal_connect (hostname1, "handle-set-icon-name", G_CALLBACK (on_handle_set_machine_info), (gpointer) &machine_info_fields[MACHINE_INFO_ICON_NAME]);
+    g_signal_connect (hostname1, "handle-set-chassis", G_CALLBACK (on_handle_set_machine_info), (gpointer) &machine_info_fields[MACHINE_INFO_CHASSIS]);
+    g_signal_connect (hostname1, "handle-set-deployment", G_CALLBACK (on_handle_set_machine_info), (gpointer) &machine_info_fields[MACHINE_INFO_DEPLOYMENT]);
+    g_signal_connect (hostname1, "handle-set-location", G_CALLBACK (on_handle_set_machine_info), (gpointer) &machine_info_fields[MACHINE_INFO_LOCATION]);
 
     if (!g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (hostname1),
                                            connection,
@@ -651,7 +646,8 @@ on_name_lost (GDBusConnection *connection,
 /* Public functions */
 
 void
-hostnamed_init (gboolean _read_only)
+hostnamed_init (gboolean _read_only,
+                guint _machine_info_commit_delay)
 {
     GError *err = NULL;
 
@@ -725,6 +721,10 @@ hostnamed_init (gboolean _read_only)
     }
 
     read_only = _read_only;
+    machine_info_commit_delay = _machine_info_commit_delay;
+    hostname_queue = work_queue_new ("hostname");
+    static_hostname_queue = work_queue_new ("static hostname");
+    machine_info_queue = work_queue_new ("machine-info");
 
     bus_id = g_bus_own_name (G_BUS_TYPE_SYSTEM,
                              "org.freedesktop.hostname1",
@@ -739,9 +739,23 @@ hostnamed_init (gboolean _read_only)
 void
 hostnamed_destroy (void)
 {
+    guint commit_id;
+
     g_bus_unown_name (bus_id);
     bus_id = 0;
     read_only = FALSE;
+    G_LOCK (machine_info);
+    commit_id = machine_info_commit_id;
+    machine_info_commit_id = 0;
+    G_UNLOCK (machine_info);
+    if (commit_id != 0) {
+        /* Don't lose setters that were already accepted */
+        g_source_remove (commit_id);
+        machine_info_commit_timeout_cb (NULL);
+    }
+    work_queue_free (hostname_queue);
+    work_queue_free (static_hostname_queue);
+    work_queue_free (machine_info_queue);
     g_free (hostname);
     g_free (static_hostname);
     g_free (pretty_hostname);
@@ -38,7 +38,8 @@ hostnamed_on_name_lost (GDBusConnection *connection,
               gpointer         user_data);
 
 void
-hostnamed_init (gboolean read_only);
+hostnamed_init (gboolean read_only,
+                guint machine_info_commit_delay);
 
 void
 hostnamed_destroy (void);
@@ -19,13 +19,16 @@
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
 
 #include <dbus/dbus-protocol.h>
 #include <glib.h>
 #include <gio/gio.h>
 
+#include "bus-utils.h"
 #include "localed.h"
 #include "locale1-generated.h"
+#include "locale1-ext-generated.h"
 #include "main.h"
 #include "utils.h"
 
@@ -37,6 +40,7 @@ static guint bus_id = 0;
 static gboolean read_only = FALSE;
 
 static OpenrcSettingsdLocaledLocale1 *locale1 = NULL;
+static OpenrcSettingsdExtLocale1 *locale1_ext = NULL;
 
 static gchar *locale_variables[] = {
     "LANG", "LC_CTYPE", "LC_NUMERIC", "LC_TIME", "LC_COLLATE", "LC_MONETARY", "LC_MESSAGES", "LC_PAPER", "LC_NAME", "LC_ADDRESS", "LC_TELEPHONE", "LC_MEASUREMENT", "LC_IDENTIFICATION", NULL
@@ -44,8 +48,21 @@ static gchar *locale_variables[] = {
 
 static gchar **locale = NULL; /* Expected format is { "LANG=foo", "LC_TIME=bar", NULL } */
 static GFile *locale_file = NULL;
+static WorkQueue *locale_queue = NULL;
 G_LOCK_DEFINE_STATIC (locale);
 
+/* env-update runs in the background, one run at a time. SetLocale calls
+ * whose change arrives while it runs wait for a single follow-up run */
+static gboolean env_update_running = FALSE;
+static GSList *env_update_waiters = NULL; /* invocations the current run covers */
+static GSList *env_update_queued = NULL; /* invocations for the follow-up run */
+G_LOCK_DEFINE_STATIC (env_update);
+
+/* SetVConsoleKeyboard and SetX11Keyboard may each update both the keymaps
+ * and the xorg.conf.d file, so they share one work queue. Code that needs
+ * both the keymaps and xorg_conf locks takes keymaps first. */
+static WorkQueue *keyboard_queue = NULL;
+
 static gchar *vconsole_keymap = NULL;
 static gchar *vconsole_keymap_toggle = NULL;
 static GFile *keymaps_file = NULL;
@@ -55,6 +72,7 @@ static gchar *x11_layout = NULL;
 static gchar *x11_model = NULL;
 static gchar *x11_variant = NULL;
 static gchar *x11_options = NULL;
+static GFile *x11_confd_dir = NULL;
 static GFile *x11_gentoo_file = NULL;
 static GFile *x11_systemd_file = NULL;
 G_LOCK_DEFINE_STATIC (xorg_conf);
@@ -63,236 +81,55 @@ G_LOCK_DEFINE_STATIC (xorg_conf);
 
 static GFile *kbd_model_map_file = NULL;
 
-GRegex *kbd_model_map_line_comment_re = NULL;
-GRegex *kbd_model_map_line_re = NULL;
-
-struct kbd_model_map_entry {
-    gchar *vconsole_keymap;
-    gchar *x11_layout;
-    gchar *x11_model;
-    gchar *x11_variant;
-    gchar *x11_options;
-};
-
-static void
-kbd_model_map_regex_destroy ()
-{
-    if (kbd_model_map_line_comment_re != NULL) {
-        g_regex_unref (kbd_model_map_line_comment_re);
-        kbd_model_map_line_comment_re = NULL;
-    }
-    if (kbd_model_map_line_re != NULL) {
-        g_regex_unref (kbd_model_map_line_re);
-        kbd_model_map_line_re = NULL;
-    }
-}
-
-static void
-kbd_model_map_regex_init ()
-{
-    if (kbd_model_map_line_comment_re == NULL) {
-        kbd_model_map_line_comment_re = g_regex_new ("^\\s*(?:#.*)?$", G_REGEX_ANCHORED, 0, NULL);
-        g_assert (kbd_model_map_line_comment_re != NULL);
-    }
-    if (kbd_model_map_line_re == NULL) {
-        kbd_model_map_line_re = g_regex_new ("^\\s*(\\S+)\\s+(\\S+)\\s+(\\S+)\\s+(\\S+)\\s+(\\S+)", G_REGEX_ANCHORED, 0, NULL);
-        g_assert (kbd_model_map_line_re != NULL);
-    }
-}
+static struct kbd_model_map *kbd_model_map = NULL;
+G_LOCK_DEFINE_STATIC (kbd_model_map);
 
-static gboolean
-kbd_model_map_entry_matches_vconsole (const struct kbd_model_map_entry *entry,
-                                      const gchar *vconsole_keymap)
+/* Returns a reference to the current map, reloading it if the file has
+ * changed since it was loaded. The file is stat'ed and parsed without the
+ * lock, which only guards comparing identities and swapping the pointer, so
+ * that a reload does not hold up callers that can use the current map. */
+static struct kbd_model_map *
+kbd_model_map_get (GError **error)
 {
-    return !g_strcmp0 (vconsole_keymap, entry->vconsole_keymap);
-}
-
-static gboolean
-matches_delimeted (const gchar *left,
-                   const gchar *right,
-                   const gchar *delimeter,
-                   unsigned int *failure_score)
-{
-    gboolean ret = FALSE;
-    gchar **leftv = NULL, **rightv = NULL;
-    gchar **leftcur = NULL, **rightcur = NULL;
-
-    if (left == NULL || left[0] == 0)
-        leftv = g_new0 (gchar *, 1);
-    else
-        leftv = g_strsplit (left, delimeter, 0);
-
-    if (right == NULL || right[0] == 0)
-        rightv = g_new0 (gchar *, 1);
-    else
-        rightv = g_strsplit (right, delimeter, 0);
-
-    if (failure_score != NULL)
-        *failure_score = 0;
-
-    for (leftcur = leftv; *leftcur != NULL; leftcur++) {
-        gboolean found = FALSE;
-        for (rightcur = rightv; *rightcur != NULL; rightcur++)
-            if (!g_strcmp0 (*leftcur, *rightcur)) {
-                found = TRUE;
-                break;
-            }
-        if (found)
-            ret = TRUE;
-        else if (failure_score != NULL)
-            (*failure_score)++;
-    }
-
-    for (rightcur = rightv; *rightcur != NULL; rightcur++) {
-        gboolean found = FALSE;
-        for (leftcur = leftv; *leftcur != NULL; leftcur++)
-            if (!g_strcmp0 (*rightcur, *leftcur)) {
-                found = TRUE;
-                break;
-            }
-        if (found)
-            ret = TRUE;
-        else if (failure_score != NULL)
-            (*failure_score)++;
-    }
-
-    g_strfreev (leftv);
-    g_strfreev (rightv);
-    return ret;
-}
-
-static gboolean
-kbd_model_map_entry_matches_x11 (const struct kbd_model_map_entry *entry,
-                                 const gchar *_x11_layout,
-                                 const gchar *_x11_model,
-                                 const gchar *_x11_variant,
-                                 const gchar *_x11_options,
-                                 unsigned int *failure_score)
-{
-    unsigned int x11_layout_failures;
-    gboolean ret = FALSE;
-
-    ret = matches_delimeted (_x11_layout, entry->x11_layout, ",", &x11_layout_failures);
-    if (failure_score != NULL)
-        *failure_score = 10000 * !ret +
-                         100 * x11_layout_failures +
-                         (g_strcmp0 (_x11_model, entry->x11_model) ? 1 : 0) +
-                         10 * (g_strcmp0 (_x11_variant, entry->x11_variant) ? 1 : 0) +
-                         !matches_delimeted (_x11_options, entry->x11_options, ",", NULL);
-    return ret;
-}
-
-static void
-kbd_model_map_entry_free (struct kbd_model_map_entry *entry)
-{
-    if (entry == NULL)
-        return;
-
-    g_free (entry->vconsole_keymap);
-    g_free (entry->x11_layout);
-    g_free (entry->x11_model);
-    g_free (entry->x11_variant);
-    g_free (entry->x11_options);
-
-    g_free (entry);
-}
-
-static GList*
-kbd_model_map_load (GError **error)
-{
-    GList *ret = NULL;
-    gchar *filename = NULL, *filebuf = NULL, *line = NULL, *newline = NULL;
-    struct kbd_model_map_entry *entry = NULL;
+    struct kbd_model_map *map = NULL, *old = NULL;
+    FileIdentity identity;
+    gchar *filename;
 
     filename = g_file_get_path (kbd_model_map_file);
-    g_debug ("Parsing keyboard model map file file: '%s'", filename);
-
-    if (!g_file_load_contents (kbd_model_map_file, NULL, &filebuf, NULL, NULL, error)) {
-        g_prefix_error (error, "Unable to read '%s':", filename);
-        goto out;
-    }
-
-    for (line = filebuf; *line != 0; line = newline + 1) {
-        struct kbd_model_map_entry *entry = NULL;
-        GMatchInfo *match_info = NULL;
-        gboolean m = FALSE;
-
-        if ((newline = strstr (line, "\n")) != NULL)
-            *newline = 0;
-        else
-            newline = line + strlen (line) - 1;
-
-        m = g_regex_match (kbd_model_map_line_comment_re, line, 0, &match_info);
-        _g_match_info_clear (&match_info);
-        if (m)
-            continue;
-
-        if (!g_regex_match (kbd_model_map_line_re, line,  0, &match_info)) {
-            g_propagate_error (error,
-                               g_error_new (G_FILE_ERROR, G_FILE_ERROR_FAILED,
-                                            "Failed to parse line '%s' in '%s'", line, filename));
-            g_match_info_free (match_info);
-            if (ret != NULL) {
-                g_list_free_full (ret, (GDestroyNotify)kbd_model_map_entry_free);
-                ret = NULL;
-            }
-            goto out;
+    if (!file_identity_stat (filename, &identity))
+        identity.valid = FALSE;
+
+    G_LOCK (kbd_model_map);
+    if (kbd_model_map != NULL && file_identity_equal (&kbd_model_map->identity, &identity)) {
+        map = kbd_model_map;
+        g_atomic_int_inc (&map->refcount);
+    }
+    G_UNLOCK (kbd_model_map);
+
+    if (map == NULL && (map = kbd_model_map_load (kbd_model_map_file, error)) != NULL) {
+        G_LOCK (kbd_model_map);
+        if (kbd_model_map != NULL && file_identity_equal (&kbd_model_map->identity, &map->identity)) {
+            /* Another caller loaded the same file meanwhile; share its map */
+            old = map;
+            map = kbd_model_map;
+        } else {
+            old = kbd_model_map;
+            kbd_model_map = map;
         }
-        entry = g_new0 (struct kbd_model_map_entry, 1);
-        entry->vconsole_keymap = g_match_info_fetch (match_info, 1);
-        entry->x11_layout = g_match_info_fetch (match_info, 2);
-        entry->x11_model = g_match_info_fetch (match_info, 3);
-        entry->x11_variant = g_match_info_fetch (match_info, 4);
-        entry->x11_options = g_match_info_fetch (match_info, 5);
-
-        // "-" in the map file stands for an empty string
-        if (!g_strcmp0 (entry->x11_model, "-"))
-            entry->x11_model[0] = 0;
-        if (!g_strcmp0 (entry->x11_variant, "-"))
-            entry->x11_variant[0] = 0;
-        if (!g_strcmp0 (entry->x11_options, "-"))
-            entry->x11_options[0] = 0;
-
-        ret = g_list_prepend (ret, entry);
-        _g_match_info_clear (&match_info);
+        g_atomic_int_inc (&map->refcount);
+        G_UNLOCK (kbd_model_map);
+        kbd_model_map_unref (old);
     }
-  out:
-    if (ret != NULL)
-        ret = g_list_reverse (ret);
-
     g_free (filename);
-    g_free (filebuf);
-    return ret;
+    return map;
 }
 
 /* Trivial /etc/X11/xorg.conf.d/30-keyboard.conf parser */
 
-enum XORG_CONFD_LINE_TYPE {
-    XORG_CONFD_LINE_TYPE_UNKNOWN,
-    XORG_CONFD_LINE_TYPE_COMMENT,
-    XORG_CONFD_LINE_TYPE_SECTION_INPUT_CLASS,
-    XORG_CONFD_LINE_TYPE_SECTION_OTHER,
-    XORG_CONFD_LINE_TYPE_END_SECTION,
-    XORG_CONFD_LINE_TYPE_MATCH_IS_KEYBOARD,
-    XORG_CONFD_LINE_TYPE_XKB_LAYOUT,
-    XORG_CONFD_LINE_TYPE_XKB_MODEL,
-    XORG_CONFD_LINE_TYPE_XKB_VARIANT,
-    XORG_CONFD_LINE_TYPE_XKB_OPTIONS,
-};
-
-GRegex *xorg_confd_line_comment_re = NULL;
-GRegex *xorg_confd_line_section_input_class_re = NULL;
-GRegex *xorg_confd_line_section_re = NULL;
-GRegex *xorg_confd_line_end_section_re = NULL;
-GRegex *xorg_confd_line_match_is_keyboard_re = NULL;
-GRegex *xorg_confd_line_xkb_layout_re = NULL;
-GRegex *xorg_confd_line_xkb_model_re = NULL;
-GRegex *xorg_confd_line_xkb_variant_re = NULL;
-GRegex *xorg_confd_line_xkb_options_re = NULL;
-
 struct xorg_confd_line_entry {
     gchar *string;
     gchar *value; /* for one of the options we are interested in */
+    gsize value_offset; /* of the opening quote of value in string */
     enum XORG_CONFD_LINE_TYPE type;
 };
 
@@ -301,89 +138,13 @@ struct xorg_confd_parser {
     gchar *filename;
     GList *line_list;
     GList *section; /* start of relevant InputClass section */
+    FileIdentity identity; /* of the file when it was read or last saved */
+    gboolean dirty; /* line_list differs from what was read or last saved */
 };
 
-static void
-xorg_confd_regex_destroy ()
-{
-    if (xorg_confd_line_comment_re != NULL) {
-        g_regex_unref (xorg_confd_line_comment_re);
-        xorg_confd_line_comment_re = NULL;
-    }
-    if (xorg_confd_line_section_input_class_re != NULL) {
-        g_regex_unref (xorg_confd_line_section_input_class_re);
-        xorg_confd_line_section_input_class_re = NULL;
-    }
-    if (xorg_confd_line_section_re != NULL) {
-        g_regex_unref (xorg_confd_line_section_re);
-        xorg_confd_line_section_re = NULL;
-    }
-    if (xorg_confd_line_end_section_re != NULL) {
-        g_regex_unref (xorg_confd_line_end_section_re);
-        xorg_confd_line_end_section_re = NULL;
-    }
-    if (xorg_confd_line_match_is_keyboard_re != NULL) {
-        g_regex_unref (xorg_confd_line_match_is_keyboard_re);
-        xorg_confd_line_match_is_keyboard_re = NULL;
-    }
-    if (xorg_confd_line_xkb_layout_re != NULL) {
-        g_regex_unref (xorg_confd_line_xkb_layout_re);
-        xorg_confd_line_xkb_layout_re = NULL;
-    }
-    if (xorg_confd_line_xkb_model_re != NULL) {
-        g_regex_unref (xorg_confd_line_xkb_model_re);
-        xorg_confd_line_xkb_model_re = NULL;
-    }
-    if (xorg_confd_line_xkb_variant_re != NULL) {
-        g_regex_unref (xorg_confd_line_xkb_variant_re);
-        xorg_confd_line_xkb_variant_re = NULL;
-    }
-    if (xorg_confd_line_xkb_options_re != NULL) {
-        g_regex_unref (xorg_confd_line_xkb_options_re);
-        xorg_confd_line_xkb_options_re = NULL;
-    }
-}
-
-static void
-xorg_confd_regex_init ()
-{
-    if (xorg_confd_line_comment_re == NULL) {
-        xorg_confd_line_comment_re = g_regex_new ("^\\s*#", G_REGEX_ANCHORED, 0, NULL);
-        g_assert (xorg_confd_line_comment_re != NULL);
-    }
-    if (xorg_confd_line_section_input_class_re == NULL) {
-        xorg_confd_line_section_input_class_re = g_regex_new ("^\\s*Section\\s+\"InputClass\"", G_REGEX_ANCHORED|G_REGEX_CASELESS, 0, NULL);
-        g_assert (xorg_confd_line_section_input_class_re != NULL);
-    }
-    if (xorg_confd_line_section_re == NULL) {
-        xorg_confd_line_section_re = g_regex_new ("^\\s*Section\\s+\"([^\"])\"", G_REGEX_ANCHORED|G_REGEX_CASELESS, 0, NULL);
-        g_assert (xorg_confd_line_section_re != NULL);
-    }
-    if (xorg_confd_line_end_section_re == NULL) {
-        xorg_confd_line_end_section_re = g_regex_new ("^\\s*EndSection", G_REGEX_ANCHORED|G_REGEX_CASELESS, 0, NULL);
-        g_assert (xorg_confd_line_end_section_re != NULL);
-    }
-    if (xorg_confd_line_match_is_keyboard_re == NULL) {
-        xorg_confd_line_match_is_keyboard_re = g_regex_new ("^\\s*MatchIsKeyboard(?:\\s*$|\\s+\"(?:1|on|true|yes)\")", G_REGEX_ANCHORED|G_REGEX_CASELESS, 0, NULL);
-        g_assert (xorg_confd_line_match_is_keyboard_re != NULL);
-    }
-    if (xorg_confd_line_xkb_layout_re == NULL) {
-        xorg_confd_line_xkb_layout_re = g_regex_new ("^(\\s*Option\\s+\"XkbLayout\"\\s+)\"([^\"]*)\"", G_REGEX_ANCHORED|G_REGEX_CASELESS, 0, NULL);
-        g_assert (xorg_confd_line_xkb_layout_re != NULL);
-    }
-    if (xorg_confd_line_xkb_model_re == NULL) {
-        xorg_confd_line_xkb_model_re = g_regex_new ("^(\\s*Option\\s+\"XkbModel\"\\s+)\"([^\"]*)\"", G_REGEX_ANCHORED|G_REGEX_CASELESS, 0, NULL);
-        g_assert (xorg_confd_line_xkb_model_re != NULL);
-    }
-    if (xorg_confd_line_xkb_variant_re == NULL) {
-        xorg_confd_line_xkb_variant_re = g_regex_new ("^(\\s*Option\\s+\"XkbVariant\"\\s+)\"([^\"]*)\"", G_REGEX_ANCHORED|G_REGEX_CASELESS, 0, NULL);
-        g_assert (xorg_confd_line_xkb_variant_re != NULL);
-    }
-    if (xorg_confd_line_xkb_options_re == NULL) {
-        xorg_confd_line_xkb_options_re = g_regex_new ("^(\\s*Option\\s+\"XkbOptions\"\\s+)\"([^\"]*)\"", G_REGEX_ANCHORED|G_REGEX_CASELESS, 0, NULL);
-        g_assert (xorg_confd_line_xkb_options_re != NULL);
-    }
-}
+/* Parsers that still match the file they were read from, keyed by filename */
+static GHashTable *xorg_confd_parser_cache = NULL;
+G_LOCK_DEFINE_STATIC (xorg_confd_parser_cache);
 
 static void
 xorg_confd_line_entry_free (struct xorg_confd_line_entry *entry)
@@ -411,8 +172,24 @@ xorg_confd_line_entry_new (const gchar *string,
     return entry;
 }
 
+static struct xorg_confd_line_entry *
+xorg_confd_line_entry_new_xkb (const gchar *option,
+                               const gchar *value,
+                               enum XORG_CONFD_LINE_TYPE type)
+{
+    struct xorg_confd_line_entry *entry;
+    gchar *string;
+
+    string = g_strdup_printf ("        Option \"%s\" ", option);
+    entry = xorg_confd_line_entry_new (NULL, value, type);
+    entry->value_offset = strlen (string);
+    entry->string = g_strdup_printf ("%s\"%s\"", string, value);
+    g_free (string);
+    return entry;
+}
+
 static void
-xorg_confd_parser_free (struct xorg_confd_parser *parser)
+xorg_confd_parser_destroy (struct xorg_confd_parser *parser)
 {
     if (parser == NULL)
         return;
@@ -428,6 +205,26 @@ xorg_confd_parser_free (struct xorg_confd_parser *parser)
     g_free (parser);
 }
 
+/* Returns an unmodified parser to the cache */
+static void
+xorg_confd_parser_free (struct xorg_confd_parser *parser)
+{
+    if (parser == NULL)
+        return;
+
+    if (!parser->identity.valid || parser->dirty) {
+        xorg_confd_parser_destroy (parser);
+        return;
+    }
+
+    G_LOCK (xorg_confd_parser_cache);
+    if (xorg_confd_parser_cache == NULL)
+        xorg_confd_parser_cache = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify)xorg_confd_parser_destroy);
+    g_hash_table_remove (xorg_confd_parser_cache, parser->filename);
+    g_hash_table_insert (xorg_confd_parser_cache, parser->filename, parser);
+    G_UNLOCK (xorg_confd_parser_cache);
+}
+
 static struct xorg_confd_parser *
 xorg_confd_parser_new (GFile *xorg_confd_file,
                        GError **error)
@@ -436,13 +233,33 @@ xorg_confd_parser_new (GFile *xorg_confd_file,
     gchar *filebuf = NULL, *line = NULL, *newline = NULL;
     GList *input_class_section_start = NULL;
     gboolean in_section = FALSE, in_xkb_section = FALSE;
+    FileIdentity identity;
+    gchar *filename;
 
     if (xorg_confd_file == NULL)
         return NULL;
 
+    filename = g_file_get_path (xorg_confd_file);
+    if (file_identity_stat (filename, &identity)) {
+        G_LOCK (xorg_confd_parser_cache);
+        if (xorg_confd_parser_cache != NULL && (parser = g_hash_table_lookup (xorg_confd_parser_cache, filename)) != NULL) {
+            g_hash_table_steal (xorg_confd_parser_cache, filename);
+            if (!file_identity_equal (&parser->identity, &identity)) {
+                xorg_confd_parser_destroy (parser);
+                parser = NULL;
+            }
+        }
+        G_UNLOCK (xorg_confd_parser_cache);
+    }
+    if (parser != NULL) {
+        g_debug ("Reusing cached parse of '%s'", filename);
+        g_free (filename);
+        return parser;
+    }
+
     parser = g_new0 (struct xorg_confd_parser, 1);
     parser->file = g_object_ref (xorg_confd_file);
-    parser->filename = g_file_get_path (xorg_confd_file);
+    parser->filename = filename;
     g_debug ("Parsing xorg.conf.d file: '%s'", parser->filename);
     if (!g_file_load_contents (xorg_confd_file, NULL, &filebuf, NULL, NULL, error)) {
         g_prefix_error (error, "Unable to read '%s':", parser->filename);
@@ -451,9 +268,7 @@ xorg_confd_parser_new (GFile *xorg_confd_file,
 
     for (line = filebuf; *line != 0; line = newline + 1) {
         struct xorg_confd_line_entry *entry = NULL;
-        GMatchInfo *match_info = NULL;
-        gboolean matched = FALSE;
-        gboolean m = FALSE;
+        gsize value_offset = 0, value_length = 0;
 
         if ((newline = strstr (line, "\n")) != NULL)
             *newline = 0;
@@ -461,63 +276,47 @@ xorg_confd_parser_new (GFile *xorg_confd_file,
             newline = line + strlen (line) - 1;
 
         entry = xorg_confd_line_entry_new (line, NULL, XORG_CONFD_LINE_TYPE_UNKNOWN);
+        entry->type = xorg_confd_line_classify (line, &value_offset, &value_length);
 
-        if (g_regex_match (xorg_confd_line_comment_re, line, 0, &match_info)) {
+        switch (entry->type) {
+        case XORG_CONFD_LINE_TYPE_COMMENT:
             g_debug ("Parsed line '%s' as comment", line);
-            entry->type = XORG_CONFD_LINE_TYPE_COMMENT;
-        } else if (_g_match_info_clear (&match_info) && g_regex_match (xorg_confd_line_section_input_class_re, line, 0, &match_info)) {
-            g_debug ("Parsed line '%s' as InputClass section", line);
-            if (in_section)
-                goto no_match;
-            in_section = TRUE;
-            entry->type = XORG_CONFD_LINE_TYPE_SECTION_INPUT_CLASS;
-        } else if (_g_match_info_clear (&match_info) && g_regex_match (xorg_confd_line_section_re, line, 0, &match_info)) {
-            g_debug ("Parsed line '%s' as non-InputClass section", line);
+            break;
+        case XORG_CONFD_LINE_TYPE_SECTION_INPUT_CLASS:
+        case XORG_CONFD_LINE_TYPE_SECTION_OTHER:
+            g_debug ("Parsed line '%s' as %s section", line, entry->type == XORG_CONFD_LINE_TYPE_SECTION_OTHER ? "non-InputClass" : "InputClass");
             if (in_section)
                 goto no_match;
             in_section = TRUE;
-            entry->type = XORG_CONFD_LINE_TYPE_SECTION_OTHER;
-        } else if (_g_match_info_clear (&match_info) && g_regex_match (xorg_confd_line_end_section_re, line, 0, &match_info)) {
+            break;
+        case XORG_CONFD_LINE_TYPE_END_SECTION:
             g_debug ("Parsed line '%s' as end of section", line);
             if (!in_section)
                 goto no_match;
-            entry->type = XORG_CONFD_LINE_TYPE_END_SECTION;
-        } else if (_g_match_info_clear (&match_info) && g_regex_match (xorg_confd_line_match_is_keyboard_re, line, 0, &match_info)) {
+            break;
+        case XORG_CONFD_LINE_TYPE_MATCH_IS_KEYBOARD:
             g_debug ("Parsed line '%s' as MatchIsKeyboard declaration", line);
             if (!in_section)
                 goto no_match;
-            entry->type = XORG_CONFD_LINE_TYPE_MATCH_IS_KEYBOARD;
             in_xkb_section = TRUE;
-        } else if (_g_match_info_clear (&match_info) && g_regex_match (xorg_confd_line_xkb_layout_re, line, 0, &match_info)) {
-            g_debug ("Parsed line '%s' as XkbLayout option", line);
-            if (!in_section)
-                goto no_match;
-            entry->type = XORG_CONFD_LINE_TYPE_XKB_LAYOUT;
-            entry->value = g_match_info_fetch (match_info, 2);
-        } else if (_g_match_info_clear (&match_info) && g_regex_match (xorg_confd_line_xkb_model_re, line, 0, &match_info)) {
-            g_debug ("Parsed line '%s' as XkbModel option", line);
-            if (!in_section)
-                goto no_match;
-            entry->type = XORG_CONFD_LINE_TYPE_XKB_MODEL;
-            entry->value = g_match_info_fetch (match_info, 2);
-        } else if (_g_match_info_clear (&match_info) && g_regex_match (xorg_confd_line_xkb_variant_re, line, 0, &match_info)) {
-            g_debug ("Parsed line '%s' as XkbVariant option", line);
-            if (!in_section)
-                goto no_match;
-            entry->type = XORG_CONFD_LINE_TYPE_XKB_VARIANT;
-            entry->value = g_match_info_fetch (match_info, 2);
-        } else if (_g_match_info_clear (&match_info) && g_regex_match (xorg_confd_line_xkb_options_re, line, 0, &match_info)) {
-            g_debug ("Parsed line '%s' as XkbOptions option", line);
+            break;
+        case XORG_CONFD_LINE_TYPE_XKB_LAYOUT:
+        case XORG_CONFD_LINE_TYPE_XKB_MODEL:
+        case XORG_CONFD_LINE_TYPE_XKB_VARIANT:
+        case XORG_CONFD_LINE_TYPE_XKB_OPTIONS:
+            g_debug ("Parsed line '%s' as Xkb option", line);
             if (!in_section)
                 goto no_match;
-            entry->type = XORG_CONFD_LINE_TYPE_XKB_OPTIONS;
-            entry->value = g_match_info_fetch (match_info, 2);
+            entry->value = g_strndup (entry->string + value_offset + 1, value_length);
+            entry->value_offset = value_offset;
+            break;
+        default:
+            break;
         }
 
         if (entry->type == XORG_CONFD_LINE_TYPE_UNKNOWN)
             g_debug ("Parsing line '%s' as unknown", line);
 
-        _g_match_info_clear (&match_info);
         parser->line_list = g_list_prepend (parser->line_list, entry);
         if (in_section) {
             if (entry->type == XORG_CONFD_LINE_TYPE_SECTION_INPUT_CLASS)
@@ -535,8 +334,7 @@ xorg_confd_parser_new (GFile *xorg_confd_file,
 
   no_match:
         /* Nothing matched... */
-        g_free (entry);
-        _g_match_info_clear (&match_info);
+        xorg_confd_line_entry_free (entry);
         goto parse_fail;
     }
 
@@ -546,8 +344,9 @@ xorg_confd_parser_new (GFile *xorg_confd_file,
     }
 
     parser->line_list = g_list_reverse (parser->line_list);
+    /* Stat'ed before reading, so a concurrent change can only cause a cache miss */
+    parser->identity = identity;
 
-  out:
     g_free (filebuf);
     return parser;
 
@@ -574,7 +373,6 @@ xorg_confd_parser_get_xkb (const struct xorg_confd_parser *parser,
     if (parser == NULL)
         return;
     for (curr = parser->section; curr != NULL; curr = curr->next) {
-        GMatchInfo *match_info = NULL;
         struct xorg_confd_line_entry *entry = (struct xorg_confd_line_entry *) curr->data;
 
         if (entry->type == XORG_CONFD_LINE_TYPE_END_SECTION)
@@ -595,16 +393,21 @@ xorg_confd_parser_get_xkb (const struct xorg_confd_parser *parser,
 }
 
 static GList *
-xorg_confd_parser_line_set_or_delete (GList *line,
-                                      const gchar *value,
-                                      const GRegex *re)
+xorg_confd_parser_line_set_or_delete (struct xorg_confd_parser *parser,
+                                      GList *line,
+                                      const gchar *value)
 {
-    gchar *replacement = NULL, *replaced = NULL;
+    gchar *replaced = NULL;
+    const gchar *rest;
 
     g_assert (line != NULL);
 
     struct xorg_confd_line_entry *entry = (struct xorg_confd_line_entry *) line->data;
 
+    if (!g_strcmp0 (entry->value, value))
+        return line;
+
+    parser->dirty = TRUE;
     if (value == NULL || !g_strcmp0 (value, "")) {
         /* If value is null, we delete the line and return previous one */
         g_debug ("Deleting entry '%s'", entry->string);
@@ -621,12 +424,12 @@ xorg_confd_parser_line_set_or_delete (GList *line,
             next->prev = prev;
         return prev;
     }
+    /* Splice the new value in between the quotes, keeping the rest of the line */
+    rest = entry->string + entry->value_offset + strlen (entry->value) + 2;
+    replaced = g_strdup_printf ("%.*s\"%s\"%s", (int) entry->value_offset, entry->string, value, rest);
+    g_debug ("Setting entry '%s' to new value '%s' i.e. '%s'", entry->string, value, replaced);
     g_free (entry->value);
     entry->value = g_strdup (value);
-    replacement = g_strdup_printf ("\\1\"%s\"", value);
-    replaced = g_regex_replace (re, entry->string, -1, 0, replacement, 0, NULL);
-    g_debug ("Setting entry '%s' to new value '%s' i.e. '%s'", entry->string, value, replaced);
-    g_free (replacement);
     g_free (entry->string);
     entry->string = replaced;
 
@@ -643,7 +446,6 @@ xorg_confd_parser_set_xkb (struct xorg_confd_parser *parser,
     GList *curr = NULL, *end = NULL;
     gboolean layout_found = FALSE, model_found = FALSE, variant_found = FALSE, options_found = FALSE;
     struct xorg_confd_line_entry *entry = NULL;
-    gchar *string = NULL;
 
     if (parser == NULL)
         return;
@@ -651,16 +453,17 @@ xorg_confd_parser_set_xkb (struct xorg_confd_parser *parser,
     if (parser->section == NULL) {
         GList *section = NULL;
 
+        parser->dirty = TRUE;
         entry = xorg_confd_line_entry_new ("Section \"InputClass\"", NULL, XORG_CONFD_LINE_TYPE_SECTION_INPUT_CLASS);
         section = g_list_prepend (section, entry);
 
         entry = xorg_confd_line_entry_new ("        Identifier \"keyboard-all\"", NULL, XORG_CONFD_LINE_TYPE_UNKNOWN);
         section = g_list_prepend (section, entry);
 
-        entry = entry = xorg_confd_line_entry_new ("        MatchIsKeyboard \"on\"", NULL, XORG_CONFD_LINE_TYPE_MATCH_IS_KEYBOARD);
+        entry = xorg_confd_line_entry_new ("        MatchIsKeyboard \"on\"", NULL, XORG_CONFD_LINE_TYPE_MATCH_IS_KEYBOARD);
         section = g_list_prepend (section, entry);
 
-        entry = entry = xorg_confd_line_entry_new ("EndSection", NULL, XORG_CONFD_LINE_TYPE_END_SECTION);
+        entry = xorg_confd_line_entry_new ("EndSection", NULL, XORG_CONFD_LINE_TYPE_END_SECTION);
         section = g_list_prepend (section, entry);
 
         section = g_list_reverse (section);
@@ -676,112 +479,866 @@ xorg_confd_parser_set_xkb (struct xorg_confd_parser *parser,
             break;
         } else if (entry->type == XORG_CONFD_LINE_TYPE_XKB_LAYOUT) {
             layout_found = TRUE;
-            curr = xorg_confd_parser_line_set_or_delete (curr, layout, xorg_confd_line_xkb_layout_re);
+            curr = xorg_confd_parser_line_set_or_delete (parser, curr, layout);
         } else if (entry->type == XORG_CONFD_LINE_TYPE_XKB_MODEL) {
             model_found = TRUE;
-            curr = xorg_confd_parser_line_set_or_delete (curr, model, xorg_confd_line_xkb_model_re);
+            curr = xorg_confd_parser_line_set_or_delete (parser, curr, model);
         } else if (entry->type == XORG_CONFD_LINE_TYPE_XKB_VARIANT) {
             variant_found = TRUE;
-            curr = xorg_confd_parser_line_set_or_delete (curr, variant, xorg_confd_line_xkb_variant_re);
+            curr = xorg_confd_parser_line_set_or_delete (parser, curr, variant);
         } else if (entry->type == XORG_CONFD_LINE_TYPE_XKB_OPTIONS) {
             options_found = TRUE;
-            curr = xorg_confd_parser_line_set_or_delete (curr, options, xorg_confd_line_xkb_options_re);
+            curr = xorg_confd_parser_line_set_or_delete (parser, curr, options);
         }
     }
 
     if (!layout_found && layout != NULL && g_strcmp0 (layout, "")) {
-        string = g_strdup_printf ("        Option \"XkbLayout\" \"%s\"", layout);
-        g_debug ("Inserting new entry: '%s'", string);
-        entry = xorg_confd_line_entry_new (string, layout, XORG_CONFD_LINE_TYPE_XKB_LAYOUT);
+        entry = xorg_confd_line_entry_new_xkb ("XkbLayout", layout, XORG_CONFD_LINE_TYPE_XKB_LAYOUT);
+        g_debug ("Inserting new entry: '%s'", entry->string);
         parser->line_list = g_list_insert_before (parser->line_list, end, entry);
-        g_free (string);
+        parser->dirty = TRUE;
     }
     if (!model_found && model != NULL && g_strcmp0 (model, "")) {
-        string = g_strdup_printf ("        Option \"XkbModel\" \"%s\"", model);
-        g_debug ("Inserting new entry: '%s'", string);
-        entry = xorg_confd_line_entry_new (string, model, XORG_CONFD_LINE_TYPE_XKB_MODEL);
+        entry = xorg_confd_line_entry_new_xkb ("XkbModel", model, XORG_CONFD_LINE_TYPE_XKB_MODEL);
+        g_debug ("Inserting new entry: '%s'", entry->string);
         parser->line_list = g_list_insert_before (parser->line_list, end, entry);
-        g_free (string);
+        parser->dirty = TRUE;
     }
     if (!variant_found && variant != NULL && g_strcmp0 (variant, "")) {
-        string = g_strdup_printf ("        Option \"XkbVariant\" \"%s\"", variant);
-        g_debug ("Inserting new entry: '%s'", string);
-        entry = xorg_confd_line_entry_new (string, variant, XORG_CONFD_LINE_TYPE_XKB_VARIANT);
+        entry = xorg_confd_line_entry_new_xkb ("XkbVariant", variant, XORG_CONFD_LINE_TYPE_XKB_VARIANT);
+        g_debug ("Inserting new entry: '%s'", entry->string);
         parser->line_list = g_list_insert_before (parser->line_list, end, entry);
-        g_free (string);
+        parser->dirty = TRUE;
     }
     if (!options_found && options != NULL && g_strcmp0 (options, "")) {
-        string = g_strdup_printf ("        Option \"XkbOptions\" \"%s\"", options);
-        g_debug ("Inserting new entry: '%s'", string);
-        entry = xorg_confd_line_entry_new (string, options, XORG_CONFD_LINE_TYPE_XKB_OPTIONS);
+        entry = xorg_confd_line_entry_new_xkb ("XkbOptions", options, XORG_CONFD_LINE_TYPE_XKB_OPTIONS);
+        g_debug ("Inserting new entry: '%s'", entry->string);
         parser->line_list = g_list_insert_before (parser->line_list, end, entry);
-        g_free (string);
+        parser->dirty = TRUE;
     }
 }
 
 static gboolean
-xorg_confd_parser_save (const struct xorg_confd_parser *parser,
+xorg_confd_parser_save (struct xorg_confd_parser *parser,
+                        GCancellable *cancellable,
                         GError **error)
 {
     gboolean ret = FALSE;
     GList *curr = NULL;
-    GFileOutputStream *os;
+    GString *contents;
 
     g_assert (parser != NULL && parser->file != NULL && parser->filename != NULL);
-    if ((os = g_file_replace (parser->file, NULL, FALSE, G_FILE_CREATE_NONE, NULL, error)) == NULL) {
-        g_prefix_error (error, "Unable to save '%s': ", parser->filename);
-        goto out;
+    if (!parser->dirty) {
+        g_debug ("Not saving '%s': unchanged", parser->filename);
+        return TRUE;
     }
 
+    contents = g_string_new (NULL);
     for (curr = parser->line_list; curr != NULL; curr = curr->next) {
         struct xorg_confd_line_entry *entry = (struct xorg_confd_line_entry *) curr->data;
-        gsize written;
 
-        if (!g_output_stream_write_all (G_OUTPUT_STREAM (os), entry->string, strlen (entry->string), &written, NULL, error)) {
-            g_prefix_error (error, "Unable to save '%s': ", parser->filename);
-            goto out;
-        }
-        if (!g_output_stream_write_all (G_OUTPUT_STREAM (os), "\n", 1, &written, NULL, error)) {
-            g_prefix_error (error, "Unable to save '%s': ", parser->filename);
-            goto out;
-        }
+        g_string_append (contents, entry->string);
+        g_string_append_c (contents, '\n');
     }
 
-    if (!g_output_stream_close (G_OUTPUT_STREAM (os), NULL, error)) {
+    parser->identity.valid = FALSE;
+    if (!file_write_atomic (parser->filename, contents->str, contents->len, &parser->identity, cancellable, error)) {
         g_prefix_error (error, "Unable to save '%s': ", parser->filename);
-        g_output_stream_close (G_OUTPUT_STREAM (os), NULL, NULL);
         goto out;
     }
+    parser->dirty = FALSE;
     ret = TRUE;
 
-  out:
-    if (os)
-        g_object_unref (os);
+  out:
+    g_string_free (contents, TRUE);
+    return ret;
+}
+
+/* End of trivial /etc/X11/xorg.conf.d/30-keyboard.conf parser */
+
+/* Index of the xkb options set in every .conf file in /etc/X11/xorg.conf.d.
+ * X applies the files in lexical order, so for each option the last file
+ * that sets it wins. The index is built once, kept current by a directory
+ * monitor, and updated in place when we save a file.
+ *
+ * The index is only modified with the xorg_conf lock held, at startup or on
+ * the keyboard queue, so holders of that lock may read it without the index
+ * lock. Files are read and written with only the xorg_conf lock held; the
+ * index lock is taken just to swap an entry in and to publish, so readers
+ * on the main loop never wait for disk I/O. */
+
+enum {
+    XKB_LAYOUT,
+    XKB_MODEL,
+    XKB_VARIANT,
+    XKB_OPTIONS,
+    XKB_N_OPTIONS
+};
+
+struct xorg_confd_index_file {
+    gchar *filename;
+    gboolean parsed; /* FALSE if the file could not be parsed */
+    gchar *xkb[XKB_N_OPTIONS]; /* from its keyboard InputClass section */
+};
+
+static GPtrArray *xorg_confd_index = NULL; /* sorted by filename */
+static GFileMonitor *xorg_confd_monitor = NULL;
+G_LOCK_DEFINE_STATIC (xorg_confd_index);
+
+static gboolean
+xkb_value_equal (const gchar *a,
+                 const gchar *b)
+{
+    return !g_strcmp0 (a != NULL ? a : "", b != NULL ? b : "");
+}
+
+static void
+xorg_confd_index_file_free (struct xorg_confd_index_file *file)
+{
+    guint i;
+
+    if (file == NULL)
+        return;
+
+    g_free (file->filename);
+    for (i = 0; i < XKB_N_OPTIONS; i++)
+        g_free (file->xkb[i]);
+    g_free (file);
+}
+
+static gboolean
+xorg_confd_filename_is_indexed (const gchar *filename)
+{
+    return g_str_has_suffix (filename, ".conf");
+}
+
+/* Returns the position of filename in the index, or where it would go */
+static guint
+xorg_confd_index_find (const gchar *filename,
+                       gboolean *found)
+{
+    guint low = 0, high = xorg_confd_index->len, mid;
+    gint cmp;
+
+    *found = FALSE;
+    while (low < high) {
+        mid = (low + high) / 2;
+        cmp = strcmp (((struct xorg_confd_index_file *) g_ptr_array_index (xorg_confd_index, mid))->filename, filename);
+        if (cmp == 0) {
+            *found = TRUE;
+            return mid;
+        }
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+/* Reads the xkb options of one file, or returns NULL if it no longer
+ * exists. Unchanged files are served from the parser cache. */
+static struct xorg_confd_index_file *
+xorg_confd_index_file_read (GFile *xorg_confd_file)
+{
+    struct xorg_confd_index_file *file;
+    struct xorg_confd_parser *parser;
+    GError *err = NULL;
+
+    if (!g_file_query_exists (xorg_confd_file, NULL))
+        return NULL;
+
+    file = g_new0 (struct xorg_confd_index_file, 1);
+    file->filename = g_file_get_path (xorg_confd_file);
+    if ((parser = xorg_confd_parser_new (xorg_confd_file, &err)) == NULL) {
+        g_debug ("Ignoring xorg.conf.d file: %s", err->message);
+        g_clear_error (&err);
+        return file;
+    }
+    xorg_confd_parser_get_xkb (parser, &file->xkb[XKB_LAYOUT], &file->xkb[XKB_MODEL], &file->xkb[XKB_VARIANT], &file->xkb[XKB_OPTIONS]);
+    file->parsed = TRUE;
+    xorg_confd_parser_free (parser);
+    return file;
+}
+
+/* (Re)reads one file into the index, or drops it if it no longer exists.
+ * Called with the xorg_conf lock held; the file is read before the index
+ * lock is taken. */
+static void
+xorg_confd_index_update (GFile *xorg_confd_file)
+{
+    struct xorg_confd_index_file *file;
+    gboolean found;
+    gchar *filename;
+    guint pos;
+
+    file = xorg_confd_index_file_read (xorg_confd_file);
+    filename = g_file_get_path (xorg_confd_file);
+
+    G_LOCK (xorg_confd_index);
+    pos = xorg_confd_index_find (filename, &found);
+    if (file == NULL) {
+        if (found)
+            g_ptr_array_remove_index (xorg_confd_index, pos);
+    } else if (found) {
+        xorg_confd_index_file_free (g_ptr_array_index (xorg_confd_index, pos));
+        g_ptr_array_index (xorg_confd_index, pos) = file;
+    } else {
+        g_ptr_array_add (xorg_confd_index, NULL);
+        memmove (xorg_confd_index->pdata + pos + 1, xorg_confd_index->pdata + pos, (xorg_confd_index->len - pos - 1) * sizeof (gpointer));
+        g_ptr_array_index (xorg_confd_index, pos) = file;
+    }
+    G_UNLOCK (xorg_confd_index);
+    g_free (filename);
+}
+
+static void
+xorg_confd_index_scan (void)
+{
+    GFileEnumerator *enumerator;
+    GFileInfo *info;
+    GError *err = NULL;
+
+    if ((enumerator = g_file_enumerate_children (x11_confd_dir, G_FILE_ATTRIBUTE_STANDARD_NAME "," G_FILE_ATTRIBUTE_STANDARD_TYPE,
+                                                 G_FILE_QUERY_INFO_NONE, NULL, &err)) == NULL) {
+        g_debug ("Unable to list xorg.conf.d: %s", err->message);
+        g_clear_error (&err);
+        return;
+    }
+    while ((info = g_file_enumerator_next_file (enumerator, NULL, NULL)) != NULL) {
+        if (g_file_info_get_file_type (info) == G_FILE_TYPE_REGULAR && xorg_confd_filename_is_indexed (g_file_info_get_name (info))) {
+            GFile *file;
+
+            file = g_file_get_child (x11_confd_dir, g_file_info_get_name (info));
+            xorg_confd_index_update (file);
+            g_object_unref (file);
+        }
+        g_object_unref (info);
+    }
+    g_object_unref (enumerator);
+}
+
+/* Index of the file whose value of option is in effect, or -1 */
+static gint
+xorg_confd_index_owner (guint option)
+{
+    gint i;
+
+    for (i = (gint) xorg_confd_index->len - 1; i >= 0; i--) {
+        struct xorg_confd_index_file *file = g_ptr_array_index (xorg_confd_index, i);
+
+        if (file->parsed && file->xkb[option] != NULL)
+            return i;
+    }
+    return -1;
+}
+
+static const gchar *
+xorg_confd_index_value (guint option)
+{
+    gint owner;
+
+    if ((owner = xorg_confd_index_owner (option)) < 0)
+        return "";
+    return ((struct xorg_confd_index_file *) g_ptr_array_index (xorg_confd_index, owner))->xkb[option];
+}
+
+/* Copies the values in effect to the x11_* variables and the bus
+ * properties; called with the index lock held, which is also what readers
+ * of the x11_* variables must hold */
+static void
+xorg_confd_index_publish (void)
+{
+    gchar **values[XKB_N_OPTIONS] = { &x11_layout, &x11_model, &x11_variant, &x11_options };
+    gboolean changed = FALSE;
+    guint i;
+
+    for (i = 0; i < XKB_N_OPTIONS; i++) {
+        const gchar *value = xorg_confd_index_value (i);
+
+        if (*values[i] != NULL && !g_strcmp0 (*values[i], value))
+            continue;
+        g_free (*values[i]);
+        *values[i] = g_strdup (value);
+        changed = TRUE;
+    }
+    if (changed && locale1 != NULL) {
+        openrc_settingsd_localed_locale1_set_x11_layout (locale1, x11_layout);
+        openrc_settingsd_localed_locale1_set_x11_model (locale1, x11_model);
+        openrc_settingsd_localed_locale1_set_x11_variant (locale1, x11_variant);
+        openrc_settingsd_localed_locale1_set_x11_options (locale1, x11_options);
+    }
+}
+
+/* The file that options nobody sets yet are written to: 30-keyboard.conf,
+ * unless only the systemd-style 00-keyboard.conf exists */
+static GFile *
+xorg_confd_index_default_file (void)
+{
+    gchar *gentoo_filename, *systemd_filename;
+    gboolean gentoo_found, systemd_found;
+
+    gentoo_filename = g_file_get_path (x11_gentoo_file);
+    systemd_filename = g_file_get_path (x11_systemd_file);
+    xorg_confd_index_find (gentoo_filename, &gentoo_found);
+    xorg_confd_index_find (systemd_filename, &systemd_found);
+    g_free (gentoo_filename);
+    g_free (systemd_filename);
+    return !gentoo_found && systemd_found ? x11_systemd_file : x11_gentoo_file;
+}
+
+/* Returns the file that should hold the requested value of option */
+static GFile *
+xorg_confd_index_target (guint option)
+{
+    gint owner;
+
+    if ((owner = xorg_confd_index_owner (option)) < 0)
+        return g_object_ref (xorg_confd_index_default_file ());
+    return g_file_new_for_path (((struct xorg_confd_index_file *) g_ptr_array_index (xorg_confd_index, owner))->filename);
+}
+
+/* Writes each option to the file whose value is in effect, or to the
+ * default file if no file sets it. Clearing an option removes it from
+ * every file that sets it, since an earlier file would take over.
+ * Called with the xorg_conf lock held, which serializes the setters and
+ * lets the index be read without its own lock. */
+static gboolean
+xorg_confd_index_set_xkb (const gchar *layout,
+                          const gchar *model,
+                          const gchar *variant,
+                          const gchar *options,
+                          GCancellable *cancellable,
+                          GError **error)
+{
+    const gchar *requested[XKB_N_OPTIONS] = { layout, model, variant, options };
+    gboolean ret = FALSE;
+    guint pass, i;
+
+    /* Each pass saves one file, clearing at most one earlier owner of each
+     * option, so the number of files bounds the number of passes */
+    for (pass = 0; pass <= xorg_confd_index->len + 1; pass++) {
+        struct xorg_confd_parser *parser = NULL;
+        const gchar *values[XKB_N_OPTIONS];
+        gchar *current[XKB_N_OPTIONS] = { NULL };
+        GFile *target = NULL;
+        gboolean saved = FALSE;
+
+        /* Pick a file that needs changing */
+        for (i = 0; i < XKB_N_OPTIONS && target == NULL; i++)
+            if (!xkb_value_equal (xorg_confd_index_value (i), requested[i]))
+                target = xorg_confd_index_target (i);
+        if (target == NULL) {
+            ret = TRUE;
+            break;
+        }
+
+        if ((parser = xorg_confd_parser_new (target, error)) != NULL) {
+            /* Change all the options that belong in this file at once, and
+             * leave the others as they are */
+            xorg_confd_parser_get_xkb (parser, &current[XKB_LAYOUT], &current[XKB_MODEL], &current[XKB_VARIANT], &current[XKB_OPTIONS]);
+            for (i = 0; i < XKB_N_OPTIONS; i++) {
+                GFile *option_target = NULL;
+
+                values[i] = current[i];
+                if (!xkb_value_equal (xorg_confd_index_value (i), requested[i]) &&
+                    g_file_equal (target, (option_target = xorg_confd_index_target (i))))
+                    values[i] = requested[i];
+                if (option_target != NULL)
+                    g_object_unref (option_target);
+            }
+            xorg_confd_parser_set_xkb (parser, values[XKB_LAYOUT], values[XKB_MODEL], values[XKB_VARIANT], values[XKB_OPTIONS]);
+            if ((saved = xorg_confd_parser_save (parser, cancellable, error)))
+                xorg_confd_index_update (target);
+        }
+        for (i = 0; i < XKB_N_OPTIONS; i++)
+            g_free (current[i]);
+        xorg_confd_parser_free (parser);
+        g_object_unref (target);
+        if (!saved)
+            goto out;
+    }
+    if (!ret)
+        g_propagate_error (error,
+                           g_error_new (G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                                        "Unable to apply the X11 keyboard settings to xorg.conf.d"));
+
+  out:
+    G_LOCK (xorg_confd_index);
+    xorg_confd_index_publish ();
+    G_UNLOCK (xorg_confd_index);
+    return ret;
+}
+
+static void
+xorg_confd_index_update_if_indexed (GFile *file)
+{
+    GFile *parent;
+    gchar *basename;
+
+    if (file == NULL)
+        return;
+
+    parent = g_file_get_parent (file);
+    basename = g_file_get_basename (file);
+    if (parent != NULL && g_file_equal (parent, x11_confd_dir) && xorg_confd_filename_is_indexed (basename)) {
+        g_debug ("xorg.conf.d file '%s' changed", basename);
+        xorg_confd_index_update (file);
+    }
+    if (parent != NULL)
+        g_object_unref (parent);
+    g_free (basename);
+}
+
+static void
+xorg_confd_index_refresh_cb (gpointer _files,
+                             gpointer unused)
+{
+    GFile **files = (GFile **) _files;
+
+    G_LOCK (xorg_conf);
+    xorg_confd_index_update_if_indexed (files[0]);
+    xorg_confd_index_update_if_indexed (files[1]);
+    G_LOCK (xorg_confd_index);
+    xorg_confd_index_publish ();
+    G_UNLOCK (xorg_confd_index);
+    G_UNLOCK (xorg_conf);
+
+    if (files[0] != NULL)
+        g_object_unref (files[0]);
+    if (files[1] != NULL)
+        g_object_unref (files[1]);
+    g_free (files);
+}
+
+/* Runs on the main loop, so the files are reread on the keyboard queue,
+ * in order with the setters */
+static void
+on_xorg_confd_changed (GFileMonitor *monitor,
+                       GFile *file,
+                       GFile *other_file,
+                       GFileMonitorEvent event_type,
+                       gpointer user_data)
+{
+    GFile **files;
+
+    if (event_type == G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED || event_type == G_FILE_MONITOR_EVENT_PRE_UNMOUNT)
+        return;
+
+    files = g_new0 (GFile *, 2);
+    if (file != NULL)
+        files[0] = g_object_ref (file);
+    if (other_file != NULL)
+        files[1] = g_object_ref (other_file);
+    work_queue_push (keyboard_queue, xorg_confd_index_refresh_cb, files);
+}
+
+/* End of xorg.conf.d index */
+
+/* Installed locales, read from the glibc locale archive and the compiled
+ * locale directories next to it. The index is built on the locale queue at
+ * startup, and rebuilt there on the next lookup after anything in the
+ * directory changes; the main loop only ever reads a fresh index. The
+ * archive and directories are read without the lock, and the new index is
+ * swapped in under it. */
+
+#define LOCALE_ARCHIVE_MAGIC 0xde020109
+
+static GFile *locale_archive_dir = NULL;
+static GFileMonitor *locale_archive_monitor = NULL;
+static GHashTable *locale_index = NULL; /* normalized name -> itself */
+static gboolean locale_index_stale = TRUE;
+static guint locale_index_changes = 0; /* counts monitor events */
+G_LOCK_DEFINE_STATIC (locale_index);
+
+/* Normalizes the codeset the way glibc does when it looks a locale up, so
+ * that e.g. "en_US.UTF-8" and "en_US.utf8" are the same locale */
+static gchar *
+locale_name_normalize (const gchar *name)
+{
+    const gchar *p;
+    GString *normalized;
+    gboolean only_digits = TRUE;
+    gsize codeset_start;
+
+    if ((p = strchr (name, '.')) == NULL || (strchr (name, '@') != NULL && strchr (name, '@') < p))
+        return g_strdup (name);
+
+    normalized = g_string_new_len (name, p - name + 1);
+    codeset_start = normalized->len;
+    for (p++; *p != '\0' && *p != '@'; p++) {
+        if (g_ascii_isalpha (*p)) {
+            g_string_append_c (normalized, g_ascii_tolower (*p));
+            only_digits = FALSE;
+        } else if (g_ascii_isdigit (*p))
+            g_string_append_c (normalized, *p);
+    }
+    if (only_digits && normalized->len > codeset_start)
+        g_string_insert (normalized, codeset_start, "iso");
+    g_string_append (normalized, p);
+    return g_string_free (normalized, FALSE);
+}
+
+static void
+locale_index_add (GHashTable *index,
+                  const gchar *name)
+{
+    gchar *normalized;
+
+    normalized = locale_name_normalize (name);
+    g_hash_table_replace (index, normalized, normalized);
+}
+
+/* Reads the locale names from glibc's locale-archive: a header of 32-bit
+ * words in host byte order, and a name hash table whose used entries hold
+ * the file offsets of the names */
+static void
+locale_index_add_archive (GHashTable *index,
+                          const gchar *filename)
+{
+    GMappedFile *mapped;
+    GError *err = NULL;
+    const gchar *contents;
+    guint32 head[5], entry[3];
+    gsize length;
+    guint32 i;
+
+    if ((mapped = g_mapped_file_new (filename, FALSE, &err)) == NULL) {
+        g_debug ("Unable to read locale archive: %s", err->message);
+        g_clear_error (&err);
+        return;
+    }
+    contents = g_mapped_file_get_contents (mapped);
+    length = g_mapped_file_get_length (mapped);
+
+    /* magic, serial, namehash_offset, namehash_used, namehash_size */
+    if (length < sizeof (head))
+        goto invalid;
+    memcpy (head, contents, sizeof (head));
+    if (head[0] != LOCALE_ARCHIVE_MAGIC || (guint64) head[2] + (guint64) head[4] * sizeof (entry) > length)
+        goto invalid;
+
+    for (i = 0; i < head[4]; i++) {
+        /* hashval, name_offset, locrec_offset */
+        memcpy (entry, contents + head[2] + i * sizeof (entry), sizeof (entry));
+        if (entry[2] == 0)
+            continue;
+        if (entry[1] >= length || memchr (contents + entry[1], '\0', length - entry[1]) == NULL)
+            goto invalid;
+        locale_index_add (index, contents + entry[1]);
+    }
+    g_mapped_file_unref (mapped);
+    return;
+
+  invalid:
+    g_debug ("Ignoring invalid locale archive '%s'", filename);
+    g_mapped_file_unref (mapped);
+}
+
+/* Locales compiled into their own directories, e.g. with localedef
+ * --no-archive, have an LC_CTYPE file */
+static void
+locale_index_add_directories (GHashTable *index,
+                              const gchar *dirname)
+{
+    const gchar *name;
+    GDir *dir;
+
+    if ((dir = g_dir_open (dirname, 0, NULL)) == NULL)
+        return;
+    while ((name = g_dir_read_name (dir)) != NULL) {
+        gchar *ctype;
+
+        ctype = g_build_filename (dirname, name, "LC_CTYPE", NULL);
+        if (g_file_test (ctype, G_FILE_TEST_IS_REGULAR))
+            locale_index_add (index, name);
+        g_free (ctype);
+    }
+    g_dir_close (dir);
+}
+
+/* Runs on the locale queue, without the locale_index lock. A change during
+ * the rebuild leaves the new index stale. */
+static void
+locale_index_rebuild (void)
+{
+    GHashTable *index, *old_index;
+    gchar *dirname, *archive;
+    guint changes;
+
+    G_LOCK (locale_index);
+    changes = locale_index_changes;
+    G_UNLOCK (locale_index);
+
+    index = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    dirname = g_file_get_path (locale_archive_dir);
+    archive = g_build_filename (dirname, "locale-archive", NULL);
+    locale_index_add_archive (index, archive);
+    locale_index_add_directories (index, dirname);
+    g_debug ("Indexed %u installed locales", g_hash_table_size (index));
+    g_free (archive);
+    g_free (dirname);
+
+    G_LOCK (locale_index);
+    old_index = locale_index;
+    locale_index = index;
+    locale_index_stale = locale_index_changes != changes;
+    G_UNLOCK (locale_index);
+    if (old_index != NULL)
+        g_hash_table_destroy (old_index);
+}
+
+static void
+on_locale_archive_dir_changed (GFileMonitor *monitor,
+                               GFile *file,
+                               GFile *other_file,
+                               GFileMonitorEvent event_type,
+                               gpointer user_data)
+{
+    G_LOCK (locale_index);
+    locale_index_stale = TRUE;
+    locale_index_changes++;
+    G_UNLOCK (locale_index);
+}
+
+static gboolean
+locale_index_is_stale (void)
+{
+    gboolean ret;
+
+    G_LOCK (locale_index);
+    ret = locale_index_stale;
+    G_UNLOCK (locale_index);
+    return ret;
+}
+
+/* Runs on the locale queue */
+static void
+locale_index_rebuild_cb (gpointer data,
+                         gpointer unused)
+{
+    if (locale_index_is_stale ())
+        locale_index_rebuild ();
+}
+
+/* If no installed locale can be found at all, e.g. with a C library that
+ * has no locale archive, any name is accepted. On the main loop, rebuild
+ * is FALSE and a stale index accepts any name too; the locale queue checks
+ * it again. rebuild may only be TRUE on the locale queue. */
+static gboolean
+locale_is_installed (const gchar *name,
+                     gboolean rebuild)
+{
+    gboolean ret = TRUE;
+    gchar *normalized;
+
+    if (!strcmp (name, "C") || !strcmp (name, "POSIX"))
+        return TRUE;
+
+    if (rebuild && locale_index_is_stale ())
+        locale_index_rebuild ();
+
+    normalized = locale_name_normalize (name);
+    G_LOCK (locale_index);
+    if ((!locale_index_stale || rebuild) && g_hash_table_size (locale_index) > 0)
+        ret = g_hash_table_lookup (locale_index, normalized) != NULL;
+    G_UNLOCK (locale_index);
+    g_free (normalized);
     return ret;
 }
 
-/* End of trivial /etc/X11/xorg.conf.d/30-keyboard.conf parser */
-
 static gboolean
 locale_name_is_valid (gchar *name)
 {
-    return g_regex_match_simple ("^[a-zA-Z0-9_.@-]*$", name, G_REGEX_MULTILINE, 0);
+    const gchar *p;
+
+    for (p = name; *p != '\0'; p++)
+        if (!g_ascii_isalnum (*p) && strchr ("_.@-", *p) == NULL)
+            return FALSE;
+    /* An empty value unsets the variable */
+    return *name == '\0' || locale_is_installed (name, FALSE);
 }
 
 struct invoked_locale {
     GDBusMethodInvocation *invocation;
-    gchar **locale; /* newly allocated */
+    gchar **locale_values; /* newly allocated, indexed like locale_variables */
 };
 
+static void
+locale_values_free (gchar **locale_values)
+{
+    gchar **val, **var;
+
+    if (locale_values == NULL)
+        return;
+    /* g_strfreev (locale_values) would leak, since it stops at first NULL value */
+    for (val = locale_values, var = locale_variables; *var != NULL; val++, var++)
+        g_free (*val);
+    g_free (locale_values);
+}
+
+/* Maps "VAR=value" strings onto an array indexed like locale_variables;
+ * returns NULL if any variable is unknown or any value is invalid */
+static gchar **
+locale_values_parse (const gchar * const *_locale)
+{
+    const gchar * const *loc;
+    gchar **var, **val, **locale_values;
+
+    locale_values = g_new0 (gchar *, g_strv_length (locale_variables) + 1);
+    if (_locale == NULL)
+        return locale_values;
+
+    for (loc = _locale; *loc != NULL; loc++) {
+        gboolean found = FALSE;
+        for (val = locale_values, var = locale_variables; *var != NULL; val++, var++) {
+            size_t varlen;
+            gchar *unquoted = NULL;
+
+            varlen = strlen (*var);
+            if (g_str_has_prefix (*loc, *var) && (*loc)[varlen] == '=' &&
+                (unquoted = g_shell_unquote (*loc + varlen + 1, NULL)) != NULL &&
+                locale_name_is_valid (unquoted)) {
+                found = TRUE;
+                if (*val != NULL)
+                    g_free (*val);
+                *val = unquoted;
+            } else
+                g_free (unquoted);
+        }
+        if (!found) {
+            locale_values_free (locale_values);
+            return NULL;
+        }
+    }
+    return locale_values;
+}
+
+/* Checks the parsed values against an up-to-date index; runs on the locale
+ * queue */
+static gboolean
+locale_values_are_installed (gchar **locale_values)
+{
+    gchar **val, **var;
+
+    for (val = locale_values, var = locale_variables; *var != NULL; val++, var++)
+        if (*val != NULL && **val != '\0' && !locale_is_installed (*val, TRUE))
+            return FALSE;
+    return TRUE;
+}
+
 static void
 invoked_locale_free (struct invoked_locale *data)
 {
     if (data == NULL)
         return;
-    g_strfreev (data->locale);
+    locale_values_free (data->locale_values);
     g_free (data);
 }
 
+static void
+env_update_reply (GSList *invocations,
+                  const GError *error,
+                  gint status)
+{
+    GSList *curr;
+
+    for (curr = invocations; curr != NULL; curr = curr->next) {
+        GDBusMethodInvocation *invocation = (GDBusMethodInvocation *) curr->data;
+
+        if (error != NULL)
+            g_dbus_method_invocation_return_gerror (invocation, error);
+        else if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+            g_dbus_method_invocation_return_dbus_error (invocation, DBUS_ERROR_FAILED,
+                                                        "env-update failed");
+        else {
+            bus_invocation_set_succeeded (invocation);
+            openrc_settingsd_localed_locale1_complete_set_locale (locale1, invocation);
+        }
+    }
+    g_slist_free (invocations);
+}
+
+static void env_update_exited_cb (GPid pid, gint status, gpointer user_data);
+
+/* Called with the env_update lock held */
+static gboolean
+env_update_spawn (GError **error)
+{
+    gchar *argv[] = { ENV_UPDATE, "--no-ldconfig", NULL };
+    GPid pid;
+
+    g_debug ("Running " ENV_UPDATE " for %u locale change(s)", g_slist_length (env_update_waiters));
+    if (!g_spawn_async (NULL, argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL, &pid, error))
+        return FALSE;
+    env_update_running = TRUE;
+    g_child_watch_add (pid, env_update_exited_cb, NULL);
+    return TRUE;
+}
+
+static void
+env_update_exited_cb (GPid pid,
+                      gint status,
+                      gpointer user_data)
+{
+    GError *err = NULL;
+    GSList *done, *failed = NULL;
+
+    g_spawn_close_pid (pid);
+
+    G_LOCK (env_update);
+    env_update_running = FALSE;
+    done = g_slist_reverse (env_update_waiters);
+    env_update_waiters = NULL;
+    if (env_update_queued != NULL) {
+        /* One run covers every change that arrived during the last one */
+        env_update_waiters = env_update_queued;
+        env_update_queued = NULL;
+        if (!env_update_spawn (&err)) {
+            failed = g_slist_reverse (env_update_waiters);
+            env_update_waiters = NULL;
+        }
+    }
+    G_UNLOCK (env_update);
+
+    env_update_reply (done, NULL, status);
+    env_update_reply (failed, err, 0);
+    if (err != NULL)
+        g_error_free (err);
+}
+
+/* Completes invocation once an env-update that started after its change has
+ * finished. If changed is FALSE, the locale file was already up to date, so
+ * the invocation only waits for a run that is already due. Returns FALSE if
+ * env-update could not be started, in which case the caller replies. */
+static gboolean
+env_update_run (GDBusMethodInvocation *invocation,
+                gboolean changed,
+                GError **error)
+{
+    gboolean ret = TRUE, reply = FALSE;
+
+    G_LOCK (env_update);
+    if (env_update_running) {
+        if (changed || env_update_queued != NULL)
+            env_update_queued = g_slist_prepend (env_update_queued, invocation);
+        else
+            env_update_waiters = g_slist_prepend (env_update_waiters, invocation);
+    } else if (changed) {
+        env_update_waiters = g_slist_prepend (env_update_waiters, invocation);
+        if (!env_update_spawn (error)) {
+            env_update_waiters = g_slist_remove (env_update_waiters, invocation);
+            ret = FALSE;
+        }
+    } else
+        reply = TRUE;
+    G_UNLOCK (env_update);
+
+    if (reply)
+        env_update_reply (g_slist_prepend (NULL, invocation), NULL, 0);
+    return ret;
+}
+
 static void
 on_handle_set_locale_authorized_cb (GObject *source_object,
                                     GAsyncResult *res,
@@ -789,9 +1346,9 @@ on_handle_set_locale_authorized_cb (GObject *source_object,
 {
     GError *err = NULL;
     struct invoked_locale *data;
-    gchar **loc, **var, **val, **locale_values = NULL;
+    gchar **loc, **var, **val, **locale_values;
     ShellParser *locale_file_parsed = NULL;
-    gint status = 0;
+    gboolean locale_file_changed;
 
     data = (struct invoked_locale *) user_data;
     if (!check_polkit_finish (res, &err)) {
@@ -799,35 +1356,20 @@ on_handle_set_locale_authorized_cb (GObject *source_object,
         goto out;
     }
 
-    G_LOCK (locale);
-    locale_values = g_new0 (gchar *, g_strv_length (locale_variables) + 1);
-    /* Don't allow unknown locale variables or invalid values */
-    if (data->locale != NULL) {
-        for (loc = data->locale; *loc != NULL; loc++) {
-            gboolean found = FALSE;
-            for (val = locale_values, var = locale_variables; *var != NULL; val++, var++) {
-                size_t varlen;
-                gchar *unquoted = NULL;
-
-                varlen = strlen (*var);
-                if (g_str_has_prefix (*loc, *var) && (*loc)[varlen] == '=' &&
-                    (unquoted = g_shell_unquote (*loc + varlen + 1, NULL)) != NULL &&
-                    locale_name_is_valid (unquoted)) {
-                    found = TRUE;
-                    if (*val != NULL)
-                        g_free (*val);
-                    *val = unquoted;
-                } else
-                    g_free (unquoted);
-            }
-            if (!found) {
-                g_dbus_method_invocation_return_dbus_error (data->invocation, DBUS_ERROR_INVALID_ARGS,
-                                                            "Invalid locale variable name or value");
-                goto unlock;
-            }
-        }
+    /* An identical request queued just before this one has done the work */
+    if (bus_invocation_joined_succeeded (data->invocation)) {
+        openrc_settingsd_localed_locale1_complete_set_locale (locale1, data->invocation);
+        goto out;
     }
 
+    /* Validated by on_handle_set_locale before authorization, but only
+     * against a fresh index */
+    if (!bus_invocation_check_args (data->invocation, locale_values_are_installed (data->locale_values),
+                                    "Invalid locale variable name or value"))
+        goto out;
+    locale_values = data->locale_values;
+
+    G_LOCK (locale);
     if ((locale_file_parsed = shell_parser_new (locale_file, &err)) == NULL) {
         g_dbus_method_invocation_return_gerror (data->invocation, err);
         goto unlock;
@@ -849,7 +1391,8 @@ on_handle_set_locale_authorized_cb (GObject *source_object,
             shell_parser_set_variable (locale_file_parsed, *var, *val, TRUE);
     }
 
-    if (!shell_parser_save (locale_file_parsed, &err)) {
+    locale_file_changed = shell_parser_is_dirty (locale_file_parsed);
+    if (!shell_parser_save (locale_file_parsed, bus_invocation_get_cancellable (data->invocation), &err)) {
         g_dbus_method_invocation_return_gerror (data->invocation, err);
         goto unlock;
     }
@@ -864,28 +1407,21 @@ on_handle_set_locale_authorized_cb (GObject *source_object,
         }
     }
 
-    if (!g_spawn_command_line_sync (ENV_UPDATE " --no-ldconfig", NULL, NULL, &status, &err)) {
-        g_dbus_method_invocation_return_gerror (data->invocation, err);
-        goto unlock;
-    }
-    if (status) {
-        g_dbus_method_invocation_return_dbus_error (data->invocation, DBUS_ERROR_FAILED,
-                                                    "env-update failed");
-        goto unlock;
-    }
-
-    openrc_settingsd_localed_locale1_complete_set_locale (locale1, data->invocation);
     openrc_settingsd_localed_locale1_set_locale (locale1, (const gchar * const *) locale);
 
+    /* The environment only needs regenerating if the locale file changed.
+     * Once it has, env-update runs even if the caller has disconnected, so
+     * that the environment never lags behind the file; the reply is then
+     * simply dropped. The reply goes out when the env-update covering this
+     * change is done. */
+    if (!env_update_run (data->invocation, locale_file_changed, &err))
+        g_dbus_method_invocation_return_gerror (data->invocation, err);
+
   unlock:
     G_UNLOCK (locale);
 
   out:
     shell_parser_free (locale_file_parsed);
-    /* g_strfreev (locale_values) will leak, since it stops at first NULL value */
-    for (val = locale_values, var = locale_variables; *var != NULL; val++, var++)
-        g_free (*val);
-    g_free (locale_values);
     invoked_locale_free (data);
     if (err != NULL)
         g_error_free (err);
@@ -904,15 +1440,389 @@ on_handle_set_locale (OpenrcSettingsdLocaledLocale1 *locale1,
                                                     SERVICE_NAME " is in read-only mode");
     else {
         struct invoked_locale *data;
+        gchar **locale_values;
+
+        /* Don't allow unknown locale variables or invalid values */
+        locale_values = locale_values_parse (_locale);
+        if (!bus_invocation_check_args (invocation, locale_values != NULL, "Invalid locale variable name or value"))
+            return TRUE;
+
         data = g_new0 (struct invoked_locale, 1);
         data->invocation = invocation;
-        data->locale = g_strdupv ((gchar**)_locale);
-        check_polkit_async (g_dbus_method_invocation_get_sender (invocation), "org.freedesktop.locale1.set-locale", user_interaction, on_handle_set_locale_authorized_cb, data);
+        data->locale_values = locale_values;
+        bus_invocation_set_joinable (invocation);
+        check_polkit_async (invocation, "org.freedesktop.locale1.set-locale", user_interaction, locale_queue, on_handle_set_locale_authorized_cb, data);
+    }
+
+    return TRUE;
+}
+
+/* Catalog of the console keymaps installed under /usr/share/keymaps. It is
+ * built on the keyboard queue at startup by walking each top-level directory
+ * in its own thread, and rebuilt there on the next use after a monitored
+ * directory changes; the main loop only ever reads a fresh catalog. The
+ * walk runs without the lock, and its result is swapped in under it. */
+
+#define KEYMAP_CATALOG_THREADS 4
+#define KEYMAP_CATALOG_MAX_DEPTH 8
+
+static const gchar *keymap_suffixes[] = {
+    ".map", ".map.gz", ".map.bz2", ".map.xz", ".map.zst", NULL
+};
+
+struct keymap_walk {
+    gchar *path;
+    GPtrArray *keymaps; /* names found under path */
+    GPtrArray *dirs; /* directories visited, to be monitored */
+};
+
+static GHashTable *keymap_catalog = NULL; /* set of keymap names */
+static gchar **keymap_catalog_names = NULL; /* sorted */
+static GPtrArray *keymap_catalog_monitors = NULL;
+static GPtrArray *keymap_catalog_dirs = NULL; /* to be monitored from the main loop */
+static guint keymap_catalog_monitor_id = 0;
+static gboolean keymap_catalog_stale = TRUE;
+static guint keymap_catalog_changes = 0; /* counts monitor events */
+G_LOCK_DEFINE_STATIC (keymap_catalog);
+
+/* Returns the keymap name for a keymap file name, or NULL */
+static gchar *
+keymap_name_from_filename (const gchar *filename)
+{
+    const gchar **suffix;
+
+    for (suffix = keymap_suffixes; *suffix != NULL; suffix++)
+        if (g_str_has_suffix (filename, *suffix) && strlen (filename) > strlen (*suffix))
+            return g_strndup (filename, strlen (filename) - strlen (*suffix));
+    return NULL;
+}
+
+static void
+keymap_walk_free (struct keymap_walk *walk)
+{
+    if (walk == NULL)
+        return;
+
+    g_free (walk->path);
+    g_ptr_array_free (walk->keymaps, TRUE);
+    g_ptr_array_free (walk->dirs, TRUE);
+    g_free (walk);
+}
+
+static struct keymap_walk *
+keymap_walk_new (const gchar *path)
+{
+    struct keymap_walk *walk;
+
+    walk = g_new0 (struct keymap_walk, 1);
+    walk->path = g_strdup (path);
+    walk->keymaps = g_ptr_array_new_with_free_func (g_free);
+    walk->dirs = g_ptr_array_new_with_free_func (g_free);
+    return walk;
+}
+
+/* If subdirs is not NULL, subdirectories are collected there instead of
+ * being walked */
+static void
+keymap_walk_dir (struct keymap_walk *walk,
+                 const gchar *path,
+                 guint depth,
+                 GPtrArray *subdirs)
+{
+    const gchar *name;
+    GDir *dir;
+
+    if (depth > KEYMAP_CATALOG_MAX_DEPTH || (dir = g_dir_open (path, 0, NULL)) == NULL)
+        return;
+    g_ptr_array_add (walk->dirs, g_strdup (path));
+    while ((name = g_dir_read_name (dir)) != NULL) {
+        gchar *child, *keymap;
+
+        child = g_build_filename (path, name, NULL);
+        if (g_file_test (child, G_FILE_TEST_IS_DIR)) {
+            if (subdirs != NULL)
+                g_ptr_array_add (subdirs, g_strdup (child));
+            else
+                keymap_walk_dir (walk, child, depth + 1, NULL);
+        } else if ((keymap = keymap_name_from_filename (name)) != NULL)
+            g_ptr_array_add (walk->keymaps, keymap);
+        g_free (child);
+    }
+    g_dir_close (dir);
+}
+
+static void
+keymap_walk_thread (gpointer data,
+                    gpointer user_data)
+{
+    struct keymap_walk *walk = (struct keymap_walk *) data;
+
+    keymap_walk_dir (walk, walk->path, 1, NULL);
+}
+
+static gint
+keymap_name_compare (gconstpointer a,
+                     gconstpointer b)
+{
+    return strcmp (*(const gchar * const *)a, *(const gchar * const *)b);
+}
+
+static void
+on_keymap_dir_changed (GFileMonitor *monitor,
+                       GFile *file,
+                       GFile *other_file,
+                       GFileMonitorEvent event_type,
+                       gpointer user_data)
+{
+    G_LOCK (keymap_catalog);
+    keymap_catalog_stale = TRUE;
+    keymap_catalog_changes++;
+    G_UNLOCK (keymap_catalog);
+}
+
+static void
+keymap_catalog_add (struct keymap_walk *walk,
+                    GHashTable *catalog,
+                    GPtrArray *dirs)
+{
+    guint i;
+
+    for (i = 0; i < walk->keymaps->len; i++) {
+        gchar *keymap = g_ptr_array_index (walk->keymaps, i);
+
+        g_hash_table_replace (catalog, g_strdup (keymap), NULL);
+    }
+    for (i = 0; i < walk->dirs->len; i++)
+        g_ptr_array_add (dirs, g_strdup (g_ptr_array_index (walk->dirs, i)));
+}
+
+/* Called with the keymap_catalog lock held */
+static void
+keymap_catalog_monitors_clear (void)
+{
+    guint i;
+
+    if (keymap_catalog_monitors == NULL)
+        return;
+    for (i = 0; i < keymap_catalog_monitors->len; i++)
+        g_file_monitor_cancel (g_ptr_array_index (keymap_catalog_monitors, i));
+    g_ptr_array_free (keymap_catalog_monitors, TRUE);
+    keymap_catalog_monitors = NULL;
+}
+
+/* Replaces the monitors with ones on the directories of the last rebuild.
+ * Runs in the main thread, so that the monitors report to the main loop
+ * and are never cancelled while they emit. */
+static gboolean
+keymap_catalog_monitor_cb (gpointer user_data)
+{
+    guint i;
+
+    G_LOCK (keymap_catalog);
+    keymap_catalog_monitor_id = 0;
+    keymap_catalog_monitors_clear ();
+    keymap_catalog_monitors = g_ptr_array_new_with_free_func (g_object_unref);
+    for (i = 0; keymap_catalog_dirs != NULL && i < keymap_catalog_dirs->len; i++) {
+        GFileMonitor *monitor;
+        GFile *dir;
+
+        dir = g_file_new_for_path (g_ptr_array_index (keymap_catalog_dirs, i));
+        if ((monitor = g_file_monitor_directory (dir, G_FILE_MONITOR_NONE, NULL, NULL)) != NULL) {
+            g_signal_connect (monitor, "changed", G_CALLBACK (on_keymap_dir_changed), NULL);
+            g_ptr_array_add (keymap_catalog_monitors, monitor);
+        }
+        g_object_unref (dir);
     }
+    G_UNLOCK (keymap_catalog);
+    return FALSE;
+}
+
+static void
+keymap_catalog_clear (void)
+{
+    if (keymap_catalog_monitor_id != 0)
+        g_source_remove (keymap_catalog_monitor_id);
+    keymap_catalog_monitor_id = 0;
+    keymap_catalog_monitors_clear ();
+    if (keymap_catalog_dirs != NULL)
+        g_ptr_array_free (keymap_catalog_dirs, TRUE);
+    keymap_catalog_dirs = NULL;
+    if (keymap_catalog != NULL)
+        g_hash_table_destroy (keymap_catalog);
+    keymap_catalog = NULL;
+    g_strfreev (keymap_catalog_names);
+    keymap_catalog_names = NULL;
+    keymap_catalog_stale = TRUE;
+}
+
+/* Runs on the keyboard queue, without the keymap_catalog lock; the
+ * monitors are handed over to the main loop. A directory that changes
+ * during the walk leaves the new catalog stale. */
+static void
+keymap_catalog_rebuild (void)
+{
+    struct keymap_walk *top;
+    GPtrArray *subdirs, *walks, *names, *dirs, *old_dirs;
+    GHashTable *catalog, *old_catalog;
+    gchar **old_names;
+    GThreadPool *pool;
+    GHashTableIter iter;
+    gpointer keymap;
+    guint changes, i;
+
+    G_LOCK (keymap_catalog);
+    changes = keymap_catalog_changes;
+    G_UNLOCK (keymap_catalog);
+
+    catalog = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    dirs = g_ptr_array_new_with_free_func (g_free);
+    top = keymap_walk_new (DATADIR "/keymaps");
+    subdirs = g_ptr_array_new_with_free_func (g_free);
+    keymap_walk_dir (top, top->path, 0, subdirs);
+
+    /* Each top-level directory (i386, mac, sun, ...) is walked in parallel */
+    walks = g_ptr_array_new_with_free_func ((GDestroyNotify)keymap_walk_free);
+    pool = g_thread_pool_new (keymap_walk_thread, NULL, KEYMAP_CATALOG_THREADS, FALSE, NULL);
+    for (i = 0; i < subdirs->len; i++) {
+        struct keymap_walk *walk = keymap_walk_new (g_ptr_array_index (subdirs, i));
+
+        g_ptr_array_add (walks, walk);
+        g_thread_pool_push (pool, walk, NULL);
+    }
+    g_thread_pool_free (pool, FALSE, TRUE);
+
+    keymap_catalog_add (top, catalog, dirs);
+    for (i = 0; i < walks->len; i++)
+        keymap_catalog_add (g_ptr_array_index (walks, i), catalog, dirs);
+
+    names = g_ptr_array_new ();
+    g_hash_table_iter_init (&iter, catalog);
+    while (g_hash_table_iter_next (&iter, &keymap, NULL))
+        g_ptr_array_add (names, g_strdup (keymap));
+    g_ptr_array_sort (names, keymap_name_compare);
+    g_ptr_array_add (names, NULL);
+    g_debug ("Found %u console keymaps in %u directories", g_hash_table_size (catalog), dirs->len);
+
+    G_LOCK (keymap_catalog);
+    old_catalog = keymap_catalog;
+    old_names = keymap_catalog_names;
+    old_dirs = keymap_catalog_dirs;
+    keymap_catalog = catalog;
+    keymap_catalog_names = (gchar **) g_ptr_array_free (names, FALSE);
+    keymap_catalog_dirs = dirs;
+    keymap_catalog_stale = keymap_catalog_changes != changes;
+    if (keymap_catalog_monitor_id == 0)
+        keymap_catalog_monitor_id = g_idle_add (keymap_catalog_monitor_cb, NULL);
+    G_UNLOCK (keymap_catalog);
+
+    if (old_catalog != NULL)
+        g_hash_table_destroy (old_catalog);
+    g_strfreev (old_names);
+    if (old_dirs != NULL)
+        g_ptr_array_free (old_dirs, TRUE);
+    g_ptr_array_free (walks, TRUE);
+    g_ptr_array_free (subdirs, TRUE);
+    keymap_walk_free (top);
+}
+
+static gboolean
+keymap_catalog_is_stale (void)
+{
+    gboolean ret;
+
+    G_LOCK (keymap_catalog);
+    ret = keymap_catalog_stale;
+    G_UNLOCK (keymap_catalog);
+    return ret;
+}
+
+/* Runs on the keyboard queue */
+static void
+keymap_catalog_rebuild_cb (gpointer data,
+                           gpointer unused)
+{
+    if (keymap_catalog_is_stale ())
+        keymap_catalog_rebuild ();
+}
+
+/* Returns the keymap names, or NULL if the catalog is stale and rebuild is
+ * FALSE. rebuild may only be TRUE on the keyboard queue. */
+static gchar **
+keymap_catalog_list (gboolean rebuild)
+{
+    gchar **ret = NULL;
+
+    if (rebuild && keymap_catalog_is_stale ())
+        keymap_catalog_rebuild ();
+
+    G_LOCK (keymap_catalog);
+    if (!keymap_catalog_stale || rebuild)
+        ret = g_strdupv (keymap_catalog_names);
+    G_UNLOCK (keymap_catalog);
+    return ret;
+}
+
+/* If no keymaps are installed at all, e.g. with busybox loadkmap, any
+ * keymap is accepted. On the main loop, rebuild is FALSE and a stale
+ * catalog accepts any keymap too; the keyboard queue checks it again. */
+static gboolean
+keymap_catalog_contains (const gchar *keymap,
+                         gboolean rebuild)
+{
+    gboolean ret = TRUE;
+
+    if (keymap == NULL || *keymap == '\0')
+        return TRUE;
 
+    if (rebuild && keymap_catalog_is_stale ())
+        keymap_catalog_rebuild ();
+
+    G_LOCK (keymap_catalog);
+    if (!keymap_catalog_stale || rebuild)
+        ret = g_hash_table_size (keymap_catalog) == 0 || g_hash_table_lookup_extended (keymap_catalog, keymap, NULL, NULL);
+    G_UNLOCK (keymap_catalog);
+    return ret;
+}
+
+/* Runs on the keyboard queue */
+static void
+keymap_catalog_list_cb (gpointer data,
+                        gpointer unused)
+{
+    GDBusMethodInvocation *invocation = (GDBusMethodInvocation *) data;
+    gchar **keymaps;
+
+    keymaps = keymap_catalog_list (TRUE);
+    openrc_settingsd_ext_locale1_complete_list_vconsole_keymaps (locale1_ext, invocation, (const gchar * const *) keymaps);
+    g_strfreev (keymaps);
+}
+
+static gboolean
+on_handle_list_vconsole_keymaps (OpenrcSettingsdExtLocale1 *locale1_ext,
+                                 GDBusMethodInvocation *invocation,
+                                 gpointer user_data)
+{
+    gchar **keymaps;
+
+    /* A stale catalog is rebuilt off the main loop */
+    if ((keymaps = keymap_catalog_list (FALSE)) == NULL) {
+        work_queue_push (keyboard_queue, keymap_catalog_list_cb, invocation);
+        return TRUE;
+    }
+    openrc_settingsd_ext_locale1_complete_list_vconsole_keymaps (locale1_ext, invocation, (const gchar * const *) keymaps);
+    g_strfreev (keymaps);
     return TRUE;
 }
 
+/* Keymap names and xkb values end up in shell and xorg.conf quoting, so reject
+ * anything that could break out of it */
+static gboolean
+keyboard_arg_is_valid (const gchar *value)
+{
+    return bus_string_is_printable (value) &&
+           (value == NULL || strpbrk (value, " \t\"'\\") == NULL);
+}
+
 struct invoked_vconsole_keyboard {
     GDBusMethodInvocation *invocation;
     gchar *vconsole_keymap; /* newly allocated */
@@ -937,9 +1847,8 @@ on_handle_set_vconsole_keyboard_authorized_cb (GObject *source_object,
 {
     GError *err = NULL;
     struct invoked_vconsole_keyboard *data;
-    GList *kbd_model_map = NULL;
-    struct kbd_model_map_entry *best_entry = NULL;
-    struct xorg_confd_parser *x11_parser = NULL;
+    struct kbd_model_map *map = NULL;
+    const struct kbd_model_map_entry *best_entry = NULL;
 
     data = (struct invoked_vconsole_keyboard *) user_data;
     if (!check_polkit_finish (res, &err)) {
@@ -947,29 +1856,29 @@ on_handle_set_vconsole_keyboard_authorized_cb (GObject *source_object,
         goto out;
     }
 
+    /* An identical request queued just before this one has done the work */
+    if (bus_invocation_joined_succeeded (data->invocation)) {
+        openrc_settingsd_localed_locale1_complete_set_vconsole_keyboard (locale1, data->invocation);
+        goto out;
+    }
+
+    /* The main loop could only check a fresh catalog */
+    if (!bus_invocation_check_args (data->invocation, keymap_catalog_contains (data->vconsole_keymap, TRUE),
+                                    "Unknown console keymap '%s'", data->vconsole_keymap))
+        goto out;
+
     G_LOCK (keymaps);
     if (data->convert) {
-        GList *cur;
-
         G_LOCK (xorg_conf);
-        kbd_model_map = kbd_model_map_load (&err);
-        if (err != NULL) {
+        if ((map = kbd_model_map_get (&err)) == NULL) {
             g_dbus_method_invocation_return_gerror (data->invocation, err);
             goto unlock;
         }
-
-        for (cur = kbd_model_map; cur->next != NULL; cur = cur->next) {
-            struct kbd_model_map_entry *cur_entry = NULL;
-            cur_entry = (struct kbd_model_map_entry *) cur->data;
-            if (kbd_model_map_entry_matches_vconsole (cur_entry, data->vconsole_keymap)) {
-                best_entry = cur_entry;
-                break;
-            }
-        }
+        best_entry = kbd_model_map_lookup_vconsole (map, data->vconsole_keymap);
     }
 
     /* We do not set vconsole_keymap_toggle because there is no good equivalent for it in OpenRC */
-    if (!shell_parser_set_and_save (keymaps_file, &err, "keymap", NULL, data->vconsole_keymap, NULL)) {
+    if (!shell_parser_set_and_save (keymaps_file, bus_invocation_get_cancellable (data->invocation), &err, "keymap", NULL, data->vconsole_keymap, NULL)) {
         g_dbus_method_invocation_return_gerror (data->invocation, err);
         goto unlock;
     }
@@ -984,43 +1893,30 @@ on_handle_set_vconsole_keyboard_authorized_cb (GObject *source_object,
             filename = g_file_get_path (kbd_model_map_file);
             g_printerr ("Failed to find conversion entry for console keymap '%s' in '%s'\n", data->vconsole_keymap, filename);
             g_free (filename);
-            G_UNLOCK (xorg_conf);
         } else {
+            struct kbd_model_map_query query;
             unsigned int failure_score = 0;
 
-            kbd_model_map_entry_matches_x11 (best_entry, x11_layout, x11_model, x11_variant, x11_options, &failure_score);
+            /* The x11_* copies are replaced whenever the index is
+             * published, so read the values in effect from the index */
+            G_LOCK (xorg_confd_index);
+            kbd_model_map_query_init (&query, map, xorg_confd_index_value (XKB_LAYOUT), xorg_confd_index_value (XKB_MODEL),
+                                      xorg_confd_index_value (XKB_VARIANT), xorg_confd_index_value (XKB_OPTIONS));
+            G_UNLOCK (xorg_confd_index);
+            kbd_model_map_entry_matches_x11 (map, best_entry, &query, &failure_score);
+            kbd_model_map_query_clear (&query);
             if (failure_score > 0) {
                 /* The xkb data has changed, so we want to update it */
-                if (!g_file_query_exists (x11_gentoo_file, NULL) && g_file_query_exists (x11_systemd_file, NULL))
-                    x11_parser = xorg_confd_parser_new (x11_systemd_file, &err);
-                else
-                    x11_parser = xorg_confd_parser_new (x11_gentoo_file, &err);
-
-                if (x11_parser == NULL) {
-                    g_dbus_method_invocation_return_gerror (data->invocation, err);
-                    goto unlock;
-                }
-                xorg_confd_parser_set_xkb (x11_parser, best_entry->x11_layout, best_entry->x11_model, best_entry->x11_variant, best_entry->x11_options);
-                if (!xorg_confd_parser_save (x11_parser, &err)) {
+                if (!xorg_confd_index_set_xkb (best_entry->x11_layout, best_entry->x11_model, best_entry->x11_variant, best_entry->x11_options,
+                                               bus_invocation_get_cancellable (data->invocation), &err)) {
                     g_dbus_method_invocation_return_gerror (data->invocation, err);
                     goto unlock;
                 }
-                g_free (x11_layout);
-                g_free (x11_model);
-                g_free (x11_variant);
-                g_free (x11_options);
-                x11_layout = g_strdup (best_entry->x11_layout);
-                x11_model = g_strdup (best_entry->x11_model);
-                x11_variant = g_strdup (best_entry->x11_variant);
-                x11_options = g_strdup (best_entry->x11_options);
-                openrc_settingsd_localed_locale1_set_x11_layout (locale1, x11_layout);
-                openrc_settingsd_localed_locale1_set_x11_model (locale1, x11_model);
-                openrc_settingsd_localed_locale1_set_x11_variant (locale1, x11_variant);
-                openrc_settingsd_localed_locale1_set_x11_options (locale1, x11_options);
             }
         }
     }
     /* We do not modify vconsole_keymap_toggle because there is no good equivalent for it in OpenRC */
+    bus_invocation_set_succeeded (data->invocation);
     openrc_settingsd_localed_locale1_complete_set_vconsole_keyboard (locale1, data->invocation);
 
   unlock:
@@ -1029,9 +1925,7 @@ on_handle_set_vconsole_keyboard_authorized_cb (GObject *source_object,
     G_UNLOCK (keymaps);
 
   out:
-    if (kbd_model_map != NULL)
-        g_list_free_full (kbd_model_map, (GDestroyNotify)kbd_model_map_entry_free);
-    xorg_confd_parser_free (x11_parser);
+    kbd_model_map_unref (map);
     invoked_vconsole_keyboard_free (data);
     if (err != NULL)
         g_error_free (err);
@@ -1050,14 +1944,18 @@ on_handle_set_vconsole_keyboard (OpenrcSettingsdLocaledLocale1 *locale1,
         g_dbus_method_invocation_return_dbus_error (invocation,
                                                     DBUS_ERROR_NOT_SUPPORTED,
                                                     SERVICE_NAME " is in read-only mode");
-    else {
+    else if (bus_invocation_check_args (invocation, keyboard_arg_is_valid (keymap) && keyboard_arg_is_valid (keymap_toggle),
+                                        "Invalid console keymap '%s'", keymap) &&
+             bus_invocation_check_args (invocation, keymap_catalog_contains (keymap, FALSE),
+                                        "Unknown console keymap '%s'", keymap)) {
         struct invoked_vconsole_keyboard *data;
         data = g_new0 (struct invoked_vconsole_keyboard, 1);
         data->invocation = invocation;
         data->vconsole_keymap = g_strdup (keymap);
         data->vconsole_keymap_toggle = g_strdup (keymap_toggle);
         data->convert = convert;
-        check_polkit_async (g_dbus_method_invocation_get_sender (invocation), "org.freedesktop.locale1.set-keyboard", user_interaction, on_handle_set_vconsole_keyboard_authorized_cb, data);
+        bus_invocation_set_joinable (invocation);
+        check_polkit_async (invocation, "org.freedesktop.locale1.set-keyboard", user_interaction, keyboard_queue, on_handle_set_vconsole_keyboard_authorized_cb, data);
     }
 
     return TRUE;
@@ -1091,10 +1989,8 @@ on_handle_set_x11_keyboard_authorized_cb (GObject *source_object,
 {
     GError *err = NULL;
     struct invoked_x11_keyboard *data;
-    GList *kbd_model_map = NULL;
-    struct kbd_model_map_entry *best_entry = NULL;
-    unsigned int best_failure_score = UINT_MAX;
-    struct xorg_confd_parser *x11_parser = NULL;
+    struct kbd_model_map *map = NULL;
+    const struct kbd_model_map_entry *best_entry = NULL;
 
     data = (struct invoked_x11_keyboard *) user_data;
     if (!check_polkit_finish (res, &err)) {
@@ -1102,56 +1998,32 @@ on_handle_set_x11_keyboard_authorized_cb (GObject *source_object,
         goto out;
     }
 
+    /* An identical request queued just before this one has done the work */
+    if (bus_invocation_joined_succeeded (data->invocation)) {
+        openrc_settingsd_localed_locale1_complete_set_x11_keyboard (locale1, data->invocation);
+        goto out;
+    }
+
+    if (data->convert)
+        G_LOCK (keymaps);
     G_LOCK (xorg_conf);
     if (data->convert) {
-        GList *cur;
+        struct kbd_model_map_query query;
 
-        G_LOCK (keymaps);
-        kbd_model_map = kbd_model_map_load (&err);
-        if (err != NULL) {
+        if ((map = kbd_model_map_get (&err)) == NULL) {
             g_dbus_method_invocation_return_gerror (data->invocation, err);
             goto unlock;
         }
-
-        for (cur = kbd_model_map; cur->next != NULL; cur = cur->next) {
-            struct kbd_model_map_entry *cur_entry = NULL;
-            unsigned int cur_failure_score = 0;
-
-            cur_entry = (struct kbd_model_map_entry *) cur->data;
-            if (kbd_model_map_entry_matches_x11 (cur_entry, data->x11_layout, data->x11_model, data->x11_variant, data->x11_options, &cur_failure_score))
-                if (cur_failure_score < best_failure_score) {
-                    best_entry = cur_entry;
-                    best_failure_score = cur_failure_score;
-                }
-        }
+        kbd_model_map_query_init (&query, map, data->x11_layout, data->x11_model, data->x11_variant, data->x11_options);
+        best_entry = kbd_model_map_lookup_x11 (map, &query);
+        kbd_model_map_query_clear (&query);
     }
 
-    if (!g_file_query_exists (x11_gentoo_file, NULL) && g_file_query_exists (x11_systemd_file, NULL))
-        x11_parser = xorg_confd_parser_new (x11_systemd_file, &err);
-    else
-        x11_parser = xorg_confd_parser_new (x11_gentoo_file, &err);
-
-    if (x11_parser == NULL) {
-        g_dbus_method_invocation_return_gerror (data->invocation, err);
-        goto unlock;
-    }
-    xorg_confd_parser_set_xkb (x11_parser, data->x11_layout, data->x11_model, data->x11_variant, data->x11_options);
-    if (!xorg_confd_parser_save (x11_parser, &err)) {
+    if (!xorg_confd_index_set_xkb (data->x11_layout, data->x11_model, data->x11_variant, data->x11_options,
+                                   bus_invocation_get_cancellable (data->invocation), &err)) {
         g_dbus_method_invocation_return_gerror (data->invocation, err);
         goto unlock;
     }
-    g_free (x11_layout);
-    g_free (x11_model);
-    g_free (x11_variant);
-    g_free (x11_options);
-    x11_layout = g_strdup (data->x11_layout);
-    x11_model = g_strdup (data->x11_model);
-    x11_variant = g_strdup (data->x11_variant);
-    x11_options = g_strdup (data->x11_options);
-    openrc_settingsd_localed_locale1_set_x11_layout (locale1, x11_layout);
-    openrc_settingsd_localed_locale1_set_x11_model (locale1, x11_model);
-    openrc_settingsd_localed_locale1_set_x11_variant (locale1, x11_variant);
-    openrc_settingsd_localed_locale1_set_x11_options (locale1, x11_options);
 
     if (data->convert) {
         if (best_entry == NULL) {
@@ -1160,7 +2032,7 @@ on_handle_set_x11_keyboard_authorized_cb (GObject *source_object,
             g_printerr ("Failed to find conversion entry for x11 layout '%s' in '%s'\n", data->x11_layout, filename);
             g_free (filename);
         } else {
-            if (!shell_parser_set_and_save (keymaps_file, &err, "keymap", NULL, best_entry->vconsole_keymap, NULL)) {
+            if (!shell_parser_set_and_save (keymaps_file, bus_invocation_get_cancellable (data->invocation), &err, "keymap", NULL, best_entry->vconsole_keymap, NULL)) {
                 g_dbus_method_invocation_return_gerror (data->invocation, err);
                 goto unlock;
             }
@@ -1170,17 +2042,16 @@ on_handle_set_x11_keyboard_authorized_cb (GObject *source_object,
         }
     }
 
+    bus_invocation_set_succeeded (data->invocation);
     openrc_settingsd_localed_locale1_complete_set_x11_keyboard (locale1, data->invocation);
 
   unlock:
+    G_UNLOCK (xorg_conf);
     if (data->convert)
         G_UNLOCK (keymaps);
-    G_UNLOCK (xorg_conf);
 
   out:
-    if (kbd_model_map != NULL)
-        g_list_free_full (kbd_model_map, (GDestroyNotify)kbd_model_map_entry_free);
-    xorg_confd_parser_free (x11_parser);
+    kbd_model_map_unref (map);
     invoked_x11_keyboard_free (data);
     if (err != NULL)
         g_error_free (err);
@@ -1201,7 +2072,9 @@ on_handle_set_x11_keyboard (OpenrcSettingsdLocaledLocale1 *locale1,
         g_dbus_method_invocation_return_dbus_error (invocation,
                                                     DBUS_ERROR_NOT_SUPPORTED,
                                                     SERVICE_NAME " is in read-only mode");
-    else {
+    else if (bus_invocation_check_args (invocation, keyboard_arg_is_valid (layout) && keyboard_arg_is_valid (model) &&
+                                        keyboard_arg_is_valid (variant) && keyboard_arg_is_valid (options),
+                                        "Invalid X11 keyboard layout, model, variant or options")) {
         struct invoked_x11_keyboard *data;
         data = g_new0 (struct invoked_x11_keyboard, 1);
         data->invocation = invocation;
@@ -1210,7 +2083,8 @@ on_handle_set_x11_keyboard (OpenrcSettingsdLocaledLocale1 *locale1,
         data->x11_variant = g_strdup (variant);
         data->x11_options = g_strdup (options);
         data->convert = convert;
-        check_polkit_async (g_dbus_method_invocation_get_sender (invocation), "org.freedesktop.locale1.set-keyboard", user_interaction, on_handle_set_x11_keyboard_authorized_cb, data);
+        bus_invocation_set_joinable (invocation);
+        check_polkit_async (invocation, "org.freedesktop.locale1.set-keyboard", user_interaction, keyboard_queue, on_handle_set_x11_keyboard_authorized_cb, data);
     }
 
     return TRUE;
@@ -1221,7 +2095,6 @@ on_bus_acquired (GDBusConnection *connection,
                  const gchar     *bus_name,
                  gpointer         user_data)
 {
-    gchar *name;
     GError *err = NULL;
 
     g_debug ("Acquired a message bus connection");
@@ -1231,10 +2104,12 @@ on_bus_acquired (GDBusConnection *connection,
     openrc_settingsd_localed_locale1_set_locale (locale1, (const gchar * const *) locale);
     openrc_settingsd_localed_locale1_set_vconsole_keymap (locale1, vconsole_keymap);
     openrc_settingsd_localed_locale1_set_vconsole_keymap_toggle (locale1, vconsole_keymap_toggle);
+    G_LOCK (xorg_confd_index);
     openrc_settingsd_localed_locale1_set_x11_layout (locale1, x11_layout);
     openrc_settingsd_localed_locale1_set_x11_model (locale1, x11_model);
     openrc_settingsd_localed_locale1_set_x11_variant (locale1, x11_variant);
     openrc_settingsd_localed_locale1_set_x11_options (locale1, x11_options);
+    G_UNLOCK (xorg_confd_index);
 
     g_signal_connect (locale1, "handle-set-locale", G_CALLBACK (on_handle_set_locale), NULL);
     g_signal_connect (locale1, "handle-set-vconsole-keyboard", G_CALLBACK (on_handle_set_vconsole_keyboard), NULL);
@@ -1249,6 +2124,18 @@ on_bus_acquired (GDBusConnection *connection,
             openrc_settingsd_exit (1);
         }
     }
+
+    locale1_ext = openrc_settingsd_ext_locale1_skeleton_new ();
+    g_signal_connect (locale1_ext, "handle-list-vconsole-keymaps", G_CALLBACK (on_handle_list_vconsole_keymaps), NULL);
+    if (!g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (locale1_ext),
+                                           connection,
+                                           "/org/freedesktop/locale1",
+                                           &err)) {
+        if (err != NULL) {
+            g_critical ("Failed to export extension interface on /org/freedesktop/locale1: %s", err->message);
+            openrc_settingsd_exit (1);
+        }
+    }
 }
 
 static void
@@ -1277,14 +2164,25 @@ localed_init (gboolean _read_only)
 {
     GError *err = NULL;
     gchar **locale_values = NULL;
-    struct xorg_confd_parser *x11_parser = NULL;
 
     read_only = _read_only;
+    locale_queue = work_queue_new ("locale");
+    keyboard_queue = work_queue_new ("keyboard");
+    work_queue_push (keyboard_queue, keymap_catalog_rebuild_cb, NULL);
     kbd_model_map_file = g_file_new_for_path (PKGDATADIR "/kbd-model-map");
     locale_file = g_file_new_for_path (SYSCONFDIR "/env.d/02locale");
+    locale_archive_dir = g_file_new_for_path (COMPLOCALEDIR);
+    if ((locale_archive_monitor = g_file_monitor_directory (locale_archive_dir, G_FILE_MONITOR_NONE, NULL, &err)) != NULL)
+        g_signal_connect (locale_archive_monitor, "changed", G_CALLBACK (on_locale_archive_dir_changed), NULL);
+    else {
+        g_debug ("Unable to monitor " COMPLOCALEDIR ": %s", err->message);
+        g_clear_error (&err);
+    }
+    work_queue_push (locale_queue, locale_index_rebuild_cb, NULL);
     keymaps_file = g_file_new_for_path (SYSCONFDIR "/conf.d/keymaps");
 
     /* See http://www.gentoo.org/doc/en/xorg-config.xml */
+    x11_confd_dir = g_file_new_for_path (SYSCONFDIR "/X11/xorg.conf.d");
     x11_gentoo_file = g_file_new_for_path (SYSCONFDIR "/X11/xorg.conf.d/30-keyboard.conf");
     x11_systemd_file = g_file_new_for_path (SYSCONFDIR "/X11/xorg.conf.d/00-keyboard.conf");
 
@@ -1319,19 +2217,17 @@ localed_init (gboolean _read_only)
     /* We don't have a good equivalent for this in openrc at the moment */
     vconsole_keymap_toggle = g_strdup ("");
 
-    kbd_model_map_regex_init ();
-    xorg_confd_regex_init ();
-
-    if (!g_file_query_exists (x11_gentoo_file, NULL) && g_file_query_exists (x11_systemd_file, NULL))
-        x11_parser = xorg_confd_parser_new (x11_systemd_file, &err);
-    else
-        x11_parser = xorg_confd_parser_new (x11_gentoo_file, &err);
-
-    if (x11_parser != NULL) {
-        xorg_confd_parser_get_xkb (x11_parser, &x11_layout, &x11_model, &x11_variant, &x11_options);
-        xorg_confd_parser_free (x11_parser);
-    } else {
-        g_debug ("%s", err->message);
+    G_LOCK (xorg_conf);
+    xorg_confd_index = g_ptr_array_new_with_free_func ((GDestroyNotify)xorg_confd_index_file_free);
+    xorg_confd_index_scan ();
+    G_LOCK (xorg_confd_index);
+    xorg_confd_index_publish ();
+    G_UNLOCK (xorg_confd_index);
+    G_UNLOCK (xorg_conf);
+    if ((xorg_confd_monitor = g_file_monitor_directory (x11_confd_dir, G_FILE_MONITOR_NONE, NULL, &err)) != NULL)
+        g_signal_connect (xorg_confd_monitor, "changed", G_CALLBACK (on_xorg_confd_changed), NULL);
+    else {
+        g_debug ("Unable to monitor xorg.conf.d: %s", err->message);
         g_clear_error (&err);
     }
 
@@ -1348,12 +2244,44 @@ localed_init (gboolean _read_only)
 void
 localed_destroy (void)
 {
+    work_queue_free (locale_queue);
+    work_queue_free (keyboard_queue);
     g_bus_unown_name (bus_id);
     bus_id = 0;
     read_only = FALSE;
     g_strfreev (locale);
-    kbd_model_map_regex_destroy ();
-    xorg_confd_regex_destroy ();
+    G_LOCK (kbd_model_map);
+    kbd_model_map_unref (kbd_model_map);
+    kbd_model_map = NULL;
+    G_UNLOCK (kbd_model_map);
+    if (xorg_confd_monitor != NULL) {
+        g_file_monitor_cancel (xorg_confd_monitor);
+        g_object_unref (xorg_confd_monitor);
+        xorg_confd_monitor = NULL;
+    }
+    G_LOCK (xorg_confd_index);
+    g_ptr_array_free (xorg_confd_index, TRUE);
+    xorg_confd_index = NULL;
+    G_UNLOCK (xorg_confd_index);
+    if (locale_archive_monitor != NULL) {
+        g_file_monitor_cancel (locale_archive_monitor);
+        g_object_unref (locale_archive_monitor);
+        locale_archive_monitor = NULL;
+    }
+    G_LOCK (keymap_catalog);
+    keymap_catalog_clear ();
+    G_UNLOCK (keymap_catalog);
+    G_LOCK (locale_index);
+    if (locale_index != NULL)
+        g_hash_table_destroy (locale_index);
+    locale_index = NULL;
+    locale_index_stale = TRUE;
+    G_UNLOCK (locale_index);
+    G_LOCK (xorg_confd_parser_cache);
+    if (xorg_confd_parser_cache != NULL)
+        g_hash_table_destroy (xorg_confd_parser_cache);
+    xorg_confd_parser_cache = NULL;
+    G_UNLOCK (xorg_confd_parser_cache);
     g_free (vconsole_keymap);
     g_free (vconsole_keymap_toggle);
     g_free (x11_layout);
@@ -1362,7 +2290,9 @@ localed_destroy (void)
     g_free (x11_options);
 
     g_object_unref (locale_file);
+    g_object_unref (locale_archive_dir);
     g_object_unref (keymaps_file);
+    g_object_unref (x11_confd_dir);
     g_object_unref (x11_gentoo_file);
     g_object_unref (x11_systemd_file);
     g_object_unref (kbd_model_map_file);
@@ -17,6 +17,7 @@
 */
 
 #include <errno.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
@@ -24,6 +25,7 @@
 #include <libdaemon/dfork.h>
 
 #include <glib.h>
+#include <glib-unix.h>
 #include <gio/gio.h>
 
 #if HAVE_OPENRC
@@ -48,6 +50,17 @@ static gboolean update_rc_status = FALSE;
 #endif
 static gboolean print_version = FALSE;
 static gchar *ntp_preferred_service = NULL;
+static gchar *fsync_policy_name = NULL;
+static gint machine_info_commit_delay = 20;
+static gint polkit_cache_ttl = 0;
+static gboolean local_auth = FALSE;
+static gchar *trusted_group = NULL;
+static gint polkit_timeout = 25;
+static gint polkit_breaker_threshold = 3;
+static gint polkit_breaker_probe_interval = 30;
+static gint max_requests = 64;
+static gint max_queued_requests = 256;
+static gint max_sender_requests = 8;
 
 static guint components_started = 0;
 G_LOCK_DEFINE_STATIC (components_started);
@@ -60,6 +73,17 @@ static GOptionEntry option_entries[] =
     { "foreground", 0, 0, G_OPTION_ARG_NONE, &foreground, "Do not daemonize", NULL },
     { "read-only", 0, 0, G_OPTION_ARG_NONE, &read_only, "Run in read-only mode", NULL },
     { "ntp-service", 0, 0, G_OPTION_ARG_STRING, &ntp_preferred_service, "Preferred rc NTP service for timedated", NULL },
+    { "machine-info-delay", 0, 0, G_OPTION_ARG_INT, &machine_info_commit_delay, "Milliseconds to batch machine-info changes before saving (default: 20)", "MS" },
+    { "polkit-cache-ttl", 0, 0, G_OPTION_ARG_INT, &polkit_cache_ttl, "Seconds to remember non-interactive polkit authorizations (default: 0, disabled)", "SECONDS" },
+    { "local-auth", 0, 0, G_OPTION_ARG_NONE, &local_auth, "Authorize requests from root without asking polkit", NULL },
+    { "trusted-group", 0, 0, G_OPTION_ARG_STRING, &trusted_group, "Also authorize members of GROUP without asking polkit", "GROUP" },
+    { "polkit-timeout", 0, 0, G_OPTION_ARG_INT, &polkit_timeout, "Seconds to wait for a non-interactive polkit answer (default: 25, 0 waits forever)", "SECONDS" },
+    { "polkit-breaker-threshold", 0, 0, G_OPTION_ARG_INT, &polkit_breaker_threshold, "Consecutive polkit timeouts before failing checks immediately (default: 3, 0 disables)", "N" },
+    { "polkit-breaker-probe", 0, 0, G_OPTION_ARG_INT, &polkit_breaker_probe_interval, "Seconds between checks that probe an unresponsive polkit (default: 30)", "SECONDS" },
+    { "max-requests", 0, 0, G_OPTION_ARG_INT, &max_requests, "Requests to process at once before queueing (default: 64, 0 for no limit)", "N" },
+    { "max-queued-requests", 0, 0, G_OPTION_ARG_INT, &max_queued_requests, "Requests to queue before rejecting (default: 256, 0 for no limit)", "N" },
+    { "max-sender-requests", 0, 0, G_OPTION_ARG_INT, &max_sender_requests, "Pending requests allowed per client (default: 8, 0 for no limit)", "N" },
+    { "fsync", 0, 0, G_OPTION_ARG_STRING, &fsync_policy_name, "When to fsync saved settings files: none, file (default) or dir", "POLICY" },
 #if HAVE_OPENRC
     { "update-rc-status", 0, 0, G_OPTION_ARG_NONE, &update_rc_status, "Force openrc-settingsd rc service to be marked as started", NULL },
 #endif
@@ -67,6 +91,13 @@ static GOptionEntry option_entries[] =
     { NULL }
 };
 
+static gboolean
+on_sigusr1 (gpointer user_data)
+{
+    utils_log_stats ();
+    return TRUE;
+}
+
 static int
 log_level_to_syslog (GLogLevelFlags log_level)
 {
@@ -209,6 +240,7 @@ main (gint argc, gchar *argv[])
     GError *error = NULL;
     GOptionContext *option_context;
     GMainLoop *loop = NULL;
+    FileFsyncPolicy fsync_policy;
     pid_t pid;
 
     g_log_set_default_handler (log_handler, NULL);
@@ -225,6 +257,41 @@ main (gint argc, gchar *argv[])
         return 0;
     }
 
+    if (!file_fsync_policy_parse (fsync_policy_name, &fsync_policy)) {
+        g_critical ("Invalid fsync policy '%s'", fsync_policy_name);
+        return 1;
+    }
+
+    if (machine_info_commit_delay < 0) {
+        g_critical ("Invalid machine-info delay %d", machine_info_commit_delay);
+        return 1;
+    }
+
+    if (polkit_cache_ttl < 0) {
+        g_critical ("Invalid polkit cache TTL %d", polkit_cache_ttl);
+        return 1;
+    }
+
+    if (polkit_timeout < 0) {
+        g_critical ("Invalid polkit timeout %d", polkit_timeout);
+        return 1;
+    }
+
+    if (polkit_breaker_threshold < 0) {
+        g_critical ("Invalid polkit breaker threshold %d", polkit_breaker_threshold);
+        return 1;
+    }
+
+    if (polkit_breaker_probe_interval <= 0) {
+        g_critical ("Invalid polkit breaker probe interval %d", polkit_breaker_probe_interval);
+        return 1;
+    }
+
+    if (max_requests < 0 || max_queued_requests < 0 || max_sender_requests < 0) {
+        g_critical ("Invalid request limits %d, %d, %d", max_requests, max_queued_requests, max_sender_requests);
+        return 1;
+    }
+
     if (!foreground) {
         if (daemon_retval_init () < 0) {
             g_critical ("Failed to create pipe");
@@ -253,8 +320,11 @@ main (gint argc, gchar *argv[])
         daemon_close_all (-1);
     }
 
-    utils_init ();
-    hostnamed_init (read_only);
+    utils_init (fsync_policy, polkit_cache_ttl, local_auth, trusted_group,
+                polkit_timeout, polkit_breaker_threshold, polkit_breaker_probe_interval);
+    utils_set_admission_limits (max_requests, max_queued_requests, max_sender_requests);
+    g_unix_signal_add (SIGUSR1, on_sigusr1, NULL);
+    hostnamed_init (read_only, machine_info_commit_delay);
     localed_init (read_only);
     timedated_init (read_only, ntp_preferred_service);
     loop = g_main_loop_new (NULL, FALSE);
@@ -269,5 +339,7 @@ main (gint argc, gchar *argv[])
 
     g_clear_error (&error);
     g_free (ntp_preferred_service);
+    g_free (fsync_policy_name);
+    g_free (trusted_group);
     openrc_settingsd_exit (0);
 }
@@ -0,0 +1,372 @@
+/*
+  Copyright 2012 Alexandre Rostovtsev
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Tests for the polkit authority handling in utils.c. They run a private
+ * dbus-daemon as the system bus, with a mock org.freedesktop.PolicyKit1 that
+ * authorizes everything and counts the requests it sees. */
+
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "utils.h"
+
+#include "config.h"
+
+#define MOCK_POLKIT_NAME "org.freedesktop.PolicyKit1"
+#define MOCK_POLKIT_PATH "/org/freedesktop/PolicyKit1/Authority"
+#define MOCK_POLKIT_INTERFACE "org.freedesktop.PolicyKit1.Authority"
+
+#define TEST_PATH "/org/openrc/settingsd/Test"
+#define TEST_INTERFACE "org.openrc.settingsd.Test"
+#define TEST_ACTION_ID "org.openrc.settingsd.test"
+
+#define TEST_TIMEOUT (10 * G_USEC_PER_SEC)
+
+static const gchar mock_polkit_xml[] =
+    "<node>"
+    "  <interface name='" MOCK_POLKIT_INTERFACE "'>"
+    "    <method name='CheckAuthorization'>"
+    "      <arg type='(sa{sv})' name='subject' direction='in'/>"
+    "      <arg type='s' name='action_id' direction='in'/>"
+    "      <arg type='a{ss}' name='details' direction='in'/>"
+    "      <arg type='u' name='flags' direction='in'/>"
+    "      <arg type='s' name='cancellation_id' direction='in'/>"
+    "      <arg type='(bba{ss})' name='result' direction='out'/>"
+    "    </method>"
+    "    <method name='CancelCheckAuthorization'>"
+    "      <arg type='s' name='cancellation_id' direction='in'/>"
+    "    </method>"
+    "    <property type='s' name='BackendName' access='read'/>"
+    "    <property type='s' name='BackendVersion' access='read'/>"
+    "    <property type='u' name='BackendFeatures' access='read'/>"
+    "    <signal name='Changed'/>"
+    "  </interface>"
+    "</node>";
+
+static const gchar test_xml[] =
+    "<node>"
+    "  <interface name='" TEST_INTERFACE "'>"
+    "    <method name='Check'/>"
+    "  </interface>"
+    "</node>";
+
+static GTestDBus *test_bus = NULL;
+static GDBusConnection *mock_polkit_connection = NULL;
+static GDBusConnection *client_connection = NULL;
+
+/* Updated from the mock's worker thread, so only touched atomically */
+static gint mock_polkit_get_all_calls = 0;
+static gint mock_polkit_check_calls = 0;
+static gint mock_polkit_bad_subjects = 0;
+
+static gint test_replies = 0;
+static gint test_errors = 0;
+
+/* Counts the authority fetches: a PolkitAuthority loads the properties of
+ * the Authority object once, when it is created */
+static GDBusMessage *
+mock_polkit_filter (GDBusConnection *connection,
+                    GDBusMessage *message,
+                    gboolean incoming,
+                    gpointer user_data)
+{
+    if (incoming &&
+        g_dbus_message_get_message_type (message) == G_DBUS_MESSAGE_TYPE_METHOD_CALL &&
+        g_strcmp0 (g_dbus_message_get_path (message), MOCK_POLKIT_PATH) == 0 &&
+        g_strcmp0 (g_dbus_message_get_interface (message), "org.freedesktop.DBus.Properties") == 0 &&
+        g_strcmp0 (g_dbus_message_get_member (message), "GetAll") == 0)
+        g_atomic_int_inc (&mock_polkit_get_all_calls);
+
+    return message;
+}
+
+static void
+mock_polkit_method_call (GDBusConnection *connection,
+                         const gchar *sender,
+                         const gchar *object_path,
+                         const gchar *interface_name,
+                         const gchar *method_name,
+                         GVariant *parameters,
+                         GDBusMethodInvocation *invocation,
+                         gpointer user_data)
+{
+    GVariant *subject_details = NULL;
+    const gchar *kind = NULL, *name = NULL, *action_id = NULL;
+
+    if (g_strcmp0 (method_name, "CheckAuthorization") != 0) {
+        g_dbus_method_invocation_return_value (invocation, NULL);
+        return;
+    }
+
+    g_atomic_int_inc (&mock_polkit_check_calls);
+
+    /* The subject must be the caller of the daemon, not the daemon itself */
+    g_variant_get (parameters, "((&s@a{sv})&s@a{ss}u&s)", &kind, &subject_details, &action_id, NULL, NULL, NULL);
+    if (g_strcmp0 (kind, "system-bus-name") != 0 ||
+        !g_variant_lookup (subject_details, "name", "&s", &name) ||
+        g_strcmp0 (name, g_dbus_connection_get_unique_name (client_connection)) != 0 ||
+        g_strcmp0 (action_id, TEST_ACTION_ID) != 0)
+        g_atomic_int_inc (&mock_polkit_bad_subjects);
+    g_variant_unref (subject_details);
+
+    g_dbus_method_invocation_return_value (invocation,
+        g_variant_new ("((bb@a{ss}))", TRUE, FALSE, g_variant_new_array (G_VARIANT_TYPE ("{ss}"), NULL, 0)));
+}
+
+static GVariant *
+mock_polkit_get_property (GDBusConnection *connection,
+                          const gchar *sender,
+                          const gchar *object_path,
+                          const gchar *interface_name,
+                          const gchar *property_name,
+                          GError **error,
+                          gpointer user_data)
+{
+    if (g_strcmp0 (property_name, "BackendFeatures") == 0)
+        return g_variant_new_uint32 (0);
+    return g_variant_new_string ("mock");
+}
+
+static const GDBusInterfaceVTable mock_polkit_vtable = {
+    mock_polkit_method_call,
+    mock_polkit_get_property,
+    NULL
+};
+
+/* The daemon side: each Check call is authorized via check_polkit_async, the
+ * way the settings daemons authorize their setters */
+static void
+test_check_cb (GObject *source_object,
+               GAsyncResult *res,
+               gpointer user_data)
+{
+    GDBusMethodInvocation *invocation = G_DBUS_METHOD_INVOCATION (user_data);
+    GError *err = NULL;
+
+    if (check_polkit_finish (res, &err))
+        g_dbus_method_invocation_return_value (invocation, NULL);
+    else {
+        g_dbus_method_invocation_return_gerror (invocation, err);
+        g_error_free (err);
+    }
+}
+
+static void
+test_method_call (GDBusConnection *connection,
+                  const gchar *sender,
+                  const gchar *object_path,
+                  const gchar *interface_name,
+                  const gchar *method_name,
+                  GVariant *parameters,
+                  GDBusMethodInvocation *invocation,
+                  gpointer user_data)
+{
+    check_polkit_async (invocation, TEST_ACTION_ID, FALSE, NULL, test_check_cb, invocation);
+}
+
+static const GDBusInterfaceVTable test_vtable = {
+    test_method_call,
+    NULL,
+    NULL
+};
+
+static GDBusConnection *
+test_connection_new (void)
+{
+    GDBusConnection *connection;
+    GError *err = NULL;
+
+    connection = g_dbus_connection_new_for_address_sync (g_test_dbus_get_bus_address (test_bus),
+                                                         G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                         G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                         NULL, NULL, &err);
+    g_assert_no_error (err);
+    return connection;
+}
+
+static guint
+test_register_object (GDBusConnection *connection,
+                      const gchar *xml,
+                      const gchar *path,
+                      const GDBusInterfaceVTable *vtable)
+{
+    GDBusNodeInfo *info;
+    GError *err = NULL;
+    guint id;
+
+    info = g_dbus_node_info_new_for_xml (xml, &err);
+    g_assert_no_error (err);
+    id = g_dbus_connection_register_object (connection, path, info->interfaces[0], vtable, NULL, NULL, &err);
+    g_assert_no_error (err);
+    g_dbus_node_info_unref (info);
+    return id;
+}
+
+static void
+mock_polkit_start (void)
+{
+    GVariant *result;
+    GError *err = NULL;
+    guint32 reply = 0;
+
+    mock_polkit_connection = test_connection_new ();
+    g_dbus_connection_add_filter (mock_polkit_connection, mock_polkit_filter, NULL, NULL);
+    test_register_object (mock_polkit_connection, mock_polkit_xml, MOCK_POLKIT_PATH, &mock_polkit_vtable);
+
+    /* Own the name before utils_init looks for the authority */
+    result = g_dbus_connection_call_sync (mock_polkit_connection, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                                          "org.freedesktop.DBus", "RequestName",
+                                          g_variant_new ("(su)", MOCK_POLKIT_NAME, 0), G_VARIANT_TYPE ("(u)"),
+                                          G_DBUS_CALL_FLAGS_NONE, -1, NULL, &err);
+    g_assert_no_error (err);
+    g_variant_get (result, "(u)", &reply);
+    g_assert_cmpuint (reply, ==, 1); /* DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER */
+    g_variant_unref (result);
+}
+
+static gboolean
+test_wakeup_cb (gpointer user_data)
+{
+    return G_SOURCE_CONTINUE;
+}
+
+/* Runs the default main context until *counter reaches value */
+static void
+test_wait_for (gint *counter,
+               gint value)
+{
+    gint64 deadline;
+    guint wakeup_id;
+
+    deadline = g_get_monotonic_time () + TEST_TIMEOUT;
+    wakeup_id = g_timeout_add (10, test_wakeup_cb, NULL);
+    while (g_atomic_int_get (counter) < value) {
+        g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+        g_main_context_iteration (NULL, TRUE);
+    }
+    g_source_remove (wakeup_id);
+}
+
+static void
+test_call_cb (GObject *source_object,
+              GAsyncResult *res,
+              gpointer user_data)
+{
+    GVariant *result;
+    GError *err = NULL;
+
+    result = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), res, &err);
+    if (result != NULL)
+        g_variant_unref (result);
+    else {
+        g_test_message ("Check failed: %s", err->message);
+        g_error_free (err);
+        test_errors++;
+    }
+    test_replies++;
+}
+
+/* Makes n concurrent Check calls from the client to the daemon side, and
+ * waits for the replies */
+static void
+test_call_check (const gchar *test_daemon_name,
+                 gint n)
+{
+    gint i;
+
+    test_replies = 0;
+    for (i = 0; i < n; i++)
+        g_dbus_connection_call (client_connection, test_daemon_name, TEST_PATH, TEST_INTERFACE, "Check", NULL, NULL,
+                                G_DBUS_CALL_FLAGS_NONE, -1, NULL, test_call_cb, NULL);
+    test_wait_for (&test_replies, n);
+}
+
+static void
+test_polkit_authority_fetch (void)
+{
+    GDBusConnection *system_bus;
+    GError *err = NULL;
+    guint object_id;
+    gint round;
+
+    if (test_bus == NULL) {
+        g_test_skip ("dbus-daemon is not installed");
+        return;
+    }
+
+    /* utils.c asks polkit about the callers of the system bus connection */
+    system_bus = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, &err);
+    g_assert_no_error (err);
+    object_id = test_register_object (system_bus, test_xml, TEST_PATH, &test_vtable);
+
+    /* The authority is fetched once at startup, before any request needs it */
+    utils_init (FILE_FSYNC_POLICY_NONE, 0, FALSE, NULL, 0, 0, 0);
+    test_wait_for (&mock_polkit_get_all_calls, 1);
+    g_assert_cmpint (g_atomic_int_get (&mock_polkit_check_calls), ==, 0);
+
+    /* After that, each call costs exactly one CheckAuthorization, and never
+     * another fetch */
+    for (round = 1; round <= 4; round++) {
+        test_call_check (g_dbus_connection_get_unique_name (system_bus), 8);
+        g_assert_cmpint (test_errors, ==, 0);
+        g_assert_cmpint (g_atomic_int_get (&mock_polkit_check_calls), ==, round * 8);
+        g_assert_cmpint (g_atomic_int_get (&mock_polkit_get_all_calls), ==, 1);
+    }
+    g_assert_cmpint (g_atomic_int_get (&mock_polkit_bad_subjects), ==, 0);
+
+    utils_destroy ();
+    g_dbus_connection_unregister_object (system_bus, object_id);
+    g_object_unref (system_bus);
+}
+
+gint
+main (gint argc, gchar *argv[])
+{
+    gchar *dbus_daemon;
+    gint ret;
+
+    g_test_init (&argc, &argv, NULL);
+
+    dbus_daemon = g_find_program_in_path ("dbus-daemon");
+    if (dbus_daemon != NULL) {
+        g_test_dbus_unset ();
+        test_bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+        g_test_dbus_up (test_bus);
+        /* Must be set before anything connects to the system bus */
+        g_setenv ("DBUS_SYSTEM_BUS_ADDRESS", g_test_dbus_get_bus_address (test_bus), TRUE);
+        mock_polkit_start ();
+        client_connection = test_connection_new ();
+    }
+    g_free (dbus_daemon);
+
+    g_test_add_func ("/utils/polkit/authority-fetch", test_polkit_authority_fetch);
+
+    ret = g_test_run ();
+
+    if (test_bus != NULL) {
+        g_dbus_connection_close_sync (client_connection, NULL, NULL);
+        g_object_unref (client_connection);
+        g_dbus_connection_close_sync (mock_polkit_connection, NULL, NULL);
+        g_object_unref (mock_polkit_connection);
+        g_test_dbus_down (test_bus);
+        g_object_unref (test_bus);
+    }
+    return ret;
+}
@@ -0,0 +1,517 @@
+/*
+  Copyright 2012 Alexandre Rostovtsev
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* Unit tests for the parts of utils.c that do not need a bus */
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "kbd-model-map-generated.h"
+#include "utils.h"
+
+#include "config.h"
+
+static gchar *test_dir = NULL;
+static guint test_file_serial = 0;
+
+/* Writes contents to a new file in the test directory. Every file gets a
+ * new name, so that the parser cache never sees two versions of one file. */
+static GFile *
+test_file_new (const gchar *contents)
+{
+    gchar *filename;
+    GFile *ret;
+
+    filename = g_strdup_printf ("%s/settings-%u", test_dir, test_file_serial++);
+    g_assert_true (g_file_set_contents (filename, contents, -1, NULL));
+    ret = g_file_new_for_path (filename);
+    g_free (filename);
+    return ret;
+}
+
+static gchar *
+test_file_get_contents (GFile *file)
+{
+    gchar *filename, *ret = NULL;
+
+    filename = g_file_get_path (file);
+    g_assert_true (g_file_get_contents (filename, &ret, NULL, NULL));
+    g_free (filename);
+    return ret;
+}
+
+static void
+test_shell_source_var (void)
+{
+    static const struct {
+        const gchar *expression;
+        const gchar *value;
+    } cases[] = {
+        { "${FOO}", "continued" },
+        { "${BAR}", "single quoted" },
+        /* Assigned values see only the assignments before them */
+        { "${BAZ}", "double bar" },
+        { "${NESTED}", "continued" },
+        { "${INDENTED}", "yes" },
+        { "${EMPTY-unset}", "" },
+        { "${EMPTY:-empty}", "empty" },
+        { "${UNSET-${UNSET2-deep}}", "deep" },
+        { "\"$FOO and ${BAR}\"", "continued and single quoted" },
+        { "'$FOO'", "$FOO" },
+        { "\\$FOO", "$FOO" },
+        { "cost: $", "cost: $" },
+        { "$UNSET", "" },
+    };
+    GFile *file;
+    guint i;
+
+    file = test_file_new ("# comment\n"
+                          "FOO=bar\n"
+                          "BAR='single quoted' ; BAZ=\"double ${FOO}\"\n"
+                          "  INDENTED=yes\n"
+                          "FOO\\\n=continued\n"
+                          "EMPTY=\n"
+                          "NESTED=${UNSET-${EMPTY:-${FOO}}}\n");
+
+    for (i = 0; i < G_N_ELEMENTS (cases); i++) {
+        GError *err = NULL;
+        gchar *value;
+
+        value = shell_source_var (file, cases[i].expression, &err);
+        g_assert_no_error (err);
+        g_assert_cmpstr (value, ==, cases[i].value);
+        g_free (value);
+    }
+    g_object_unref (file);
+}
+
+static void
+test_shell_source_var_unsupported (void)
+{
+    static const gchar *expressions[] = {
+        "${FOO#b}",
+        "${",
+        "${FOO",
+        "\"unterminated",
+        "'unterminated",
+    };
+    GFile *file;
+    guint i;
+
+    file = test_file_new ("FOO=bar\n");
+    for (i = 0; i < G_N_ELEMENTS (expressions); i++) {
+        GError *err = NULL;
+        gchar *value;
+
+        value = shell_source_var (file, expressions[i], &err);
+        g_assert_null (value);
+        g_assert_error (err, G_FILE_ERROR, G_FILE_ERROR_FAILED);
+        g_clear_error (&err);
+    }
+    g_object_unref (file);
+}
+
+static void
+test_shell_parser_rejects (void)
+{
+    static const gchar *contents[] = {
+        "FOO=$(id)\n",
+        "FOO=`id`\n",
+        "FOO=\"$(id)\"\n",
+        "FOO=\"`id`\"\n",
+        "FOO='unterminated\n",
+        "FOO=bar BAR=baz\n",
+        "echo hi\n",
+    };
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS (contents); i++) {
+        GError *err = NULL;
+        GFile *file;
+        ShellParser *parser;
+
+        file = test_file_new (contents[i]);
+        parser = shell_parser_new (file, &err);
+        g_assert_null (parser);
+        g_assert_error (err, G_FILE_ERROR, G_FILE_ERROR_FAILED);
+        g_clear_error (&err);
+        g_object_unref (file);
+    }
+}
+
+static void
+test_shell_parser_set_and_save (void)
+{
+    static const gchar *var_names[] = { "A", "B", "C", "D", NULL };
+    GError *err = NULL;
+    GFile *file;
+    ShellParser *parser;
+    gchar *contents, **values;
+
+    file = test_file_new ("# keep\n"
+                          "A=1\n"
+                          "B=2\n"
+                          "A\\\n=3\n"
+                          "C=4\n");
+    parser = shell_parser_new (file, &err);
+    g_assert_no_error (err);
+    g_assert_nonnull (parser);
+    g_assert_false (shell_parser_is_dirty (parser));
+
+    /* Only the last assignment counts, and setting it again is a no-op */
+    g_assert_true (shell_parser_set_variable (parser, "A", "3", FALSE));
+    g_assert_false (shell_parser_is_dirty (parser));
+
+    g_assert_true (shell_parser_set_variable (parser, "A", "x y", FALSE));
+    g_assert_true (shell_parser_is_dirty (parser));
+    shell_parser_clear_variable (parser, "B");
+    g_assert_false (shell_parser_set_variable (parser, "E", "unset", FALSE));
+    g_assert_true (shell_parser_set_variable (parser, "D", "new", TRUE));
+    /* A variable added by the parser can be changed again */
+    g_assert_true (shell_parser_set_variable (parser, "D", "newer", TRUE));
+    g_assert_true (shell_parser_save (parser, NULL, &err));
+    g_assert_no_error (err);
+    g_assert_false (shell_parser_is_dirty (parser));
+    shell_parser_free (parser);
+
+    contents = test_file_get_contents (file);
+    g_assert_cmpstr (contents, ==, "# keep\n"
+                                   "A=1\n"
+                                   "\n"
+                                   "A='x y'\n"
+                                   "C=4\n"
+                                   "D='newer'");
+    g_free (contents);
+
+    values = shell_parser_source_var_list (file, var_names, &err);
+    g_assert_no_error (err);
+    g_assert_nonnull (values);
+    g_assert_cmpstr (values[0], ==, "x y");
+    g_assert_null (values[1]);
+    g_assert_cmpstr (values[2], ==, "4");
+    g_assert_cmpstr (values[3], ==, "newer");
+    g_strfreev (values);
+    g_object_unref (file);
+}
+
+/* Counts the temporary files left next to basename in the test directory */
+static guint
+test_count_temporaries (const gchar *basename)
+{
+    GDir *dir;
+    const gchar *name;
+    gchar *prefix;
+    guint ret = 0;
+
+    prefix = g_strdup_printf (".%s.", basename);
+    dir = g_dir_open (test_dir, 0, NULL);
+    g_assert_nonnull (dir);
+    while ((name = g_dir_read_name (dir)) != NULL)
+        if (g_str_has_prefix (name, prefix))
+            ret++;
+    g_dir_close (dir);
+    g_free (prefix);
+    return ret;
+}
+
+static void
+test_file_write_atomic_new (void)
+{
+    GError *err = NULL;
+    FileIdentity identity, stat_identity;
+    gchar *filename, *contents = NULL;
+
+    filename = g_build_filename (test_dir, "atomic-new", NULL);
+    g_assert_true (file_write_atomic (filename, "hello\n", 6, &identity, NULL, &err));
+    g_assert_no_error (err);
+
+    g_assert_true (g_file_get_contents (filename, &contents, NULL, NULL));
+    g_assert_cmpstr (contents, ==, "hello\n");
+    /* The identity is that of the file now in place */
+    g_assert_true (file_identity_stat (filename, &stat_identity));
+    g_assert_true (file_identity_equal (&identity, &stat_identity));
+    g_assert_cmpuint (test_count_temporaries ("atomic-new"), ==, 0);
+
+    g_free (contents);
+    g_free (filename);
+}
+
+static void
+test_file_write_atomic_replace (void)
+{
+    GError *err = NULL;
+    FileIdentity old_identity, identity;
+    gchar *filename, *contents = NULL;
+    struct stat st;
+
+    filename = g_build_filename (test_dir, "atomic-replace", NULL);
+    g_assert_true (g_file_set_contents (filename, "old contents\n", -1, NULL));
+    g_assert_cmpint (chmod (filename, 0640), ==, 0);
+    g_assert_true (file_identity_stat (filename, &old_identity));
+
+    g_assert_true (file_write_atomic (filename, "new\n", 4, &identity, NULL, &err));
+    g_assert_no_error (err);
+
+    g_assert_true (g_file_get_contents (filename, &contents, NULL, NULL));
+    g_assert_cmpstr (contents, ==, "new\n");
+    /* The mode is kept, and the file is a new one rather than rewritten */
+    g_assert_cmpint (stat (filename, &st), ==, 0);
+    g_assert_cmpuint (st.st_mode & 07777, ==, 0640);
+    g_assert_false (file_identity_equal (&old_identity, &identity));
+    g_assert_cmpuint (test_count_temporaries ("atomic-replace"), ==, 0);
+
+    g_free (contents);
+    g_free (filename);
+}
+
+static void
+test_file_write_atomic_symlink (void)
+{
+    GError *err = NULL;
+    gchar *target, *link, *contents = NULL;
+    struct stat st;
+
+    target = g_build_filename (test_dir, "atomic-target", NULL);
+    link = g_build_filename (test_dir, "atomic-link", NULL);
+    g_assert_true (g_file_set_contents (target, "old\n", -1, NULL));
+    g_assert_cmpint (symlink ("atomic-target", link), ==, 0);
+
+    g_assert_true (file_write_atomic (link, "new\n", 4, NULL, NULL, &err));
+    g_assert_no_error (err);
+
+    /* The link is kept, and the file it points to is replaced */
+    g_assert_cmpint (lstat (link, &st), ==, 0);
+    g_assert_true (S_ISLNK (st.st_mode));
+    g_assert_true (g_file_get_contents (target, &contents, NULL, NULL));
+    g_assert_cmpstr (contents, ==, "new\n");
+    g_assert_cmpuint (test_count_temporaries ("atomic-target"), ==, 0);
+
+    g_free (contents);
+    g_free (link);
+    g_free (target);
+}
+
+static void
+test_file_write_atomic_cancelled (void)
+{
+    GError *err = NULL;
+    GCancellable *cancellable;
+    gchar *filename, *contents = NULL;
+
+    filename = g_build_filename (test_dir, "atomic-cancelled", NULL);
+    g_assert_true (g_file_set_contents (filename, "old\n", -1, NULL));
+    cancellable = g_cancellable_new ();
+    g_cancellable_cancel (cancellable);
+
+    g_assert_false (file_write_atomic (filename, "new\n", 4, NULL, cancellable, &err));
+    g_assert_error (err, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+    g_clear_error (&err);
+
+    g_assert_true (g_file_get_contents (filename, &contents, NULL, NULL));
+    g_assert_cmpstr (contents, ==, "old\n");
+    g_assert_cmpuint (test_count_temporaries ("atomic-cancelled"), ==, 0);
+
+    g_object_unref (cancellable);
+    g_free (contents);
+    g_free (filename);
+}
+
+static void
+test_kbd_model_map_builtin (void)
+{
+    gchar *filename, *contents = NULL, *checksum, **lines, **line;
+    gsize length = 0;
+    guint n_entries = 0;
+
+    /* The compiled table must be that of the shipped file */
+    filename = g_build_filename (TEST_DATADIR, "kbd-model-map", NULL);
+    g_assert_true (g_file_get_contents (filename, &contents, &length, NULL));
+    g_assert_cmpuint (length, ==, kbd_model_map_builtin_size);
+    checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA256, (const guchar *)contents, length);
+    g_assert_cmpstr (checksum, ==, kbd_model_map_builtin_sha256);
+
+    /* With the same fields, in file order */
+    lines = g_strsplit (contents, "\n", -1);
+    for (line = lines; *line != NULL; line++) {
+        const struct kbd_model_map_builtin_entry *entry;
+        gchar **fields, **field;
+        GPtrArray *words;
+
+        /* Any ASCII whitespace separates fields, and "-" is an empty one */
+        fields = g_strsplit_set (*line, " \t\n\v\f\r", -1);
+        words = g_ptr_array_new ();
+        for (field = fields; *field != NULL; field++)
+            if (**field != 0)
+                g_ptr_array_add (words, strcmp (*field, "-") ? *field : "");
+
+        if (words->len > 0 && *(gchar *)g_ptr_array_index (words, 0) != '#') {
+            g_assert_cmpuint (words->len, >=, 5);
+            g_assert_cmpuint (n_entries, <, kbd_model_map_builtin_n_entries);
+            entry = &kbd_model_map_builtin_entries[n_entries++];
+            g_assert_cmpstr (entry->vconsole_keymap, ==, g_ptr_array_index (words, 0));
+            g_assert_cmpstr (entry->x11_layout, ==, g_ptr_array_index (words, 1));
+            g_assert_cmpstr (entry->x11_model, ==, g_ptr_array_index (words, 2));
+            g_assert_cmpstr (entry->x11_variant, ==, g_ptr_array_index (words, 3));
+            g_assert_cmpstr (entry->x11_options, ==, g_ptr_array_index (words, 4));
+        }
+
+        g_ptr_array_free (words, TRUE);
+        g_strfreev (fields);
+    }
+    g_assert_cmpuint (n_entries, ==, kbd_model_map_builtin_n_entries);
+
+    g_strfreev (lines);
+    g_free (checksum);
+    g_free (contents);
+    g_free (filename);
+}
+
+static void
+test_kbd_model_map_builtin_lookup (void)
+{
+    static const gchar *unknown[] = { "", "no-such-keymap", "de-", "US", "us ", "sg-latin1-lk450-nodeadkeys" };
+    guint i, j;
+
+    g_assert_cmpuint (kbd_model_map_builtin_n_entries, >, 0);
+
+    /* Every keymap in the table leads to its first entry */
+    for (i = 0; i < kbd_model_map_builtin_n_entries; i++) {
+        const gchar *keymap = kbd_model_map_builtin_entries[i].vconsole_keymap;
+
+        for (j = 0; strcmp (kbd_model_map_builtin_entries[j].vconsole_keymap, keymap); j++)
+            ;
+        g_assert_cmpint (kbd_model_map_builtin_lookup (keymap), ==, j);
+    }
+
+    for (i = 0; i < G_N_ELEMENTS (unknown); i++)
+        g_assert_cmpint (kbd_model_map_builtin_lookup (unknown[i]), ==, -1);
+}
+
+static void
+test_xorg_confd_line_classify (void)
+{
+    static const struct {
+        const gchar *line;
+        enum XORG_CONFD_LINE_TYPE type;
+        const gchar *value; /* for the Xkb options */
+    } cases[] = {
+        { "", XORG_CONFD_LINE_TYPE_UNKNOWN, NULL },
+        { "# Section \"InputClass\"", XORG_CONFD_LINE_TYPE_COMMENT, NULL },
+        { "  \t#", XORG_CONFD_LINE_TYPE_COMMENT, NULL },
+        { "Section \"InputClass\"", XORG_CONFD_LINE_TYPE_SECTION_INPUT_CLASS, NULL },
+        { "  section\t\"inputclass\"  # comment", XORG_CONFD_LINE_TYPE_SECTION_INPUT_CLASS, NULL },
+        { "Section \"Device\"", XORG_CONFD_LINE_TYPE_SECTION_OTHER, NULL },
+        { "Section \"InputClassic\"", XORG_CONFD_LINE_TYPE_SECTION_OTHER, NULL },
+        { "Section\"InputClass\"", XORG_CONFD_LINE_TYPE_UNKNOWN, NULL },
+        { "Section", XORG_CONFD_LINE_TYPE_UNKNOWN, NULL },
+        { "Sections \"InputClass\"", XORG_CONFD_LINE_TYPE_UNKNOWN, NULL },
+        { "EndSection", XORG_CONFD_LINE_TYPE_END_SECTION, NULL },
+        { "\tENDSECTION", XORG_CONFD_LINE_TYPE_END_SECTION, NULL },
+        { "EndSectional", XORG_CONFD_LINE_TYPE_UNKNOWN, NULL },
+        { "MatchIsKeyboard", XORG_CONFD_LINE_TYPE_MATCH_IS_KEYBOARD, NULL },
+        { "    MatchIsKeyboard \"on\"", XORG_CONFD_LINE_TYPE_MATCH_IS_KEYBOARD, NULL },
+        { "matchiskeyboard \"Yes\"", XORG_CONFD_LINE_TYPE_MATCH_IS_KEYBOARD, NULL },
+        { "MatchIsKeyboard \"1\"", XORG_CONFD_LINE_TYPE_MATCH_IS_KEYBOARD, NULL },
+        { "MatchIsKeyboard \"TRUE\"", XORG_CONFD_LINE_TYPE_MATCH_IS_KEYBOARD, NULL },
+        { "MatchIsKeyboard \"off\"", XORG_CONFD_LINE_TYPE_UNKNOWN, NULL },
+        { "MatchIsKeyboard on", XORG_CONFD_LINE_TYPE_UNKNOWN, NULL },
+        { "MatchIsPointer \"on\"", XORG_CONFD_LINE_TYPE_UNKNOWN, NULL },
+        { "Identifier \"keyboard-all\"", XORG_CONFD_LINE_TYPE_UNKNOWN, NULL },
+        { "        Option \"XkbLayout\" \"us,de\"", XORG_CONFD_LINE_TYPE_XKB_LAYOUT, "us,de" },
+        { "option \"xkbmodel\"\t\"pc105\"", XORG_CONFD_LINE_TYPE_XKB_MODEL, "pc105" },
+        { "Option \"XkbVariant\" \"\"", XORG_CONFD_LINE_TYPE_XKB_VARIANT, "" },
+        { "Option \"XkbOptions\" \"grp:alt_shift_toggle\" # comment", XORG_CONFD_LINE_TYPE_XKB_OPTIONS, "grp:alt_shift_toggle" },
+        { "Option \"XkbLayout\"", XORG_CONFD_LINE_TYPE_UNKNOWN, NULL },
+        { "Option \"XkbLayout\" \"us", XORG_CONFD_LINE_TYPE_UNKNOWN, NULL },
+        { "Option \"XkbLayout\"\"us\"", XORG_CONFD_LINE_TYPE_UNKNOWN, NULL },
+        { "Option \"XkbRules\" \"evdev\"", XORG_CONFD_LINE_TYPE_UNKNOWN, NULL },
+        { "Options \"XkbLayout\" \"us\"", XORG_CONFD_LINE_TYPE_UNKNOWN, NULL },
+    };
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS (cases); i++) {
+        const gchar *line = cases[i].line;
+        gsize value_offset = 0, value_length = 0;
+        enum XORG_CONFD_LINE_TYPE type;
+
+        g_test_message ("Classifying '%s'", line);
+        type = xorg_confd_line_classify (line, &value_offset, &value_length);
+        g_assert_cmpint (type, ==, cases[i].type);
+        if (cases[i].value != NULL) {
+            /* The offset is that of the opening quote */
+            g_assert_cmpuint (value_offset + 1 + value_length, <, strlen (line));
+            g_assert_cmpint (line[value_offset], ==, '"');
+            g_assert_cmpuint (value_length, ==, strlen (cases[i].value));
+            g_assert_true (!strncmp (line + value_offset + 1, cases[i].value, value_length));
+            g_assert_cmpint (line[value_offset + 1 + value_length], ==, '"');
+        }
+    }
+}
+
+static void
+test_dir_remove (const gchar *dirname)
+{
+    GDir *dir;
+    const gchar *name;
+
+    if ((dir = g_dir_open (dirname, 0, NULL)) == NULL)
+        return;
+    while ((name = g_dir_read_name (dir)) != NULL) {
+        gchar *filename;
+
+        filename = g_build_filename (dirname, name, NULL);
+        unlink (filename);
+        g_free (filename);
+    }
+    g_dir_close (dir);
+    rmdir (dirname);
+}
+
+gint
+main (gint argc, gchar *argv[])
+{
+    gint ret;
+
+    g_test_init (&argc, &argv, NULL);
+
+    test_dir = g_dir_make_tmp ("openrc-settingsd-test-XXXXXX", NULL);
+    g_assert_nonnull (test_dir);
+
+    g_test_add_func ("/utils/shell-parser/source-var", test_shell_source_var);
+    g_test_add_func ("/utils/shell-parser/source-var-unsupported", test_shell_source_var_unsupported);
+    g_test_add_func ("/utils/shell-parser/rejects", test_shell_parser_rejects);
+    g_test_add_func ("/utils/shell-parser/set-and-save", test_shell_parser_set_and_save);
+    g_test_add_func ("/utils/file-write-atomic/new", test_file_write_atomic_new);
+    g_test_add_func ("/utils/file-write-atomic/replace", test_file_write_atomic_replace);
+    g_test_add_func ("/utils/file-write-atomic/symlink", test_file_write_atomic_symlink);
+    g_test_add_func ("/utils/file-write-atomic/cancelled", test_file_write_atomic_cancelled);
+    g_test_add_func ("/utils/kbd-model-map/builtin", test_kbd_model_map_builtin);
+    g_test_add_func ("/utils/kbd-model-map/builtin-lookup", test_kbd_model_map_builtin_lookup);
+    g_test_add_func ("/utils/xorg-confd/line-classify", test_xorg_confd_line_classify);
+
+    ret = g_test_run ();
+
+    utils_destroy ();
+    test_dir_remove (test_dir);
+    g_free (test_dir);
+    return ret;
+}
@@ -34,6 +34,7 @@
 #endif
 
 #include "copypaste/hwclock.h"
+#include "bus-utils.h"
 #include "timedated.h"
 #include "timedate1-generated.h"
 #include "main.h"
@@ -52,14 +53,19 @@ static GFile *hwclock_file = NULL;
 static GFile *timezone_file = NULL;
 static GFile *localtime_file = NULL;
 
-gboolean local_rtc = FALSE;
-gchar *timezone_name = NULL;
+/* Setters run on a work queue per resource, off the main loop */
+static gboolean local_rtc = FALSE;
+static gchar *timezone_name = NULL;
+static WorkQueue *clock_queue = NULL;
 G_LOCK_DEFINE_STATIC (clock);
 
-gboolean use_ntp = FALSE;
+static gboolean use_ntp = FALSE;
 static const gchar *ntp_preferred_service = NULL;
+#if HAVE_OPENRC
 static const gchar *ntp_default_services[] = { "ntpd", "chronyd", "busybox-ntpd", NULL };
+#endif
 #define NTP_DEFAULT_SERVICES_PACKAGES "ntp, openntpd, chrony, busybox-ntpd"
+static WorkQueue *ntp_queue = NULL;
 G_LOCK_DEFINE_STATIC (ntp);
 
 static gboolean
@@ -78,7 +84,7 @@ get_local_rtc (GError **error)
 static gchar *
 get_timezone_name (GError **error)
 {
-    gchar *filebuf = NULL, *filebuf2 = NULL, *ret = NULL, *newline = NULL, *filename = NULL;
+    gchar *filebuf = NULL, *filebuf2 = NULL, *ret = NULL, *newline = NULL;
     gchar *timezone_filename = NULL, *localtime_filename = NULL, *localtime2_filename = NULL;
     GFile *localtime2_file = NULL;
 
@@ -123,6 +129,7 @@ get_timezone_name (GError **error)
 
 static gboolean
 set_timezone (const gchar *_timezone_name,
+              GCancellable *cancellable,
               GError **error)
 {
     gchar *filebuf = NULL;
@@ -131,6 +138,11 @@ set_timezone (const gchar *_timezone_name,
     gboolean ret = FALSE;
     gsize length = 0;
 
+    /* Once started, the update runs to completion so that the timezone
+     * file and localtime never disagree */
+    if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+
     timezone_filename = g_file_get_path (timezone_file);
     if (!g_file_replace_contents (timezone_file, _timezone_name, strlen (_timezone_name), NULL, FALSE, 0, NULL, NULL, error)) {
         g_prefix_error (error, "Unable to write '%s':", timezone_filename);
@@ -238,6 +250,7 @@ service_started (const gchar *service,
 
 static gboolean
 service_disable (const gchar *service,
+                 GCancellable *cancellable,
                  GError **error)
 {
 #if HAVE_OPENRC
@@ -249,6 +262,11 @@ service_disable (const gchar *service,
 
     g_assert (service != NULL);
 
+    /* Checked only before touching the runlevel; a running rc script is
+     * not interrupted */
+    if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        goto out;
+
     if (!rc_service_exists (service)) {
         g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "%s rc service not found", service);
         goto out;
@@ -291,6 +309,7 @@ service_disable (const gchar *service,
 
 static gboolean
 service_enable (const gchar *service,
+                GCancellable *cancellable,
                 GError **error)
 {
 #if HAVE_OPENRC
@@ -302,6 +321,11 @@ service_enable (const gchar *service,
 
     g_assert (service != NULL);
 
+    /* Checked only before touching the runlevel; a running rc script is
+     * not interrupted */
+    if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        goto out;
+
     if (!rc_service_exists (service)) {
         g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "%s rc service not found", service);
         goto out;
@@ -356,7 +380,7 @@ on_handle_set_time_authorized_cb (GObject *source_object,
     GError *err = NULL;
     struct invoked_set_time *data;
     struct timespec ts = { 0, 0 };
-    struct tm *tm = NULL;
+    struct tm *tm = NULL, tm_buf;
 
     data = (struct invoked_set_time *) user_data;
     if (!check_polkit_finish (res, &err)) {
@@ -365,29 +389,25 @@ on_handle_set_time_authorized_cb (GObject *source_object,
     }
 
     G_LOCK (clock);
-    if (!data->relative && data->usec_utc < 0) {
-        g_dbus_method_invocation_return_dbus_error (data->invocation, DBUS_ERROR_INVALID_ARGS, "Attempt to set time before epoch");
-        goto unlock;
-    }
-
     if (data->relative)
         if (clock_gettime (CLOCK_REALTIME, &ts)) {
             int errsv = errno;
-            g_dbus_method_invocation_return_dbus_error (data->invocation, DBUS_ERROR_FAILED, strerror (errsv));
+            g_dbus_method_invocation_return_dbus_error (data->invocation, DBUS_ERROR_FAILED, g_strerror (errsv));
             goto unlock;
         }
     ts.tv_sec += data->usec_utc / 1000000;
     ts.tv_nsec += (data->usec_utc % 1000000) * 1000;
     if (clock_settime (CLOCK_REALTIME, &ts)) {
         int errsv = errno;
-        g_dbus_method_invocation_return_dbus_error (data->invocation, DBUS_ERROR_FAILED, strerror (errsv));
+        g_dbus_method_invocation_return_dbus_error (data->invocation, DBUS_ERROR_FAILED, g_strerror (errsv));
         goto unlock;
     }
 
+    /* This runs on a worker thread, so use the reentrant variants */
     if (local_rtc)
-        tm = localtime(&ts.tv_sec);
+        tm = localtime_r (&ts.tv_sec, &tm_buf);
     else
-        tm = gmtime(&ts.tv_sec);
+        tm = gmtime_r (&ts.tv_sec, &tm_buf);
     hwclock_set_time(tm);
 
     openrc_settingsd_timedated_timedate1_complete_set_time (timedate1, data->invocation);
@@ -413,18 +433,60 @@ on_handle_set_time (OpenrcSettingsdTimedatedTimedate1 *timedate1,
         g_dbus_method_invocation_return_dbus_error (invocation,
                                                     DBUS_ERROR_NOT_SUPPORTED,
                                                     SERVICE_NAME " is in read-only mode");
-    else {
+    else if (bus_invocation_check_args (invocation, relative || usec_utc >= 0, "Attempt to set time before epoch")) {
         struct invoked_set_time *data;
         data = g_new0 (struct invoked_set_time, 1);
         data->invocation = invocation;
         data->usec_utc = usec_utc;
         data->relative = relative;
-        check_polkit_async (g_dbus_method_invocation_get_sender (invocation), "org.freedesktop.timedate1.set-time", user_interaction, on_handle_set_time_authorized_cb, data);
+        check_polkit_async (invocation, "org.freedesktop.timedate1.set-time", user_interaction, clock_queue, on_handle_set_time_authorized_cb, data);
     }
 
     return TRUE;
 }
 
+/* A timezone name must be a relative path that stays inside the zoneinfo
+ * directory. This is only a syntax check, so that it can run on the main
+ * loop; see timezone_is_installed. */
+static gboolean
+timezone_name_is_valid (const gchar *_timezone_name)
+{
+    const gchar *p, *component;
+
+    if (_timezone_name == NULL || *_timezone_name == '\0' || *_timezone_name == '/')
+        return FALSE;
+
+    /* Non-empty components of letters, digits and "_+.-", none of them
+     * "." or ".." */
+    for (component = p = _timezone_name; ; p++) {
+        if (*p == '/' || *p == '\0') {
+            if (p == component ||
+                (p - component == 1 && component[0] == '.') ||
+                (p - component == 2 && component[0] == '.' && component[1] == '.'))
+                return FALSE;
+            if (*p == '\0')
+                break;
+            component = p + 1;
+        } else if (!g_ascii_isalnum (*p) && strchr ("_+.-", *p) == NULL)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* A valid timezone name must also name an existing file under the zoneinfo
+ * directory; checked on the clock queue */
+static gboolean
+timezone_is_installed (const gchar *_timezone_name)
+{
+    gchar *filename;
+    gboolean ret;
+
+    filename = g_strdup_printf (DATADIR "/zoneinfo/%s", _timezone_name);
+    ret = g_file_test (filename, G_FILE_TEST_IS_REGULAR);
+    g_free (filename);
+    return ret;
+}
+
 struct invoked_set_timezone {
     GDBusMethodInvocation *invocation;
     gchar *timezone; /* newly allocated */
@@ -444,23 +506,37 @@ on_handle_set_timezone_authorized_cb (GObject *source_object,
         goto out;
     }
 
+    /* An identical request queued just before this one has done the work */
+    if (bus_invocation_joined_succeeded (data->invocation)) {
+        g_free (data->timezone);
+        openrc_settingsd_timedated_timedate1_complete_set_timezone (timedate1, data->invocation);
+        goto out;
+    }
+
+    if (!bus_invocation_check_args (data->invocation, timezone_is_installed (data->timezone), "Unknown timezone '%s'", data->timezone)) {
+        g_free (data->timezone);
+        goto out;
+    }
+
     G_LOCK (clock);
-    if (!set_timezone(data->timezone, &err)) {
+    if (!set_timezone (data->timezone, bus_invocation_get_cancellable (data->invocation), &err)) {
         g_dbus_method_invocation_return_gerror (data->invocation, err);
         goto unlock;
     }
 
     if (local_rtc) {
         struct timespec ts;
-        struct tm *tm;
+        struct tm tm;
  
-        /* Update kernel's view of the rtc timezone */
+        /* Update kernel's view of the rtc timezone; localtime_r () does
+         * not pick up the new zone by itself */
+        tzset ();
         hwclock_apply_localtime_delta (NULL);
         clock_gettime (CLOCK_REALTIME, &ts);
-        tm = localtime (&ts.tv_sec);
-        hwclock_set_time (tm);
+        hwclock_set_time (localtime_r (&ts.tv_sec, &tm));
     }
 
+    bus_invocation_set_succeeded (data->invocation);
     openrc_settingsd_timedated_timedate1_complete_set_timezone (timedate1, data->invocation);
     g_free (timezone_name);
     timezone_name = data->timezone;
@@ -486,12 +562,13 @@ on_handle_set_timezone (OpenrcSettingsdTimedatedTimedate1 *timedate1,
         g_dbus_method_invocation_return_dbus_error (invocation,
                                                     DBUS_ERROR_NOT_SUPPORTED,
                                                     SERVICE_NAME " is in read-only mode");
-    else {
+    else if (bus_invocation_check_args (invocation, timezone_name_is_valid (timezone), "Invalid timezone '%s'", timezone)) {
         struct invoked_set_timezone *data;
         data = g_new0 (struct invoked_set_timezone, 1);
         data->invocation = invocation;
         data->timezone = g_strdup (timezone);
-        check_polkit_async (g_dbus_method_invocation_get_sender (invocation), "org.freedesktop.timedate1.set-timezone", user_interaction, on_handle_set_timezone_authorized_cb, data);
+        bus_invocation_set_joinable (invocation);
+        check_polkit_async (invocation, "org.freedesktop.timedate1.set-timezone", user_interaction, clock_queue, on_handle_set_timezone_authorized_cb, data);
     }
 
     return TRUE;
@@ -522,7 +599,7 @@ on_handle_set_local_rtc_authorized_cb (GObject *source_object,
     G_LOCK (clock);
     clock = shell_source_var (hwclock_file, "${clock}", NULL);
     if (clock != NULL || data->local_rtc)
-        if (!shell_parser_set_and_save (hwclock_file, &err, "clock", NULL, clock_types[data->local_rtc], NULL)) {
+        if (!shell_parser_set_and_save (hwclock_file, bus_invocation_get_cancellable (data->invocation), &err, "clock", NULL, clock_types[data->local_rtc], NULL)) {
             g_dbus_method_invocation_return_gerror (data->invocation, err);
             goto unlock;
         }
@@ -546,9 +623,9 @@ on_handle_set_local_rtc_authorized_cb (GObject *source_object,
              * initialize the timezone fields of
              * struct tm. */
             if (data->local_rtc)
-                tm = *localtime(&ts.tv_sec);
+                localtime_r(&ts.tv_sec, &tm);
             else
-                tm = *gmtime(&ts.tv_sec);
+                gmtime_r(&ts.tv_sec, &tm);
 
             /* Override the main fields of
              * struct tm, but not the timezone
@@ -565,19 +642,19 @@ on_handle_set_local_rtc_authorized_cb (GObject *source_object,
             }
 
         } else {
-            struct tm *tm;
+            struct tm tm;
 
             /* Sync RTC from system clock */
             if (data->local_rtc)
-                tm = localtime(&ts.tv_sec);
+                localtime_r(&ts.tv_sec, &tm);
             else
-                tm = gmtime(&ts.tv_sec);
+                gmtime_r(&ts.tv_sec, &tm);
 
-            hwclock_set_time(tm);
+            hwclock_set_time(&tm);
         }
     }
 
-    openrc_settingsd_timedated_timedate1_complete_set_timezone (timedate1, data->invocation);
+    openrc_settingsd_timedated_timedate1_complete_set_local_rtc (timedate1, data->invocation);
     local_rtc = data->local_rtc;
     openrc_settingsd_timedated_timedate1_set_local_rtc (timedate1, local_rtc);
 
@@ -609,7 +686,7 @@ on_handle_set_local_rtc (OpenrcSettingsdTimedatedTimedate1 *timedate1,
         data->invocation = invocation;
         data->local_rtc = _local_rtc;
         data->fix_system = fix_system;
-        check_polkit_async (g_dbus_method_invocation_get_sender (invocation), "org.freedesktop.timedate1.set-local-rtc", user_interaction, on_handle_set_local_rtc_authorized_cb, data);
+        check_polkit_async (invocation, "org.freedesktop.timedate1.set-local-rtc", user_interaction, clock_queue, on_handle_set_local_rtc_authorized_cb, data);
     }
 
     return TRUE;
@@ -634,6 +711,12 @@ on_handle_set_ntp_authorized_cb (GObject *source_object,
         goto out;
     }
 
+    /* An identical request queued just before this one has done the work */
+    if (bus_invocation_joined_succeeded (data->invocation)) {
+        openrc_settingsd_timedated_timedate1_complete_set_ntp (timedate1, data->invocation);
+        goto out;
+    }
+
     G_LOCK (ntp);
     if (ntp_service () == NULL) {
         g_dbus_method_invocation_return_dbus_error (data->invocation, DBUS_ERROR_FAILED,
@@ -641,13 +724,14 @@ on_handle_set_ntp_authorized_cb (GObject *source_object,
                                                     NTP_DEFAULT_SERVICES_PACKAGES);
         goto unlock;
     }
-    if ((data->use_ntp && !service_enable (ntp_service (), &err)) ||
-        (!data->use_ntp && !service_disable (ntp_service (), &err)))
+    if ((data->use_ntp && !service_enable (ntp_service (), bus_invocation_get_cancellable (data->invocation), &err)) ||
+        (!data->use_ntp && !service_disable (ntp_service (), bus_invocation_get_cancellable (data->invocation), &err)))
     {
         g_dbus_method_invocation_return_gerror (data->invocation, err);
         goto unlock;
     }
 
+    bus_invocation_set_succeeded (data->invocation);
     openrc_settingsd_timedated_timedate1_complete_set_ntp (timedate1, data->invocation);
     use_ntp = data->use_ntp;
     openrc_settingsd_timedated_timedate1_set_ntp (timedate1, use_ntp);
@@ -677,7 +761,8 @@ on_handle_set_ntp (OpenrcSettingsdTimedatedTimedate1 *timedate1,
         data = g_new0 (struct invoked_set_ntp, 1);
         data->invocation = invocation;
         data->use_ntp = _use_ntp;
-        check_polkit_async (g_dbus_method_invocation_get_sender (invocation), "org.freedesktop.timedate1.set-ntp", user_interaction, on_handle_set_ntp_authorized_cb, data);
+        bus_invocation_set_joinable (invocation);
+        check_polkit_async (invocation, "org.freedesktop.timedate1.set-ntp", user_interaction, ntp_queue, on_handle_set_ntp_authorized_cb, data);
     }
 
     return TRUE;
@@ -688,7 +773,6 @@ on_bus_acquired (GDBusConnection *connection,
                  const gchar     *bus_name,
                  gpointer         user_data)
 {
-    gchar *name;
     GError *err = NULL;
 
     g_debug ("Acquired a message bus connection");
@@ -744,6 +828,8 @@ timedated_init (gboolean _read_only,
 
     read_only = _read_only;
     ntp_preferred_service = _ntp_preferred_service;
+    clock_queue = work_queue_new ("clock");
+    ntp_queue = work_queue_new ("ntp");
 
     hwclock_file = g_file_new_for_path (SYSCONFDIR "/conf.d/hwclock");
     timezone_file = g_file_new_for_path (SYSCONFDIR "/timezone");
@@ -783,6 +869,8 @@ timedated_init (gboolean _read_only,
 void
 timedated_destroy (void)
 {
+    work_queue_free (clock_queue);
+    work_queue_free (ntp_queue);
     g_bus_unown_name (bus_id);
     bus_id = 0;
     read_only = FALSE;
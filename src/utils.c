@@ -21,10 +21,17 @@
   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <limits.h>
+#include <pwd.h>
 #include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include <libdaemon/dfork.h>
 
@@ -32,18 +39,12 @@
 #include <gio/gio.h>
 #include <polkit/polkit.h>
 
+#include "bus-utils.h"
+#include "kbd-model-map-generated.h"
 #include "utils.h"
 
 #include "config.h"
 
-static GRegex *indent_regex = NULL;
-static GRegex *comment_regex = NULL;
-static GRegex *separator_regex = NULL;
-static GRegex *var_equals_regex = NULL;
-static GRegex *single_quoted_regex = NULL;
-static GRegex *double_quoted_regex = NULL;
-static GRegex *unquoted_regex = NULL;
-
 /* Always returns TRUE */
 gboolean
 _g_match_info_clear (GMatchInfo **match_info)
@@ -63,18 +64,91 @@ strstr0 (const gchar *haystack, const gchar *needle)
     return strstr (haystack, needle);
 }
 
+struct _WorkQueue {
+    gchar *name;
+    GThreadPool *pool;
+};
+
+struct work_queue_item {
+    GFunc func;
+    gpointer data;
+};
+
+static void
+work_queue_run (gpointer _item,
+                gpointer _queue)
+{
+    struct work_queue_item *item = (struct work_queue_item *) _item;
+
+    item->func (item->data, NULL);
+    g_free (item);
+}
+
+/* A queue whose work items run one at a time, in order, on a worker thread;
+ * work for different queues runs in parallel */
+WorkQueue *
+work_queue_new (const gchar *name)
+{
+    WorkQueue *queue;
+
+    queue = g_new0 (WorkQueue, 1);
+    queue->name = g_strdup (name);
+    /* A non-exclusive pool cannot fail to be created */
+    queue->pool = g_thread_pool_new (work_queue_run, queue, 1, FALSE, NULL);
+    return queue;
+}
+
+void
+work_queue_push (WorkQueue *queue,
+                 GFunc func,
+                 gpointer data)
+{
+    struct work_queue_item *item;
+
+    item = g_new0 (struct work_queue_item, 1);
+    item->func = func;
+    item->data = data;
+    g_debug ("Queueing work on %s queue", queue->name);
+    g_thread_pool_push (queue->pool, item, NULL);
+}
+
+/* Waits for all queued work to finish */
+void
+work_queue_free (WorkQueue *queue)
+{
+    if (queue == NULL)
+        return;
+
+    g_thread_pool_free (queue->pool, FALSE, TRUE);
+    g_free (queue->name);
+    g_free (queue);
+}
+
 struct check_polkit_data {
+    GDBusMethodInvocation *invocation;
+    GDBusConnection *connection;
     const gchar *unique_name;
     const gchar *action_id;
     gboolean user_interaction;
+    WorkQueue *queue;
+    GCancellable *cancellable; /* cancelled when the sender disconnects */
     GAsyncReadyCallback callback;
     gpointer user_data;
 
+    guint backend; /* index of the next authorization backend to try */
     PolkitAuthority *authority;
     PolkitSubject *subject;
+
+    /* The polkit call has its own cancellable, so that it can also be
+     * cancelled by the deadline */
+    GCancellable *polkit_cancellable;
+    gulong cancelled_id;
+    guint deadline_id;
+    gboolean timed_out;
+    gboolean probe;
 };
 
-void
+static void
 check_polkit_data_free (struct check_polkit_data *data)
 {
     if (data == NULL)
@@ -84,7 +158,15 @@ check_polkit_data_free (struct check_polkit_data *data)
         g_object_unref (data->subject);
     if (data->authority != NULL)
         g_object_unref (data->authority);
-    
+    if (data->deadline_id != 0)
+        g_source_remove (data->deadline_id);
+    if (data->cancelled_id != 0)
+        g_cancellable_disconnect (data->cancellable, data->cancelled_id);
+    if (data->polkit_cancellable != NULL)
+        g_object_unref (data->polkit_cancellable);
+    if (data->cancellable != NULL)
+        g_object_unref (data->cancellable);
+
     g_free (data);
 }
 
@@ -97,6 +179,283 @@ check_polkit_finish (GAsyncResult *res,
     return g_task_propagate_boolean (G_TASK (res), error);
 }
 
+struct check_polkit_dispatch {
+    GAsyncReadyCallback callback;
+    GAsyncResult *res;
+    gpointer user_data;
+};
+
+static void
+check_polkit_dispatch_run (gpointer _dispatch,
+                           gpointer unused)
+{
+    struct check_polkit_dispatch *dispatch = (struct check_polkit_dispatch *) _dispatch;
+
+    dispatch->callback (NULL, dispatch->res, dispatch->user_data);
+    g_object_unref (dispatch->res);
+    g_free (dispatch);
+}
+
+static void
+check_polkit_dispatch_cb (GObject *source_object,
+                          GAsyncResult *res,
+                          gpointer _data)
+{
+    struct check_polkit_data *data = (struct check_polkit_data *) _data;
+    struct check_polkit_dispatch *dispatch;
+
+    /* Registering here keeps registrations in the order of the queue */
+    if (!g_task_had_error (G_TASK (res)))
+        bus_invocation_join (data->invocation, data->queue);
+
+    dispatch = g_new0 (struct check_polkit_dispatch, 1);
+    dispatch->callback = data->callback;
+    dispatch->res = g_object_ref (res);
+    dispatch->user_data = data->user_data;
+    work_queue_push (data->queue, check_polkit_dispatch_run, dispatch);
+    check_polkit_data_free (data);
+}
+
+/* Completes the check with error, or successfully if error is NULL, and
+ * frees data; the caller's callback runs on data->queue if there is one.
+ * check_polkit_finish fails with G_IO_ERROR_CANCELLED if the sender has
+ * disconnected by then, even if it was authorized. */
+static void
+check_polkit_return (struct check_polkit_data *data,
+                     GError *error)
+{
+    GTask *task;
+
+    if (data->queue != NULL)
+        task = g_task_new (NULL, data->cancellable, check_polkit_dispatch_cb, data);
+    else {
+        task = g_task_new (NULL, data->cancellable, data->callback, data->user_data);
+        check_polkit_data_free (data);
+    }
+    g_task_set_source_tag (task, check_polkit_async);
+    if (error != NULL)
+        g_task_return_error (task, error);
+    else
+        g_task_return_boolean (task, TRUE);
+    g_object_unref (task);
+}
+
+/* Optional cache of positive non-interactive authorizations, per sender and
+ * action. An entry lives for at most polkit_cache_ttl seconds, and is dropped
+ * earlier when the sender disconnects or polkit reports a policy change. */
+struct polkit_cache_sender {
+    GDBusConnection *connection;
+    guint watch_id;
+    GHashTable *actions; /* action id -> gint64 * monotonic expiry time */
+};
+
+static guint polkit_cache_ttl = 0; /* in seconds; 0 disables the cache */
+static GHashTable *polkit_cache = NULL; /* unique name -> struct polkit_cache_sender */
+static guint64 polkit_cache_hits = 0;
+static guint64 polkit_cache_misses = 0;
+G_LOCK_DEFINE_STATIC (polkit_cache);
+
+static void
+polkit_cache_sender_free (struct polkit_cache_sender *sender)
+{
+    bus_peer_unwatch (sender->connection, sender->watch_id);
+    g_object_unref (sender->connection);
+    g_hash_table_destroy (sender->actions);
+    g_free (sender);
+}
+
+static void
+polkit_cache_sender_vanished_cb (const gchar *unique_name,
+                                 gpointer user_data)
+{
+    G_LOCK (polkit_cache);
+    if (polkit_cache != NULL)
+        g_hash_table_remove (polkit_cache, unique_name);
+    G_UNLOCK (polkit_cache);
+}
+
+static void
+polkit_cache_clear (void)
+{
+    G_LOCK (polkit_cache);
+    if (polkit_cache != NULL)
+        g_hash_table_remove_all (polkit_cache);
+    G_UNLOCK (polkit_cache);
+}
+
+static gboolean
+polkit_cache_lookup (const gchar *unique_name,
+                     const gchar *action_id)
+{
+    struct polkit_cache_sender *sender;
+    gint64 *expiry;
+    gboolean ret = FALSE;
+
+    if (polkit_cache_ttl == 0)
+        return FALSE;
+
+    G_LOCK (polkit_cache);
+    if (polkit_cache != NULL &&
+        (sender = g_hash_table_lookup (polkit_cache, unique_name)) != NULL &&
+        (expiry = g_hash_table_lookup (sender->actions, action_id)) != NULL) {
+        if (*expiry > g_get_monotonic_time ())
+            ret = TRUE;
+        else
+            g_hash_table_remove (sender->actions, action_id);
+    }
+    if (ret)
+        polkit_cache_hits++;
+    else
+        polkit_cache_misses++;
+    G_UNLOCK (polkit_cache);
+    return ret;
+}
+
+static void
+polkit_cache_insert (GDBusConnection *connection,
+                     const gchar *unique_name,
+                     const gchar *action_id)
+{
+    struct polkit_cache_sender *sender;
+    gint64 *expiry;
+
+    if (polkit_cache_ttl == 0 || connection == NULL)
+        return;
+
+    G_LOCK (polkit_cache);
+    if (polkit_cache == NULL)
+        polkit_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)polkit_cache_sender_free);
+    if ((sender = g_hash_table_lookup (polkit_cache, unique_name)) == NULL) {
+        sender = g_new0 (struct polkit_cache_sender, 1);
+        sender->connection = g_object_ref (connection);
+        sender->watch_id = bus_peer_watch (connection, unique_name, polkit_cache_sender_vanished_cb, NULL);
+        sender->actions = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+        g_hash_table_insert (polkit_cache, g_strdup (unique_name), sender);
+    }
+    expiry = g_new (gint64, 1);
+    *expiry = g_get_monotonic_time () + (gint64)polkit_cache_ttl * G_USEC_PER_SEC;
+    g_hash_table_replace (sender->actions, g_strdup (action_id), expiry);
+    G_UNLOCK (polkit_cache);
+}
+
+/* Deadline for polkit checks, and a circuit breaker that stops sending
+ * checks to a polkitd which keeps missing it. After breaker_threshold
+ * consecutive timeouts the breaker opens and checks fail immediately; every
+ * breaker_probe_interval seconds one check is let through as a probe, and
+ * the breaker closes again once a probe gets an answer. */
+enum polkit_breaker_state {
+    POLKIT_BREAKER_CLOSED,
+    POLKIT_BREAKER_OPEN,
+    POLKIT_BREAKER_PROBING,
+};
+
+static const gchar * const polkit_breaker_state_names[] = { "closed", "open", "probing" };
+
+/* Interactive checks wait for the user to answer an authentication dialog,
+ * so they are allowed at least this many seconds, unless they are probes */
+#define POLKIT_INTERACTIVE_TIMEOUT 300
+
+static guint polkit_timeout = 0; /* in seconds; 0 disables the deadline */
+static guint polkit_breaker_threshold = 0; /* 0 disables the breaker */
+static guint polkit_breaker_probe_interval = 0; /* in seconds */
+static enum polkit_breaker_state polkit_breaker_state = POLKIT_BREAKER_CLOSED;
+static guint polkit_breaker_failures = 0; /* consecutive timeouts */
+static gint64 polkit_breaker_opened = 0; /* monotonic time of the last trip or probe */
+static guint64 polkit_timeouts = 0;
+static guint64 polkit_breaker_trips = 0;
+static guint64 polkit_breaker_rejections = 0;
+G_LOCK_DEFINE_STATIC (polkit_breaker);
+
+/* Returns FALSE if the check should fail immediately; sets *probe if it is
+ * let through to test whether polkitd has recovered */
+static gboolean
+polkit_breaker_admit (gboolean *probe)
+{
+    gboolean ret = TRUE;
+
+    *probe = FALSE;
+    G_LOCK (polkit_breaker);
+    switch (polkit_breaker_state) {
+    case POLKIT_BREAKER_CLOSED:
+        break;
+    case POLKIT_BREAKER_OPEN:
+        if (g_get_monotonic_time () - polkit_breaker_opened >= (gint64)polkit_breaker_probe_interval * G_USEC_PER_SEC) {
+            g_message ("polkit circuit breaker: probing whether polkitd has recovered");
+            polkit_breaker_state = POLKIT_BREAKER_PROBING;
+            *probe = TRUE;
+        } else
+            ret = FALSE;
+        break;
+    case POLKIT_BREAKER_PROBING:
+        ret = FALSE;
+        break;
+    }
+    if (!ret)
+        polkit_breaker_rejections++;
+    G_UNLOCK (polkit_breaker);
+    return ret;
+}
+
+/* Records the outcome of a check that polkitd either answered or, if
+ * timed_out, did not answer in time */
+static void
+polkit_breaker_record (gboolean timed_out,
+                       gboolean probe)
+{
+    G_LOCK (polkit_breaker);
+    if (!timed_out) {
+        if (polkit_breaker_state != POLKIT_BREAKER_CLOSED && probe) {
+            g_message ("polkit circuit breaker closed: polkitd is answering again");
+            polkit_breaker_state = POLKIT_BREAKER_CLOSED;
+        }
+        polkit_breaker_failures = 0;
+    } else {
+        polkit_timeouts++;
+        polkit_breaker_failures++;
+        if (probe) {
+            g_warning ("polkit circuit breaker reopened: probe timed out");
+            polkit_breaker_state = POLKIT_BREAKER_OPEN;
+            polkit_breaker_opened = g_get_monotonic_time ();
+        } else if (polkit_breaker_state == POLKIT_BREAKER_CLOSED && polkit_breaker_threshold > 0 &&
+                   polkit_breaker_failures >= polkit_breaker_threshold) {
+            g_warning ("polkit circuit breaker opened after %u consecutive timeouts; failing authorization checks for %u seconds",
+                       polkit_breaker_failures, polkit_breaker_probe_interval);
+            polkit_breaker_state = POLKIT_BREAKER_OPEN;
+            polkit_breaker_opened = g_get_monotonic_time ();
+            polkit_breaker_trips++;
+        }
+    }
+    G_UNLOCK (polkit_breaker);
+}
+
+/* A probe whose caller went away proves nothing; let the next check probe */
+static void
+polkit_breaker_abandon_probe (void)
+{
+    G_LOCK (polkit_breaker);
+    if (polkit_breaker_state == POLKIT_BREAKER_PROBING)
+        polkit_breaker_state = POLKIT_BREAKER_OPEN;
+    G_UNLOCK (polkit_breaker);
+}
+
+static void
+check_polkit_cancelled_cb (GCancellable *cancellable,
+                           gpointer _polkit_cancellable)
+{
+    g_cancellable_cancel (G_CANCELLABLE (_polkit_cancellable));
+}
+
+static gboolean
+check_polkit_deadline_cb (gpointer _data)
+{
+    struct check_polkit_data *data = (struct check_polkit_data *) _data;
+
+    data->deadline_id = 0;
+    data->timed_out = TRUE;
+    g_cancellable_cancel (data->polkit_cancellable);
+    return FALSE;
+}
+
 static void
 check_polkit_authorization_cb (GObject *source_object,
                                GAsyncResult *res,
@@ -104,70 +463,558 @@ check_polkit_authorization_cb (GObject *source_object,
 {
     struct check_polkit_data *data;
     PolkitAuthorizationResult *result;
-    GTask *task;
     GError *err = NULL;
 
     data = (struct check_polkit_data *) _data;
+    if (data->deadline_id != 0) {
+        g_source_remove (data->deadline_id);
+        data->deadline_id = 0;
+    }
     if ((result = polkit_authority_check_authorization_finish (data->authority, res, &err)) == NULL) {
-        g_task_report_error (NULL, data->callback, data->user_data, NULL, err);
-        goto out;
+        if (data->timed_out) {
+            g_error_free (err);
+            err = g_error_new (G_DBUS_ERROR, G_DBUS_ERROR_TIMED_OUT, "Authorizing for '%s': polkit did not answer in time", data->action_id);
+            /* A slow user is not a slow polkitd, but an interactive probe
+             * must still give the breaker back */
+            if (!data->user_interaction)
+                polkit_breaker_record (TRUE, data->probe);
+            else if (data->probe)
+                polkit_breaker_abandon_probe ();
+        } else if (!g_error_matches (err, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            polkit_breaker_record (FALSE, data->probe);
+        else if (data->probe)
+            polkit_breaker_abandon_probe ();
+        check_polkit_return (data, err);
+        return;
     }
- 
-    if (!polkit_authorization_result_get_is_authorized (result)) {
-        g_task_report_new_error (NULL, data->callback, data->user_data, NULL, POLKIT_ERROR, POLKIT_ERROR_NOT_AUTHORIZED, "Authorizing for '%s': not authorized", data->action_id);
-        goto out;
+
+    polkit_breaker_record (FALSE, data->probe);
+    if (!polkit_authorization_result_get_is_authorized (result))
+        err = g_error_new (POLKIT_ERROR, POLKIT_ERROR_NOT_AUTHORIZED, "Authorizing for '%s': not authorized", data->action_id);
+    else if (!data->user_interaction)
+        polkit_cache_insert (data->connection, data->unique_name, data->action_id);
+    check_polkit_return (data, err);
+    g_object_unref (result);
+}
+
+static void
+check_polkit_start (struct check_polkit_data *data)
+{
+    guint timeout;
+
+    if (data->unique_name == NULL || data->action_id == NULL ||
+        (data->subject = polkit_system_bus_name_new (data->unique_name)) == NULL) {
+        check_polkit_return (data, g_error_new (POLKIT_ERROR, POLKIT_ERROR_FAILED, "Authorizing for '%s': failed sanity check", data->action_id));
+        return;
     }
-    task = g_task_new (NULL, NULL, data->callback, data->user_data);
-    g_task_set_source_tag (task, check_polkit_async);
-    g_task_return_boolean (task, TRUE);
-    g_clear_object (&task);
 
-  out:
-    check_polkit_data_free (data);
-    if (result != NULL)
-        g_object_unref (result);
+    if (!polkit_breaker_admit (&data->probe)) {
+        check_polkit_return (data, g_error_new (G_DBUS_ERROR, G_DBUS_ERROR_TIMED_OUT, "Authorizing for '%s': polkit is not responding", data->action_id));
+        return;
+    }
+
+    data->polkit_cancellable = g_cancellable_new ();
+    if (data->cancellable != NULL)
+        data->cancelled_id = g_cancellable_connect (data->cancellable, G_CALLBACK (check_polkit_cancelled_cb),
+                                                    data->polkit_cancellable, NULL);
+    if (polkit_timeout > 0) {
+        /* The breaker rejects every other check while a probe is out, so a
+         * probe never waits longer than a non-interactive check */
+        if (data->user_interaction && !data->probe)
+            timeout = MAX (polkit_timeout, POLKIT_INTERACTIVE_TIMEOUT);
+        else
+            timeout = polkit_timeout;
+        data->deadline_id = g_timeout_add_seconds (timeout, check_polkit_deadline_cb, data);
+    }
+    polkit_authority_check_authorization (data->authority, data->subject, data->action_id, NULL, (PolkitCheckAuthorizationFlags) data->user_interaction, data->polkit_cancellable, check_polkit_authorization_cb, data);
+}
+
+/* The authority is obtained once, at startup, and kept for the lifetime of
+ * the daemon; it follows polkitd across restarts by itself. Checks that
+ * arrive while it is being obtained wait in polkit_authority_waiters. */
+static PolkitAuthority *polkit_authority = NULL;
+static gboolean polkit_authority_pending = FALSE;
+static GList *polkit_authority_waiters = NULL;
+G_LOCK_DEFINE_STATIC (polkit_authority);
+
+static void
+polkit_authority_owner_changed_cb (GObject *authority,
+                                   GParamSpec *pspec,
+                                   gpointer user_data)
+{
+    gchar *owner;
+
+    /* A restarted polkitd may have reloaded its rules */
+    polkit_cache_clear ();
+    owner = polkit_authority_get_owner (POLKIT_AUTHORITY (authority));
+    if (owner != NULL)
+        g_message ("polkit authority is available as %s", owner);
+    else
+        g_message ("polkit authority has gone away");
+    g_free (owner);
+}
+
+static void
+polkit_authority_changed_cb (PolkitAuthority *authority,
+                             gpointer user_data)
+{
+    g_debug ("polkit configuration changed, dropping cached authorizations");
+    polkit_cache_clear ();
+}
+
+static void
+polkit_authority_ready_cb (GObject *source_object,
+                           GAsyncResult *res,
+                           gpointer user_data)
+{
+    PolkitAuthority *authority;
+    GList *waiters, *curr;
+    GError *err = NULL;
+
+    if ((authority = polkit_authority_get_finish (res, &err)) != NULL) {
+        g_signal_connect (authority, "notify::owner", G_CALLBACK (polkit_authority_owner_changed_cb), NULL);
+        g_signal_connect (authority, "changed", G_CALLBACK (polkit_authority_changed_cb), NULL);
+    } else
+        /* Leave polkit_authority unset, so that the next check retries */
+        g_warning ("Unable to get polkit authority: %s", err->message);
+
+    G_LOCK (polkit_authority);
+    polkit_authority = authority;
+    polkit_authority_pending = FALSE;
+    waiters = polkit_authority_waiters;
+    polkit_authority_waiters = NULL;
+    G_UNLOCK (polkit_authority);
+
+    for (curr = waiters; curr != NULL; curr = curr->next) {
+        struct check_polkit_data *data = (struct check_polkit_data *) curr->data;
+
+        if (authority != NULL) {
+            data->authority = g_object_ref (authority);
+            check_polkit_start (data);
+        } else
+            check_polkit_return (data, g_error_copy (err));
+    }
+    g_list_free (waiters);
+    if (err != NULL)
+        g_error_free (err);
+}
+
+/* Must be called with the polkit_authority lock held */
+static void
+polkit_authority_fetch (void)
+{
+    if (polkit_authority != NULL || polkit_authority_pending)
+        return;
+    polkit_authority_pending = TRUE;
+    polkit_authority_get_async (NULL, polkit_authority_ready_cb, NULL);
+}
+
+/* Authorization backends are tried in order until one of them decides. A
+ * backend's check function either completes data with check_polkit_return or
+ * hands it on with auth_backend_next. */
+struct auth_backend {
+    const gchar *name;
+    void (*check) (struct check_polkit_data *data);
+};
+
+static void auth_local_check (struct check_polkit_data *data);
+static void auth_polkit_cache_check (struct check_polkit_data *data);
+static void auth_polkit_check (struct check_polkit_data *data);
+
+static const struct auth_backend auth_backend_local = { "local", auth_local_check };
+static const struct auth_backend auth_backend_polkit_cache = { "polkit cache", auth_polkit_cache_check };
+static const struct auth_backend auth_backend_polkit = { "polkit", auth_polkit_check };
+
+/* Filled in by utils_init; polkit is always last */
+static const struct auth_backend *auth_backends[4] = { &auth_backend_polkit, NULL };
+
+static void
+auth_backend_next (struct check_polkit_data *data)
+{
+    const struct auth_backend *backend;
+    GError *err = NULL;
+
+    /* Nobody is left to authorize for */
+    if (g_cancellable_set_error_if_cancelled (data->cancellable, &err)) {
+        check_polkit_return (data, err);
+        return;
+    }
+
+    backend = auth_backends[data->backend++];
+    g_assert (backend != NULL);
+    backend->check (data);
+}
+
+/* Local policy: root, and optionally members of a trusted group, are
+ * authorized for everything. Whether a peer qualifies is resolved once, from
+ * its GetConnectionCredentials, and remembered until it disconnects. */
+struct peer_credentials {
+    GDBusConnection *connection;
+    guint watch_id;
+    gboolean trusted;
+};
+
+static gboolean auth_local_enabled = FALSE;
+static gboolean auth_local_have_trusted_gid = FALSE;
+static gid_t auth_local_trusted_gid = 0;
+static GHashTable *peer_credentials = NULL; /* unique name -> struct peer_credentials */
+G_LOCK_DEFINE_STATIC (peer_credentials);
+
+static void
+peer_credentials_free (struct peer_credentials *credentials)
+{
+    bus_peer_unwatch (credentials->connection, credentials->watch_id);
+    g_object_unref (credentials->connection);
+    g_free (credentials);
 }
 
 static void
-check_polkit_authority_cb (GObject *source_object,
+peer_credentials_vanished_cb (const gchar *unique_name,
+                              gpointer user_data)
+{
+    G_LOCK (peer_credentials);
+    if (peer_credentials != NULL)
+        g_hash_table_remove (peer_credentials, unique_name);
+    G_UNLOCK (peer_credentials);
+}
+
+/* Used when the bus does not report a peer's groups */
+static gboolean
+uid_in_group (uid_t uid,
+              gid_t gid)
+{
+    struct passwd pwd, *pw = NULL;
+    gchar buf[4096];
+    gid_t groups[256];
+    int ngroups = G_N_ELEMENTS (groups), i;
+
+    if (getpwuid_r (uid, &pwd, buf, sizeof (buf), &pw) != 0 || pw == NULL)
+        return FALSE;
+    if (pw->pw_gid == gid)
+        return TRUE;
+    if (getgrouplist (pw->pw_name, pw->pw_gid, groups, &ngroups) < 0)
+        return FALSE;
+    for (i = 0; i < ngroups; i++)
+        if (groups[i] == gid)
+            return TRUE;
+    return FALSE;
+}
+
+static gboolean
+credentials_are_trusted (GVariant *credentials)
+{
+    GVariant *groups;
+    guint32 uid;
+    gboolean ret = FALSE;
+
+    if (!g_variant_lookup (credentials, "UnixUserID", "u", &uid))
+        return FALSE;
+    if (uid == 0)
+        return TRUE;
+    if (!auth_local_have_trusted_gid)
+        return FALSE;
+
+    if ((groups = g_variant_lookup_value (credentials, "UnixGroupIDs", G_VARIANT_TYPE ("au"))) != NULL) {
+        const guint32 *gids;
+        gsize n_gids, i;
+
+        gids = g_variant_get_fixed_array (groups, &n_gids, sizeof (guint32));
+        for (i = 0; i < n_gids && !ret; i++)
+            ret = gids[i] == auth_local_trusted_gid;
+        g_variant_unref (groups);
+    } else
+        ret = uid_in_group (uid, auth_local_trusted_gid);
+    return ret;
+}
+
+static void
+auth_local_decide (struct check_polkit_data *data,
+                   gboolean trusted)
+{
+    if (trusted) {
+        g_debug ("Authorizing for '%s': trusted local peer", data->action_id);
+        check_polkit_return (data, NULL);
+    } else
+        auth_backend_next (data);
+}
+
+static void
+auth_local_credentials_cb (GObject *source_object,
                            GAsyncResult *res,
                            gpointer _data)
 {
-    struct check_polkit_data *data;
+    struct check_polkit_data *data = (struct check_polkit_data *) _data;
+    struct peer_credentials *credentials;
+    GVariant *reply, *dict;
     GError *err = NULL;
 
-    data = (struct check_polkit_data *) _data;
-    if ((data->authority = polkit_authority_get_finish (res, &err)) == NULL) {
-        g_task_report_error (NULL, data->callback, data->user_data, NULL, err);
-        check_polkit_data_free (data);
+    if ((reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), res, &err)) == NULL) {
+        if (g_error_matches (err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            check_polkit_return (data, err);
+            return;
+        }
+        /* Let polkit decide */
+        g_debug ("Unable to get credentials of %s: %s", data->unique_name, err->message);
+        g_error_free (err);
+        auth_backend_next (data);
         return;
     }
-    if (data->unique_name == NULL || data->action_id == NULL || 
-        (data->subject = polkit_system_bus_name_new (data->unique_name)) == NULL) {
-        g_task_report_new_error (NULL, data->callback, data->user_data, NULL, POLKIT_ERROR, POLKIT_ERROR_FAILED, "Authorizing for '%s': failed sanity check", data->action_id);
-        check_polkit_data_free (data);
+
+    credentials = g_new0 (struct peer_credentials, 1);
+    g_variant_get (reply, "(@a{sv})", &dict);
+    credentials->trusted = credentials_are_trusted (dict);
+    g_variant_unref (dict);
+    g_variant_unref (reply);
+    credentials->connection = g_object_ref (data->connection);
+    credentials->watch_id = bus_peer_watch (data->connection, data->unique_name, peer_credentials_vanished_cb, NULL);
+
+    G_LOCK (peer_credentials);
+    if (peer_credentials == NULL)
+        peer_credentials = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)peer_credentials_free);
+    g_hash_table_replace (peer_credentials, g_strdup (data->unique_name), credentials);
+    G_UNLOCK (peer_credentials);
+
+    auth_local_decide (data, credentials->trusted);
+}
+
+static void
+auth_local_check (struct check_polkit_data *data)
+{
+    struct peer_credentials *credentials = NULL;
+    gboolean known = FALSE, trusted = FALSE;
+
+    G_LOCK (peer_credentials);
+    if (peer_credentials != NULL && (credentials = g_hash_table_lookup (peer_credentials, data->unique_name)) != NULL) {
+        known = TRUE;
+        trusted = credentials->trusted;
+    }
+    G_UNLOCK (peer_credentials);
+
+    if (known) {
+        auth_local_decide (data, trusted);
         return;
     }
-    polkit_authority_check_authorization (data->authority, data->subject, data->action_id, NULL, (PolkitCheckAuthorizationFlags) data->user_interaction, NULL, check_polkit_authorization_cb, data);
+
+    g_dbus_connection_call (data->connection,
+                            "org.freedesktop.DBus",
+                            "/org/freedesktop/DBus",
+                            "org.freedesktop.DBus",
+                            "GetConnectionCredentials",
+                            g_variant_new ("(s)", data->unique_name),
+                            G_VARIANT_TYPE ("(a{sv})"),
+                            G_DBUS_CALL_FLAGS_NONE,
+                            -1,
+                            data->cancellable,
+                            auth_local_credentials_cb,
+                            data);
+}
+
+static void
+auth_polkit_cache_check (struct check_polkit_data *data)
+{
+    if (polkit_cache_lookup (data->unique_name, data->action_id)) {
+        g_debug ("Authorizing for '%s': cached", data->action_id);
+        check_polkit_return (data, NULL);
+    } else
+        auth_backend_next (data);
+}
+
+static void
+auth_polkit_check (struct check_polkit_data *data)
+{
+    G_LOCK (polkit_authority);
+    if (polkit_authority != NULL)
+        data->authority = g_object_ref (polkit_authority);
+    else {
+        polkit_authority_waiters = g_list_append (polkit_authority_waiters, data);
+        polkit_authority_fetch ();
+    }
+    G_UNLOCK (polkit_authority);
+
+    if (data->authority != NULL)
+        check_polkit_start (data);
+}
+
+/* Admission control bounds the requests that are being authorized or
+ * carried out at once. A sender may have at most admission_max_per_sender
+ * requests outstanding; beyond admission_max_active, requests wait in
+ * admission_queue, which holds at most admission_max_queued of them. A
+ * request keeps its slot until its invocation is replied to and freed.
+ * Zero means no limit. */
+struct admission_sender {
+    guint outstanding; /* active or queued */
+    guint64 rejected; /* since last logged */
+};
+
+#define ADMISSION_LOG_INTERVAL 60 /* seconds */
+
+static guint admission_max_active = 0;
+static guint admission_max_queued = 0;
+static guint admission_max_per_sender = 0;
+static guint admission_active = 0;
+static GQueue admission_queue = G_QUEUE_INIT; /* of struct check_polkit_data */
+static GHashTable *admission_senders = NULL; /* unique name -> struct admission_sender */
+static guint admission_log_id = 0;
+static guint64 admission_rejected = 0;
+G_LOCK_DEFINE_STATIC (admission);
+
+enum admission_result {
+    ADMISSION_ACTIVE,
+    ADMISSION_QUEUED,
+    ADMISSION_REJECTED,
+};
+
+/* Logs and resets per-sender rejection counts, and forgets idle senders */
+static gboolean
+admission_log_cb (gpointer user_data)
+{
+    GHashTableIter iter;
+    const gchar *unique_name;
+    struct admission_sender *sender;
+
+    G_LOCK (admission);
+    g_hash_table_iter_init (&iter, admission_senders);
+    while (g_hash_table_iter_next (&iter, (gpointer *)&unique_name, (gpointer *)&sender)) {
+        if (sender->rejected > 0)
+            g_message ("Rejected %" G_GUINT64_FORMAT " requests from %s in the last %u seconds: too many pending requests",
+                       sender->rejected, unique_name, ADMISSION_LOG_INTERVAL);
+        sender->rejected = 0;
+        if (sender->outstanding == 0)
+            g_hash_table_iter_remove (&iter);
+    }
+    admission_log_id = 0;
+    G_UNLOCK (admission);
+    return FALSE;
+}
+
+static gboolean
+admission_start_cb (gpointer _data)
+{
+    auth_backend_next ((struct check_polkit_data *) _data);
+    return FALSE;
+}
+
+/* Called when an admitted invocation has been replied to */
+static void
+admission_release_cb (gpointer _unique_name,
+                      GObject *invocation)
+{
+    gchar *unique_name = (gchar *) _unique_name;
+    struct admission_sender *sender;
+    struct check_polkit_data *next;
+
+    G_LOCK (admission);
+    if (admission_senders != NULL && (sender = g_hash_table_lookup (admission_senders, unique_name)) != NULL) {
+        sender->outstanding--;
+        if (sender->outstanding == 0 && sender->rejected == 0)
+            g_hash_table_remove (admission_senders, unique_name);
+    }
+    /* Hand the slot straight to the oldest waiting request; it is started
+     * from the main context, since this may run on a worker thread */
+    if ((next = g_queue_pop_head (&admission_queue)) != NULL)
+        g_idle_add (admission_start_cb, next);
+    else
+        admission_active--;
+    G_UNLOCK (admission);
+    g_free (unique_name);
+}
+
+static enum admission_result
+admission_enter (GDBusMethodInvocation *invocation,
+                 struct check_polkit_data *data)
+{
+    struct admission_sender *sender;
+    enum admission_result ret;
+
+    G_LOCK (admission);
+    if (admission_senders == NULL)
+        admission_senders = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    if ((sender = g_hash_table_lookup (admission_senders, data->unique_name)) == NULL) {
+        sender = g_new0 (struct admission_sender, 1);
+        g_hash_table_insert (admission_senders, g_strdup (data->unique_name), sender);
+    }
+
+    if (admission_max_per_sender > 0 && sender->outstanding >= admission_max_per_sender)
+        ret = ADMISSION_REJECTED;
+    else if (admission_max_active == 0 || admission_active < admission_max_active) {
+        admission_active++;
+        ret = ADMISSION_ACTIVE;
+    } else if (admission_max_queued > 0 && admission_queue.length >= admission_max_queued)
+        ret = ADMISSION_REJECTED;
+    else {
+        g_queue_push_tail (&admission_queue, data);
+        ret = ADMISSION_QUEUED;
+    }
+
+    if (ret == ADMISSION_REJECTED) {
+        sender->rejected++;
+        admission_rejected++;
+        if (admission_log_id == 0)
+            admission_log_id = g_timeout_add_seconds (ADMISSION_LOG_INTERVAL, admission_log_cb, NULL);
+    } else {
+        sender->outstanding++;
+        g_object_weak_ref (G_OBJECT (invocation), admission_release_cb, g_strdup (data->unique_name));
+    }
+    G_UNLOCK (admission);
+    return ret;
 }
 
 void
-check_polkit_async (const gchar *unique_name,
+utils_set_admission_limits (guint max_active,
+                            guint max_queued,
+                            guint max_per_sender)
+{
+    G_LOCK (admission);
+    admission_max_active = max_active;
+    admission_max_queued = max_queued;
+    admission_max_per_sender = max_per_sender;
+    G_UNLOCK (admission);
+}
+
+/* Checks whether the sender of invocation is authorized for action_id. If
+ * queue is not NULL, callback runs on its worker thread rather than in the
+ * main context, so it may block. The check is abandoned if the sender
+ * disconnects; see bus_invocation_get_cancellable. */
+void
+check_polkit_async (GDBusMethodInvocation *invocation,
                     const gchar *action_id,
                     const gboolean user_interaction,
+                    WorkQueue *queue,
                     GAsyncReadyCallback callback,
                     gpointer user_data)
 {
     struct check_polkit_data *data;
 
     data = g_new0 (struct check_polkit_data, 1);
-    data->unique_name = unique_name;
+    data->invocation = invocation;
+    data->connection = g_dbus_method_invocation_get_connection (invocation);
+    data->unique_name = g_dbus_method_invocation_get_sender (invocation);
     data->action_id = action_id;
     data->user_interaction = user_interaction;
+    data->queue = queue;
+    data->cancellable = g_object_ref (bus_invocation_get_cancellable (invocation));
     data->callback = callback;
     data->user_data = user_data;
 
-    polkit_authority_get_async (NULL, check_polkit_authority_cb, data);
+    if (data->connection == NULL || data->unique_name == NULL || data->action_id == NULL) {
+        check_polkit_return (data, g_error_new (POLKIT_ERROR, POLKIT_ERROR_FAILED, "Authorizing for '%s': failed sanity check", data->action_id));
+        return;
+    }
+
+    switch (admission_enter (invocation, data)) {
+    case ADMISSION_ACTIVE:
+        auth_backend_next (data);
+        break;
+    case ADMISSION_QUEUED:
+        g_debug ("Queueing request from %s for '%s'", data->unique_name, data->action_id);
+        break;
+    case ADMISSION_REJECTED:
+        /* Reply from the main context rather than adding to a busy queue */
+        data->queue = NULL;
+        check_polkit_return (data, g_error_new (G_DBUS_ERROR, G_DBUS_ERROR_LIMITS_EXCEEDED,
+                                                "Too many pending requests from %s", data->unique_name));
+        break;
+    }
 }
 
 enum ShellEntryType {
@@ -175,25 +1022,360 @@ enum ShellEntryType {
     SHELL_ENTRY_TYPE_COMMENT,
     SHELL_ENTRY_TYPE_SEPARATOR,
     SHELL_ENTRY_TYPE_ASSIGNMENT,
+    SHELL_ENTRY_TYPE_REMOVED, /* cleared assignment, kept so that entry indices stay valid */
 };
 
+/* Entries do not own their text: string points into the parser's filebuf,
+ * or into owned once the entry has been modified */
 struct ShellEntry {
     enum ShellEntryType type;
-    gchar *string;
-    gchar *variable; /* only relevant for assignments */
-    gchar *unquoted_value; /* only relevant for assignments */
+    const gchar *string;
+    gsize length;
+    gsize variable_length; /* only relevant for assignments; the variable is string[0, variable_length) */
+    gsize value_offset; /* only relevant for assignments; the raw value is string[value_offset, length) */
+    guint prev_assignment; /* only relevant for assignments; 1 + index of the previous assignment to the same variable, or 0 */
+    gchar *owned;
 };
 
+#define shell_parser_entry(parser, i) (&g_array_index ((parser)->entries, struct ShellEntry, (i)))
+
+/* The variable index is keyed by pointers to the start of an assignment's
+ * text, so that no key needs to be allocated. A key ends at the first
+ * character that cannot be part of a variable name, which is exactly where
+ * shell_scan_var_equals ends the name, i.e. at variable_length; a line
+ * continuation or the '=' after it are never part of the key. Plain
+ * variable names can therefore be used for lookups. */
+static gboolean
+shell_is_variable_char (gchar c)
+{
+    return g_ascii_isalnum (c) || c == '_';
+}
+
+static guint
+shell_variable_hash (gconstpointer key)
+{
+    const gchar *p;
+    guint32 h = 5381;
+
+    for (p = key; shell_is_variable_char (*p); p++)
+        h = (h << 5) + h + *p;
+    return h;
+}
+
+static gboolean
+shell_variable_equal (gconstpointer a,
+                      gconstpointer b)
+{
+    const gchar *p = a, *q = b;
+
+    for (; shell_is_variable_char (*p); p++, q++) {
+        if (*p != *q)
+            return FALSE;
+    }
+    return !shell_is_variable_char (*q);
+}
+
+/* Returns the index of the last assignment to variable, or -1 if it is not assigned */
+static gint
+shell_parser_lookup (ShellParser *parser,
+                     const gchar *variable)
+{
+    gpointer value;
+
+    if ((value = g_hash_table_lookup (parser->variables, variable)) == NULL)
+        return -1;
+    return GPOINTER_TO_UINT (value) - 1;
+}
+
+/* Records the assignment at index i as the last one to its variable */
+static void
+shell_parser_index_assignment (ShellParser *parser,
+                               guint i)
+{
+    struct ShellEntry *entry;
+
+    entry = shell_parser_entry (parser, i);
+    entry->prev_assignment = GPOINTER_TO_UINT (g_hash_table_lookup (parser->variables, entry->string));
+    g_hash_table_replace (parser->variables, (gpointer)entry->string, GUINT_TO_POINTER (i + 1));
+}
+
+/* Returns the newly allocated unquoted value of an assignment entry */
+static gchar *
+shell_entry_get_value (const struct ShellEntry *entry)
+{
+    gchar *raw_value, *ret;
+
+    raw_value = g_strndup (entry->string + entry->value_offset, entry->length - entry->value_offset);
+    ret = g_shell_unquote (raw_value, NULL);
+    g_free (raw_value);
+    return ret;
+}
+
+/* Returns the newly allocated unquoted value of the last assignment to
+ * variable, or NULL if the variable is never assigned; unlike
+ * shell_parser_expand, nothing in the value is expanded */
+static gchar *
+shell_parser_get_variable (ShellParser *parser,
+                           const gchar *variable)
+{
+    gint i;
+
+    if ((i = shell_parser_lookup (parser, variable)) < 0)
+        return NULL;
+    return shell_entry_get_value (shell_parser_entry (parser, i));
+}
+
+/* Returns the index of the last assignment to variable before entry limit,
+ * or -1 if there is none */
+static gint
+shell_parser_lookup_before (ShellParser *parser,
+                            const gchar *variable,
+                            guint limit)
+{
+    gint i;
+
+    for (i = shell_parser_lookup (parser, variable); i >= (gint)limit; )
+        i = (gint)shell_parser_entry (parser, i)->prev_assignment - 1;
+    return i;
+}
+
+static gboolean
+shell_parser_expand_word (ShellParser *parser,
+                          const gchar **s,
+                          guint limit,
+                          gboolean in_braces,
+                          GString *out,
+                          GError **error);
+
+/* Returns the newly allocated value of the assignment at index i, evaluated
+ * the way sh would when it reaches that line, or NULL on error */
+static gchar *
+shell_parser_evaluate_assignment (ShellParser *parser,
+                                  guint i,
+                                  GError **error)
+{
+    const struct ShellEntry *entry;
+    gchar *raw_value;
+    const gchar *s;
+    GString *out;
+    gboolean ret;
+
+    entry = shell_parser_entry (parser, i);
+    /* The value is copied so that evaluation cannot run past its end */
+    raw_value = g_strndup (entry->string + entry->value_offset, entry->length - entry->value_offset);
+    out = g_string_new (NULL);
+    s = raw_value;
+    /* Only earlier assignments are visible, which also bounds the recursion */
+    ret = shell_parser_expand_word (parser, &s, i, FALSE, out, error);
+    g_free (raw_value);
+    if (!ret) {
+        g_string_free (out, TRUE);
+        return NULL;
+    }
+    return g_string_free (out, FALSE);
+}
+
+/* Expands the parameter starting at the '$' at *s and advances *s past it */
+static gboolean
+shell_parser_expand_parameter (ShellParser *parser,
+                               const gchar **s,
+                               guint limit,
+                               GString *out,
+                               GError **error)
+{
+    const gchar *p, *name_start;
+    gchar *name, *value = NULL;
+    gboolean braced, colon = FALSE, ret;
+    gint i;
+
+    p = *s + 1;
+    if ((braced = (*p == '{')))
+        p++;
+
+    name_start = p;
+    if (!g_ascii_isalpha (*p) && *p != '_') {
+        if (braced) {
+            g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "bad substitution");
+            return FALSE;
+        }
+        /* A lone '$' is not special */
+        g_string_append_c (out, '$');
+        *s = p;
+        return TRUE;
+    }
+    while (shell_is_variable_char (*p))
+        p++;
+
+    name = g_strndup (name_start, p - name_start);
+    i = shell_parser_lookup_before (parser, name, limit);
+    g_free (name);
+    if (i >= 0 && (value = shell_parser_evaluate_assignment (parser, i, error)) == NULL)
+        return FALSE;
+
+    if (!braced) {
+        if (value != NULL)
+            g_string_append (out, value);
+        g_free (value);
+        *s = p;
+        return TRUE;
+    }
+
+    if (*p == ':') {
+        colon = TRUE;
+        p++;
+    }
+    if (*p == '}' && !colon) {
+        if (value != NULL)
+            g_string_append (out, value);
+        g_free (value);
+        *s = p + 1;
+        return TRUE;
+    }
+    if (*p != '-') {
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "unsupported parameter expansion");
+        g_free (value);
+        return FALSE;
+    }
+    p++;
+
+    /* ${var-word} uses word if var is unset; ${var:-word} also if var is empty */
+    if (value != NULL && !(colon && *value == 0)) {
+        GString *unused;
+
+        /* Still parse word, both to validate it and to find the closing brace */
+        unused = g_string_new (NULL);
+        ret = shell_parser_expand_word (parser, &p, limit, TRUE, unused, error);
+        g_string_free (unused, TRUE);
+        g_string_append (out, value);
+    } else
+        ret = shell_parser_expand_word (parser, &p, limit, TRUE, out, error);
+    g_free (value);
+
+    if (!ret)
+        return FALSE;
+    *s = p + 1;
+    return TRUE;
+}
+
+/* Expands a double-quoted string starting after the opening quote at *s,
+ * and advances *s past the closing one */
+static gboolean
+shell_parser_expand_double_quoted (ShellParser *parser,
+                                   const gchar **s,
+                                   guint limit,
+                                   GString *out,
+                                   GError **error)
+{
+    while (**s != '"') {
+        if (**s == 0) {
+            g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "missing '\"'");
+            return FALSE;
+        }
+        if (**s == '\\' && (*s)[1] == '\n')
+            *s += 2;
+        else if (**s == '\\' && (*s)[1] != 0 && strchr ("$`\"\\", (*s)[1]) != NULL) {
+            g_string_append_c (out, (*s)[1]);
+            *s += 2;
+        } else if (**s == '$') {
+            if (!shell_parser_expand_parameter (parser, s, limit, out, error))
+                return FALSE;
+        } else {
+            g_string_append_c (out, **s);
+            (*s)++;
+        }
+    }
+    (*s)++;
+    return TRUE;
+}
+
+/* Expands characters from *s until the end of the string, or until the
+ * closing brace of the enclosing ${...} if in_braces is set. Variables are
+ * looked up among the assignments before entry limit. */
+static gboolean
+shell_parser_expand_word (ShellParser *parser,
+                          const gchar **s,
+                          guint limit,
+                          gboolean in_braces,
+                          GString *out,
+                          GError **error)
+{
+    const gchar *end;
+
+    while (**s != 0) {
+        if (in_braces && **s == '}')
+            return TRUE;
+
+        if (**s == '\'') {
+            if ((end = strchr (*s + 1, '\'')) == NULL) {
+                g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "missing \"'\"");
+                return FALSE;
+            }
+            g_string_append_len (out, *s + 1, end - *s - 1);
+            *s = end + 1;
+        } else if (**s == '"') {
+            (*s)++;
+            if (!shell_parser_expand_double_quoted (parser, s, limit, out, error))
+                return FALSE;
+        } else if (**s == '\\' && (*s)[1] == '\n') {
+            *s += 2;
+        } else if (**s == '\\' && (*s)[1] != 0) {
+            g_string_append_c (out, (*s)[1]);
+            *s += 2;
+        } else if (**s == '$') {
+            if (!shell_parser_expand_parameter (parser, s, limit, out, error))
+                return FALSE;
+        } else {
+            g_string_append_c (out, **s);
+            (*s)++;
+        }
+    }
+
+    if (in_braces) {
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "missing '}'");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Evaluates a restricted shell word against the variables assigned in
+ * parser, as sh would after sourcing the file. Quoting, $var, ${var},
+ * ${var-word} and ${var:-word} are supported, nested arbitrarily, both in
+ * expression and in the assigned values, which see only the assignments
+ * before them. Anything else, such as $(...), `...`, arithmetic or other
+ * parameter expansions, is not evaluated: the parser rejects files with
+ * command substitutions, and other expansions fail with an error, so that
+ * callers fall back to their defaults. Unlike sourcing the file with sh,
+ * the environment is never consulted and nothing in the file is executed. */
+static gchar *
+shell_parser_expand (ShellParser *parser,
+                     const gchar *expression,
+                     GError **error)
+{
+    GString *out;
+    const gchar *s;
+
+    g_assert (parser != NULL);
+    g_assert (expression != NULL);
+
+    out = g_string_new (NULL);
+    s = expression;
+    if (!shell_parser_expand_word (parser, &s, parser->entries->len, FALSE, out, error)) {
+        g_prefix_error (error, "Unable to evaluate '%s': ", expression);
+        g_string_free (out, TRUE);
+        return NULL;
+    }
+    return g_string_free (out, FALSE);
+}
+
 gchar *
 shell_source_var (GFile *file,
                   const gchar *variable,
                   GError **error)
 {
-    gchar *argv[4] = { "sh", "-c", NULL, NULL };
-    gchar *filename = NULL, *quoted_filename = NULL;
+    gchar *filename = NULL;
     gchar *output = NULL;
     GFileInfo *info;
-    const GFileAttributeInfo *attribute_info;
+    ShellParser *parser = NULL;
 
     filename = g_file_get_path (file);
     if ((info = g_file_query_info (file, G_FILE_ATTRIBUTE_STANDARD_TYPE "," G_FILE_ATTRIBUTE_ACCESS_CAN_READ, G_FILE_QUERY_INFO_NONE, NULL, error)) == NULL) {
@@ -216,71 +1398,380 @@ shell_source_var (GFile *file,
         goto out;
     }
 
-    quoted_filename = g_shell_quote (filename);
-    argv[2] = g_strdup_printf (". %s; echo -n %s", quoted_filename, variable);
+    if ((parser = shell_parser_new (file, error)) == NULL)
+        goto out;
+
+    if ((output = shell_parser_expand (parser, variable, error)) == NULL)
+        g_prefix_error (error, "Unable to source '%s': ", filename);
+
+  out:
+    g_free (filename);
+    if (info != NULL)
+        g_object_unref (info);
+    shell_parser_free (parser);
+    return output;
+}
+
+static void
+file_identity_from_stat (const struct stat *st,
+                         FileIdentity *identity)
+{
+    identity->valid = TRUE;
+    identity->dev = st->st_dev;
+    identity->ino = st->st_ino;
+    identity->size = st->st_size;
+    identity->mtime_ns = (gint64)st->st_mtim.tv_sec * G_GINT64_CONSTANT (1000000000) + st->st_mtim.tv_nsec;
+}
+
+gboolean
+file_identity_stat (const gchar *filename,
+                    FileIdentity *identity)
+{
+    struct stat st;
+
+    memset (identity, 0, sizeof (FileIdentity));
+    if (filename == NULL || stat (filename, &st) != 0)
+        return FALSE;
+
+    file_identity_from_stat (&st, identity);
+    return TRUE;
+}
+
+gboolean
+file_identity_equal (const FileIdentity *a,
+                     const FileIdentity *b)
+{
+    return a->valid && b->valid &&
+           a->dev == b->dev &&
+           a->ino == b->ino &&
+           a->size == b->size &&
+           a->mtime_ns == b->mtime_ns;
+}
+
+static FileFsyncPolicy file_fsync_policy = FILE_FSYNC_POLICY_FILE;
+
+gboolean
+file_fsync_policy_parse (const gchar *name,
+                         FileFsyncPolicy *policy)
+{
+    if (name == NULL || !g_strcmp0 (name, "file"))
+        *policy = FILE_FSYNC_POLICY_FILE;
+    else if (!g_strcmp0 (name, "none"))
+        *policy = FILE_FSYNC_POLICY_NONE;
+    else if (!g_strcmp0 (name, "dir"))
+        *policy = FILE_FSYNC_POLICY_DIR;
+    else
+        return FALSE;
+    return TRUE;
+}
+
+static gboolean
+write_all (int fd,
+           const gchar *contents,
+           gsize length)
+{
+    while (length > 0) {
+        ssize_t written;
+
+        if ((written = write (fd, contents, length)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return FALSE;
+        }
+        contents += written;
+        length -= written;
+    }
+    return TRUE;
+}
+
+/* Set once an unnamed file could not be linked, e.g. without /proc */
+static volatile gint file_unnamed_unsupported = 0;
+
+/* Creates an unnamed file in dirname if the filesystem supports it and
+ * unnamed is TRUE, or else a uniquely named one; *tmpname is set to NULL in
+ * the former case */
+static int
+file_create_temporary (const gchar *dirname,
+                       const gchar *basename,
+                       gboolean unnamed,
+                       gchar **tmpname)
+{
+    int fd;
+
+    *tmpname = NULL;
+#ifdef O_TMPFILE
+    if (unnamed && !g_atomic_int_get (&file_unnamed_unsupported)) {
+        if ((fd = open (dirname, O_TMPFILE | O_WRONLY | O_CLOEXEC, 0600)) >= 0)
+            return fd;
+        if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)
+            return -1;
+    }
+#endif
+    *tmpname = g_strdup_printf ("%s/.%s.XXXXXX", dirname, basename);
+    if ((fd = g_mkstemp_full (*tmpname, O_WRONLY | O_CLOEXEC, 0600)) < 0) {
+        g_free (*tmpname);
+        *tmpname = NULL;
+    }
+    return fd;
+}
+
+/* Gives the unnamed file fd a temporary name in dirname, so that it can be
+ * renamed over the destination */
+static gchar *
+file_link_temporary (int fd,
+                     const gchar *dirname,
+                     const gchar *basename)
+{
+    gchar *fd_path, *tmpname = NULL;
+    guint tries;
+
+    fd_path = g_strdup_printf ("/proc/self/fd/%d", fd);
+    for (tries = 0; tries < 16; tries++) {
+        tmpname = g_strdup_printf ("%s/.%s.%08x", dirname, basename, g_random_int ());
+        if (linkat (AT_FDCWD, fd_path, AT_FDCWD, tmpname, AT_SYMLINK_FOLLOW) == 0)
+            break;
+        g_free (tmpname);
+        tmpname = NULL;
+        if (errno != EEXIST)
+            break;
+    }
+    g_free (fd_path);
+    return tmpname;
+}
+
+/* Atomically replaces filename (or the file it links to) with contents,
+ * using a single write() into a temporary file in the same directory that
+ * is then renamed into place. The existing file's mode and ownership are
+ * kept, and data is flushed according to the --fsync policy. On success,
+ * identity (if not NULL) is set to the identity of the new file. If
+ * cancellable is cancelled before the rename, the file is left untouched. */
+gboolean
+file_write_atomic (const gchar *filename,
+                   const gchar *contents,
+                   gsize length,
+                   FileIdentity *identity,
+                   GCancellable *cancellable,
+                   GError **error)
+{
+    gchar *target = NULL, *dirname = NULL, *basename = NULL, *tmpname = NULL;
+    const gchar *failed_op = NULL;
+    struct stat st, new_st;
+    mode_t mode = 0644;
+    gboolean have_old = FALSE, unnamed = TRUE, ret = FALSE;
+    int fd = -1, saved_errno = 0;
+
+    if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+
+    /* Replace the target of a symlink rather than the symlink itself */
+    if ((target = realpath (filename, NULL)) == NULL)
+        target = g_strdup (filename);
+    if (stat (target, &st) == 0) {
+        have_old = TRUE;
+        mode = st.st_mode & 07777;
+    }
+    dirname = g_path_get_dirname (target);
+    basename = g_path_get_basename (target);
+
+  retry:
+    if ((fd = file_create_temporary (dirname, basename, unnamed, &tmpname)) < 0) {
+        failed_op = "create temporary file";
+        goto fail;
+    }
+    if (!write_all (fd, contents, length)) {
+        failed_op = "write";
+        goto fail;
+    }
+    if (fchmod (fd, mode) != 0) {
+        failed_op = "set mode";
+        goto fail;
+    }
+    /* Only root can give files away; failing that, the file stays ours */
+    if (have_old && fchown (fd, st.st_uid, st.st_gid) != 0)
+        g_debug ("Unable to keep ownership of '%s': %s", target, g_strerror (errno));
+    if (file_fsync_policy != FILE_FSYNC_POLICY_NONE && fsync (fd) != 0) {
+        failed_op = "sync";
+        goto fail;
+    }
+    if (identity != NULL) {
+        /* Renaming keeps the inode and does not touch the mtime */
+        if (fstat (fd, &new_st) == 0)
+            file_identity_from_stat (&new_st, identity);
+        else
+            memset (identity, 0, sizeof (FileIdentity));
+    }
+    if (tmpname == NULL && (tmpname = file_link_temporary (fd, dirname, basename)) == NULL) {
+        /* Linking goes through /proc, which may not be mounted; a named
+         * file does not need it */
+        g_debug ("Unable to link unnamed temporary file in '%s': %s", dirname, g_strerror (errno));
+        if (errno != EEXIST)
+            g_atomic_int_set (&file_unnamed_unsupported, 1);
+        close (fd);
+        fd = -1;
+        unnamed = FALSE;
+        goto retry;
+    }
+    /* The rename is the point of no return */
+    if (g_cancellable_set_error_if_cancelled (cancellable, error)) {
+        unlink (tmpname);
+        goto out;
+    }
+    if (rename (tmpname, target) != 0) {
+        failed_op = "rename temporary file";
+        goto fail;
+    }
+    g_free (tmpname);
+    tmpname = NULL;
+
+    if (file_fsync_policy == FILE_FSYNC_POLICY_DIR) {
+        int dirfd;
+
+        if ((dirfd = open (dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 || fsync (dirfd) != 0) {
+            saved_errno = errno;
+            if (dirfd >= 0)
+                close (dirfd);
+            errno = saved_errno;
+            failed_op = "sync directory";
+            goto fail;
+        }
+        close (dirfd);
+    }
+    ret = TRUE;
+    goto out;
+
+  fail:
+    saved_errno = errno;
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                 "Unable to %s: %s", failed_op, g_strerror (saved_errno));
+    if (tmpname != NULL)
+        unlink (tmpname);
+
+  out:
+    if (fd >= 0)
+        close (fd);
+    g_free (tmpname);
+    g_free (target);
+    g_free (dirname);
+    g_free (basename);
+    return ret;
+}
+
+/* Parsers that still match the file they were read from, keyed by filename;
+ * a parser is removed from the cache while a caller is using it */
+static GHashTable *shell_parser_cache = NULL;
+G_LOCK_DEFINE_STATIC (shell_parser_cache);
+
+static void
+shell_parser_destroy (ShellParser *parser)
+{
+    guint i;
+
+    if (parser == NULL)
+        return;
+
+    if (parser->file != NULL)
+        g_object_unref (parser->file);
+    if (parser->filename != NULL)
+        g_free (parser->filename);
+    g_free (parser->filebuf);
+    g_hash_table_destroy (parser->variables);
+    for (i = 0; i < parser->entries->len; i++)
+        g_free (shell_parser_entry (parser, i)->owned);
+    g_array_free (parser->entries, TRUE);
+    g_free (parser);
+}
+
+void
+shell_parser_free (ShellParser *parser)
+{
+    if (parser == NULL)
+        return;
 
-    if (!g_spawn_sync (NULL, argv, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, &output, NULL, NULL, error)) {
-        g_prefix_error (error, "Unable to source '%s': ", filename);
+    if (!parser->identity.valid || parser->dirty || parser->filename == NULL) {
+        shell_parser_destroy (parser);
+        return;
     }
 
-  out:
-    g_free (filename);
-    g_free (quoted_filename);
-    if (info != NULL)
-        g_object_unref (info);
-    if (argv[2] != NULL)
-        g_free (argv[2]);
-    return output;
+    G_LOCK (shell_parser_cache);
+    if (shell_parser_cache == NULL)
+        shell_parser_cache = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify)shell_parser_destroy);
+    g_hash_table_remove (shell_parser_cache, parser->filename);
+    g_hash_table_insert (shell_parser_cache, parser->filename, parser);
+    G_UNLOCK (shell_parser_cache);
 }
 
-static void
-shell_entry_free (struct ShellEntry *entry)
+/* Returns the cached parser for filename if the file is unchanged since it
+ * was parsed; the caller then owns the parser until shell_parser_free */
+static ShellParser *
+shell_parser_cache_take (const gchar *filename,
+                         const FileIdentity *identity)
 {
-    if (entry == NULL)
-        return;
+    ShellParser *ret = NULL;
+
+    G_LOCK (shell_parser_cache);
+    if (shell_parser_cache != NULL && (ret = g_hash_table_lookup (shell_parser_cache, filename)) != NULL) {
+        g_hash_table_steal (shell_parser_cache, filename);
+        if (!file_identity_equal (&ret->identity, identity)) {
+            shell_parser_destroy (ret);
+            ret = NULL;
+        }
+    }
+    G_UNLOCK (shell_parser_cache);
 
-    g_free (entry->string);
-    g_free (entry->variable);
-    g_free (entry->unquoted_value);
-    g_free (entry);
+    if (ret != NULL)
+        g_debug ("Reusing cached parse of '%s'", filename);
+    return ret;
 }
 
-void
-shell_parser_free (ShellParser *parser)
+static ShellParser *
+shell_parser_new_empty (GFile *file,
+                        guint reserved_entries)
 {
-    if (parser == NULL)
-        return;
+    ShellParser *ret;
 
-    if (parser->file != NULL)
-        g_object_unref (parser->file);
-    if (parser->filename != NULL)
-        g_free (parser->filename);
-    if (parser->entry_list != NULL)
-        g_list_free_full (parser->entry_list, (GDestroyNotify)shell_entry_free);
-    g_free (parser);
+    ret = g_new0 (ShellParser, 1);
+    g_object_ref (file);
+    ret->file = file;
+    ret->filename = g_file_get_path (file);
+    ret->entries = g_array_sized_new (FALSE, FALSE, sizeof (struct ShellEntry), reserved_entries);
+    ret->variables = g_hash_table_new (shell_variable_hash, shell_variable_equal);
+    return ret;
 }
 
+static ShellParser *
+shell_parser_new_take_buffer (GFile *file,
+                              gchar *filebuf,
+                              gsize length,
+                              GError **error);
+
 ShellParser *
 shell_parser_new (GFile *file,
                   GError **error)
 {
-    gchar *filebuf = NULL;
-    GError *local_err = NULL;
     ShellParser *ret = NULL;
+    FileIdentity identity;
+    gchar *filename, *filebuf = NULL;
+    gsize length = 0;
+    GError *local_err = NULL;
 
     if (file == NULL)
         return NULL;
 
-    if (!g_file_load_contents (file, NULL, &filebuf, NULL, NULL, &local_err)) {
+    /* The file is stat'ed before it is read, so if it changes in between, the
+     * recorded identity is stale and the next lookup misses the cache */
+    filename = g_file_get_path (file);
+    if (file_identity_stat (filename, &identity))
+        ret = shell_parser_cache_take (filename, &identity);
+    g_free (filename);
+    if (ret != NULL)
+        return ret;
+
+    if (!g_file_load_contents (file, NULL, &filebuf, &length, NULL, &local_err)) {
         if (local_err != NULL) {
             /* Inability to parse or open is a failure; file not existing at all is *not* a failure */
             if (local_err->code == G_IO_ERROR_NOT_FOUND) {
                 g_error_free (local_err);
-                ret = g_new0 (ShellParser, 1);
-                g_object_ref (file);
-                ret->file = file;
-                ret->filename = g_file_get_path (file);
-                return ret;
+                return shell_parser_new_empty (file, 0);
             } else {
                 gchar *filename;
                 filename = g_file_get_path (file);
@@ -290,228 +1781,280 @@ shell_parser_new (GFile *file,
         }
         return NULL;
     }
-    ret = shell_parser_new_from_string (file, filebuf, error);
-    g_free (filebuf);
+    if ((ret = shell_parser_new_take_buffer (file, filebuf, length, error)) != NULL)
+        ret->identity = identity;
     return ret;
 }
 
-ShellParser *
-shell_parser_new_from_string (GFile *file,
-                                     gchar *filebuf,
-                                     GError **error)
-{
-    ShellParser *ret = NULL;
-    GError *local_err = NULL;
-    gchar *s;
+/* Hand-written scanner for the restricted shell syntax that ShellParser
+ * accepts; each function returns the length of the token at s, or 0 if there
+ * is none */
 
-    if (file == NULL || filebuf == NULL)
-        return NULL;
+static gsize
+shell_scan_comment (const gchar *s)
+{
+    const gchar *newline;
 
-    ret = g_new0 (ShellParser, 1);
-    g_object_ref (file);
-    ret->file = file;
-    ret->filename = g_file_get_path (file);
+    if (*s != '#')
+        return 0;
+    if ((newline = strchr (s, '\n')) != NULL)
+        return newline - s + 1;
+    return strlen (s);
+}
 
-    gboolean want_separator = FALSE; /* Do we expect the next entry to be a separator or comment? */
-    s = filebuf;
-    while (*s != 0) {
-        g_debug ("Scanning string: ``%s''", s);
-        gboolean matched = FALSE;
-        GMatchInfo *match_info = NULL;
-        struct ShellEntry *entry = NULL;
- 
-        matched = g_regex_match (comment_regex, s, 0, &match_info);
-        if (matched) {
-            entry = g_new0 (struct ShellEntry, 1);
-            entry->type = SHELL_ENTRY_TYPE_COMMENT;
-            entry->string = g_match_info_fetch (match_info, 0);
-            ret->entry_list = g_list_prepend (ret->entry_list, entry);
-            s += strlen (entry->string);
-            g_debug ("Scanned comment: ``%s''", entry->string);
-            _g_match_info_clear (&match_info);
-            want_separator = FALSE;
-            continue;
-        }
-        _g_match_info_clear (&match_info);
-
-        matched = g_regex_match (separator_regex, s, 0, &match_info);
-        if (matched) {
-            entry = g_new0 (struct ShellEntry, 1);
-            entry->type = SHELL_ENTRY_TYPE_SEPARATOR;
-            entry->string = g_match_info_fetch (match_info, 0);
-            ret->entry_list = g_list_prepend (ret->entry_list, entry);
-            s += strlen (entry->string);
-            g_debug ("Scanned separator: ``%s''", entry->string);
-            _g_match_info_clear (&match_info);
-            want_separator = FALSE;
-            continue;
-        }
-        _g_match_info_clear (&match_info);
-
-        matched = g_regex_match (indent_regex, s, 0, &match_info);
-        if (matched) {
-            entry = g_new0 (struct ShellEntry, 1);
-            entry->type = SHELL_ENTRY_TYPE_INDENT;
-            entry->string = g_match_info_fetch (match_info, 0);
-            ret->entry_list = g_list_prepend (ret->entry_list, entry);
-            s += strlen (entry->string);
-            g_debug ("Scanned indent: ``%s''", entry->string);
-            _g_match_info_clear (&match_info);
-            continue;
-        }
-        _g_match_info_clear (&match_info);
+static gboolean
+shell_is_separator_char (gchar c)
+{
+    return c == ' ' || c == '\t' || c == ';' || c == '\n' || c == '\r';
+}
 
-        matched = g_regex_match (var_equals_regex, s, 0, &match_info);
-        if (matched) {
-            gchar *raw_value = NULL, *temp1 = NULL, *temp2 = NULL;
-            /* If we expect a separator and get an assignment instead, fail */
-            if (want_separator)
-                goto no_match;
+/* A run of blanks, ';' and newlines containing at least one ';' or newline */
+static gsize
+shell_scan_separator (const gchar *s)
+{
+    const gchar *p;
+    gboolean found = FALSE;
 
-            entry = g_new0 (struct ShellEntry, 1);
-            entry->type = SHELL_ENTRY_TYPE_ASSIGNMENT;
-            entry->string = g_match_info_fetch (match_info, 0);
-            entry->variable = g_match_info_fetch (match_info, 1);
-            s += strlen (entry->string);
-            g_debug ("Scanned variable: ``%s''", entry->string);
-            _g_match_info_clear (&match_info);
-            want_separator = TRUE;
+    for (p = s; shell_is_separator_char (*p); p++)
+        if (*p == ';' || *p == '\n')
+            found = TRUE;
+    return found ? p - s : 0;
+}
 
-            while (*s != 0) {
-                g_debug ("Scanning string for values: ``%s''", s);
-                gboolean matched2 = FALSE;
+static gsize
+shell_scan_indent (const gchar *s)
+{
+    const gchar *p;
 
-                matched2 = g_regex_match (single_quoted_regex, s, 0, &match_info);
-                if (matched2)
-                    goto append_value;
+    for (p = s; *p == ' ' || *p == '\t'; p++);
+    return p - s;
+}
 
-                _g_match_info_clear (&match_info);
+/* A variable name and '=', either of which may be followed by line continuations */
+static gsize
+shell_scan_var_equals (const gchar *s,
+                       gsize *name_len)
+{
+    const gchar *p = s;
+
+    if (!g_ascii_isalpha (*p) && *p != '_')
+        return 0;
+    while (shell_is_variable_char (*p))
+        p++;
+    *name_len = p - s;
+
+    while (p[0] == '\\' && p[1] == '\n')
+        p += 2;
+    if (*p != '=')
+        return 0;
+    p++;
+    while (p[0] == '\\' && p[1] == '\n')
+        p += 2;
+    return p - s;
+}
 
-                matched2 = g_regex_match (double_quoted_regex, s, 0, &match_info);
-                if (matched2)
-                    goto append_value;
+/* A (possibly empty) value made of single-quoted, double-quoted and unquoted
+ * parts. We do not want to allow $(...) or `...` constructs because they might
+ * have side effects, but ${...} is OK. Returns FALSE if a quoted part is
+ * unterminated or contains a forbidden construct. */
+static gboolean
+shell_scan_value (const gchar *s,
+                  gsize *len)
+{
+    const gchar *p = s;
+
+    for (;;) {
+        if (*p == '\'') {
+            if ((p = strchr (p + 1, '\'')) == NULL)
+                return FALSE;
+            p++;
+        } else if (*p == '"') {
+            for (p++; *p != '"'; p++) {
+                if (*p == 0 || *p == '`' || (*p == '$' && p[1] != '{'))
+                    return FALSE;
+                if (*p == '\\' && p[1] != 0)
+                    p++;
+            }
+            p++;
+        } else if (*p == '\\' && p[1] != 0) {
+            p += 2;
+        } else if (*p == '$' && p[1] == '{') {
+            p += 2;
+        } else if (*p != 0 && !g_ascii_isspace (*p) && strchr ("\"'`$|&<>;", *p) == NULL) {
+            p++;
+        } else
+            break;
+    }
+    *len = p - s;
+    return TRUE;
+}
 
-                _g_match_info_clear (&match_info);
+/* Takes ownership of filebuf, which all parsed entries point into */
+static ShellParser *
+shell_parser_new_take_buffer (GFile *file,
+                              gchar *filebuf,
+                              gsize length,
+                              GError **error)
+{
+    ShellParser *ret = NULL;
+    const gchar *s;
+    gboolean want_separator = FALSE; /* Do we expect the next entry to be a separator or comment? */
 
-                matched2 = g_regex_match (unquoted_regex, s, 0, &match_info);
-                if (matched2)
-                    goto append_value;
+    /* Most lines are an assignment or comment plus a separator, so this
+     * usually avoids regrowing the array while parsing */
+    ret = shell_parser_new_empty (file, MIN (length / 8 + 4, 4096));
+    ret->filebuf = filebuf;
 
-                _g_match_info_clear (&match_info);
+    s = filebuf;
+    while (*s != 0) {
+        struct ShellEntry entry = { 0 };
+        gsize len, name_len, value_len;
 
-                break;
+        if ((len = shell_scan_comment (s)) > 0) {
+            entry.type = SHELL_ENTRY_TYPE_COMMENT;
+            want_separator = FALSE;
+        } else if ((len = shell_scan_separator (s)) > 0) {
+            entry.type = SHELL_ENTRY_TYPE_SEPARATOR;
+            want_separator = FALSE;
+        } else if ((len = shell_scan_indent (s)) > 0) {
+            entry.type = SHELL_ENTRY_TYPE_INDENT;
+        } else if ((len = shell_scan_var_equals (s, &name_len)) > 0) {
+            /* If we expect a separator and get an assignment instead, fail */
+            if (want_separator || !shell_scan_value (s + len, &value_len))
+                goto no_match;
 
-  append_value:
-                if (raw_value == NULL) {
-                    raw_value = g_match_info_fetch (match_info, 0);
-                    s += strlen (raw_value);
-                    g_debug ("Scanned value: ``%s''", raw_value);
-                } else {
-                    temp1 = raw_value;
-                    temp2 = g_match_info_fetch (match_info, 0);
-                    raw_value = g_strconcat (temp1, temp2, NULL);
-                    s += strlen (temp2);
-                    g_debug ("Scanned value: ``%s''", temp2);
-                    g_free (temp1);
-                    g_free (temp2);
-                }
-                _g_match_info_clear (&match_info);
-            }
+            /* The scanner only accepts balanced quotes, so the value is
+             * guaranteed to unquote; that is deferred until it is read */
+            entry.type = SHELL_ENTRY_TYPE_ASSIGNMENT;
+            entry.variable_length = name_len;
+            entry.value_offset = len;
+            len += value_len;
+            want_separator = TRUE;
+        } else
+            goto no_match;
+
+        entry.string = s;
+        entry.length = len;
+        g_array_append_val (ret->entries, entry);
+        if (entry.type == SHELL_ENTRY_TYPE_ASSIGNMENT)
+            shell_parser_index_assignment (ret, ret->entries->len - 1);
+        s += len;
+    }
 
-            if (raw_value != NULL) {
-                entry->unquoted_value = g_shell_unquote (raw_value, &local_err);
-                g_debug  ("Unquoted value: ``%s''", entry->unquoted_value);
-                temp1 = entry->string;
-                temp2 = raw_value;
-                entry->string = g_strconcat (temp1, temp2, NULL);
-                g_free (temp1);
-                g_free (temp2);
-                ret->entry_list = g_list_prepend (ret->entry_list, entry);
-                if (local_err != NULL)
-                    goto no_match;
-            }
-            continue;
-        }
+    g_debug ("Parsed '%s': %u entries", ret->filename, ret->entries->len);
+    return ret;
 
   no_match:
-        /* Nothing matches, parsing has failed! */
-        _g_match_info_clear (&match_info);
-        if (local_err != NULL)
-            g_propagate_prefixed_error (error, local_err, "Unable to parse '%s':", ret->filename);
-        else
-            g_propagate_error (error,
-                               g_error_new (G_FILE_ERROR, G_FILE_ERROR_FAILED,
-                                            "Unable to parse '%s'", ret->filename));
-        shell_parser_free (ret);
+    /* Nothing matches, parsing has failed! */
+    g_propagate_error (error,
+                       g_error_new (G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                                    "Unable to parse '%s'", ret->filename));
+    shell_parser_free (ret);
+    return NULL;
+}
+
+ShellParser *
+shell_parser_new_from_string (GFile *file,
+                              const gchar *filebuf,
+                              GError **error)
+{
+    ShellParser *ret;
+
+    if (file == NULL || filebuf == NULL)
         return NULL;
-    }
 
-    ret->entry_list = g_list_reverse (ret->entry_list);
+    if ((ret = shell_parser_new_take_buffer (file, g_strdup (filebuf), strlen (filebuf), error)) != NULL)
+        ret->dirty = TRUE; /* the contents do not come from the file */
     return ret;
 }
 
 gboolean
 shell_parser_is_empty (ShellParser *parser)
 {
-    if (parser == NULL || parser->entry_list == NULL)
+    if (parser == NULL || parser->entries->len == parser->removed_entries)
         return TRUE;
     return FALSE;
 }
 
+gboolean
+shell_parser_is_dirty (ShellParser *parser)
+{
+    return parser != NULL && parser->dirty;
+}
+
 gboolean
 shell_parser_set_variable (ShellParser *parser,
                            const gchar *variable,
                            const gchar *value,
                            gboolean add_if_unset)
 {
-    GList *curr = NULL;
     struct ShellEntry *found_entry = NULL;
     gchar *quoted_value = NULL;
+    gsize variable_length;
     gboolean ret = FALSE;
+    gint i;
 
     g_assert (parser != NULL);
     g_assert (variable != NULL);
 
-    for (curr = parser->entry_list; curr != NULL; curr = curr->next) {
-        struct ShellEntry *entry;
+    variable_length = strlen (variable);
+    if ((i = shell_parser_lookup (parser, variable)) >= 0) {
+        gchar *old_value;
+        gboolean unchanged;
+
+        found_entry = shell_parser_entry (parser, i);
+        /* Setting a variable to its current value is not a modification */
+        old_value = shell_entry_get_value (found_entry);
+        unchanged = g_strcmp0 (old_value, value) == 0;
+        g_free (old_value);
+        if (unchanged)
+            return TRUE;
+    } else if (add_if_unset) {
+        struct ShellEntry new_entry = { 0 };
+        gint last;
+
+        /* We need to add a separator (\n) between two items if there isn't one already. */
+        for (last = parser->entries->len - 1;
+             last >= 0 && shell_parser_entry (parser, last)->type == SHELL_ENTRY_TYPE_REMOVED;
+             last--);
+        if (last >= 0 && shell_parser_entry (parser, last)->type != SHELL_ENTRY_TYPE_SEPARATOR) {
+            struct ShellEntry separator_entry = { 0 };
+
+            g_debug ("Adding separator entry");
+            separator_entry.type = SHELL_ENTRY_TYPE_SEPARATOR;
+            separator_entry.string = "\n";
+            separator_entry.length = 1;
+            g_array_append_val (parser->entries, separator_entry);
+        }
 
-        entry = (struct ShellEntry *)(curr->data);
-        if (entry->type == SHELL_ENTRY_TYPE_ASSIGNMENT && g_strcmp0 (variable, entry->variable) == 0)
-            found_entry = entry;
+        new_entry.type = SHELL_ENTRY_TYPE_ASSIGNMENT;
+        g_array_append_val (parser->entries, new_entry);
+        i = parser->entries->len - 1;
+        found_entry = shell_parser_entry (parser, i);
     }
 
-    quoted_value = g_shell_quote (value);
-
     if (found_entry != NULL) {
-        g_free (found_entry->string);
-        found_entry->string = g_strdup_printf ("%s=%s", variable, quoted_value);
+        gchar *old_owned;
+        gboolean indexed;
+
+        /* Whether the entry was already indexed must be checked before its text changes */
+        indexed = found_entry->string != NULL;
+        quoted_value = g_shell_quote (value);
+        old_owned = found_entry->owned;
+        found_entry->owned = g_strdup_printf ("%s=%s", variable, quoted_value);
+        found_entry->string = found_entry->owned;
+        found_entry->length = strlen (found_entry->owned);
+        found_entry->variable_length = variable_length;
+        found_entry->value_offset = variable_length + 1;
+        /* The index is keyed by the entry's text, which has moved; the old
+         * key is still compared against, so it is only freed afterwards */
+        if (indexed)
+            g_hash_table_replace (parser->variables, (gpointer)found_entry->string, GUINT_TO_POINTER (i + 1));
+        else
+            shell_parser_index_assignment (parser, i);
+        g_free (old_owned);
+        parser->dirty = TRUE;
         ret = TRUE;
-    } else {
-        if (add_if_unset) {
-            GList *previous;
-            struct ShellEntry *previous_entry = NULL;
-
-            /* We need to add a separator (\n) between two items if there isn't one already. */
-            if ((previous = g_list_last(parser->entry_list)) != NULL) {
-                previous_entry = previous->data;
-            }
-            if (previous_entry && previous_entry->type != SHELL_ENTRY_TYPE_SEPARATOR) {
-                struct ShellEntry *separator_entry;
-
-                g_debug ("Adding separator entry");
-                separator_entry = g_new0 (struct ShellEntry, 1);
-                separator_entry->type = SHELL_ENTRY_TYPE_SEPARATOR;
-                separator_entry->string = g_strdup ("\n");
-                parser->entry_list = g_list_append (parser->entry_list, separator_entry);
-            }
-
-            found_entry = g_new0 (struct ShellEntry, 1);
-            found_entry->type = SHELL_ENTRY_TYPE_ASSIGNMENT;
-            found_entry->variable = g_strdup (variable);
-            found_entry->string = g_strdup_printf ("%s=%s", variable, quoted_value);
-            parser->entry_list = g_list_append (parser->entry_list, found_entry);
-            ret = TRUE;
-        }
     }
 
     g_free (quoted_value);
@@ -522,74 +2065,75 @@ void
 shell_parser_clear_variable (ShellParser *parser,
                              const gchar *variable)
 {
-    GList *curr = NULL;
-    gboolean ret = FALSE;
+    gint i;
 
     g_assert (parser != NULL);
     g_assert (variable != NULL);
 
-    for (curr = parser->entry_list; curr != NULL; ) {
+    if ((i = shell_parser_lookup (parser, variable)) < 0)
+        return;
+    g_hash_table_remove (parser->variables, variable);
+    parser->dirty = TRUE;
+
+    /* Follow the chain through every assignment to variable */
+    while (i >= 0) {
         struct ShellEntry *entry;
 
-        entry = (struct ShellEntry *)(curr->data);
-        if (entry->type == SHELL_ENTRY_TYPE_ASSIGNMENT && g_strcmp0 (variable, entry->variable) == 0) {
-            GList *prev, *next;
-
-            prev = curr->prev;
-            next = curr->next;
-            curr->prev = NULL;
-            curr->next = NULL;
-            g_list_free_full (curr, (GDestroyNotify)shell_entry_free);
-            if (prev != NULL)
-                prev->next = next;
-            if (next != NULL)
-                next->prev = prev;
-            curr = next;
-        } else
-            curr = curr->next;
+        entry = shell_parser_entry (parser, i);
+        i = (gint)entry->prev_assignment - 1;
+        g_free (entry->owned);
+        entry->owned = NULL;
+        entry->type = SHELL_ENTRY_TYPE_REMOVED;
+        entry->string = "";
+        entry->length = 0;
+        entry->prev_assignment = 0;
+        parser->removed_entries++;
     }
 }
 
 gboolean
 shell_parser_save (ShellParser *parser,
+                   GCancellable *cancellable,
                    GError **error)
 {
     gboolean ret = FALSE;
-    GList *curr = NULL;
-    GFileOutputStream *os;
+    GString *contents;
+    gsize length = 0;
+    guint i;
 
     g_assert (parser != NULL && parser->file != NULL && parser->filename != NULL);
-    if ((os = g_file_replace (parser->file, NULL, FALSE, G_FILE_CREATE_NONE, NULL, error)) == NULL) {
-        g_prefix_error (error, "Unable to save '%s': ", parser->filename);
-        goto out;
+    if (!parser->dirty) {
+        g_debug ("Not saving '%s': unchanged", parser->filename);
+        return TRUE;
     }
 
-    for (curr = parser->entry_list; curr != NULL; curr = curr->next) {
+    for (i = 0; i < parser->entries->len; i++)
+        length += shell_parser_entry (parser, i)->length;
+    contents = g_string_sized_new (length);
+    for (i = 0; i < parser->entries->len; i++) {
         struct ShellEntry *entry;
-        gsize written;
 
-        entry = (struct ShellEntry *)(curr->data);
-        if (!g_output_stream_write_all (G_OUTPUT_STREAM (os), entry->string, strlen (entry->string), &written, NULL, error)) {
-            g_prefix_error (error, "Unable to save '%s': ", parser->filename);
-            goto out;
-        }
+        entry = shell_parser_entry (parser, i);
+        g_string_append_len (contents, entry->string, entry->length);
     }
-    
-    if (!g_output_stream_close (G_OUTPUT_STREAM (os), NULL, error)) {
+
+    /* On success the parser mirrors the file again, so it can be cached */
+    parser->identity.valid = FALSE;
+    if (!file_write_atomic (parser->filename, contents->str, contents->len, &parser->identity, cancellable, error)) {
         g_prefix_error (error, "Unable to save '%s': ", parser->filename);
-        g_output_stream_close (G_OUTPUT_STREAM (os), NULL, NULL);
         goto out;
     }
+    parser->dirty = FALSE;
     ret = TRUE;
 
   out:
-    if (os)
-        g_object_unref (os);
+    g_string_free (contents, TRUE);
     return ret;
 }
 
 gboolean
 shell_parser_set_and_save (GFile *file,
+                           GCancellable *cancellable,
                            GError **error,
                            const gchar *first_var_name,
                            const gchar *first_alt_var_name,
@@ -629,7 +2173,7 @@ shell_parser_set_and_save (GFile *file,
     } while ((var_name = va_arg (ap, const gchar*)) != NULL ?
                  alt_var_name = va_arg (ap, const gchar*), value = va_arg (ap, const gchar*), 1 : 0);
 
-    if (!shell_parser_save (parser, error))
+    if (!shell_parser_save (parser, cancellable, error))
         goto out;
 
     ret = TRUE;
@@ -657,84 +2201,630 @@ shell_parser_source_var_list (GFile *file,
         return NULL;
 
     ret = g_new0 (gchar *, g_strv_length ((gchar **)var_names) + 1);
-    for (var_name = var_names, value = ret; *var_name != NULL; var_name++, value++) {
-        GList *curr;
-        for (curr = parser->entry_list; curr != NULL; curr = curr->next) {
-            struct ShellEntry *entry;
-
-            entry = (struct ShellEntry *)(curr->data);
-            if (entry->type == SHELL_ENTRY_TYPE_ASSIGNMENT && g_strcmp0 (*var_name, entry->variable) == 0)
-                *value = g_strdup (entry->unquoted_value);
-        }
-    }
+    for (var_name = var_names, value = ret; *var_name != NULL; var_name++, value++)
+        *value = shell_parser_get_variable (parser, *var_name);
     shell_parser_free (parser);
     return ret;
 }
 
-void
-utils_destroy (void)
+/* keyboard model map file parser */
+
+/* Counts the ids in left that are not in right, setting *any if some are */
+static guint
+token_ids_count_unmatched (const guint *left,
+                           guint n_left,
+                           const guint *right,
+                           guint n_right,
+                           gboolean *any)
+{
+    guint i, j, unmatched = 0;
+
+    for (i = 0; i < n_left; i++) {
+        for (j = 0; j < n_right; j++)
+            if (left[i] == right[j])
+                break;
+        if (j < n_right)
+            *any = TRUE;
+        else
+            unmatched++;
+    }
+    return unmatched;
+}
+
+/* Lower scores are better matches; the result only depends on integers
+ * computed in advance, so scoring does not allocate */
+gboolean
+kbd_model_map_entry_matches_x11 (const struct kbd_model_map *map,
+                                 const struct kbd_model_map_entry *entry,
+                                 const struct kbd_model_map_query *query,
+                                 unsigned int *failure_score)
 {
-    if (indent_regex != NULL) {
-        g_regex_unref (indent_regex);
-        indent_regex = NULL;
+    const guint *entry_layouts = map->token_ids + entry->layouts;
+    const guint *entry_options = map->token_ids + entry->options;
+    unsigned int x11_layout_failures;
+    gboolean ret = FALSE, options_match = FALSE;
+
+    /* A list matches if any token is in both; each token in one list but not
+     * the other is a failure */
+    x11_layout_failures = token_ids_count_unmatched (query->layouts, query->n_layouts, entry_layouts, entry->n_layouts, &ret) +
+                          token_ids_count_unmatched (entry_layouts, entry->n_layouts, query->layouts, query->n_layouts, &ret);
+    if (failure_score != NULL) {
+        token_ids_count_unmatched (query->options, query->n_options, entry_options, entry->n_options, &options_match);
+        *failure_score = 10000 * !ret +
+                         100 * x11_layout_failures +
+                         (query->model_id != entry->model_id ? 1 : 0) +
+                         10 * (query->variant_id != entry->variant_id ? 1 : 0) +
+                         !options_match;
     }
-    if (comment_regex != NULL) {
-        g_regex_unref (comment_regex);
-        comment_regex = NULL;
+    return ret;
+}
+
+void
+kbd_model_map_unref (struct kbd_model_map *map)
+{
+    if (map == NULL || !g_atomic_int_dec_and_test (&map->refcount))
+        return;
+
+    if (map->by_vconsole != NULL)
+        g_hash_table_destroy (map->by_vconsole);
+    g_ptr_array_free (map->by_layout, TRUE);
+    g_hash_table_destroy (map->tokens);
+    g_free (map->token_ids);
+    g_free (map->entries);
+    g_free (map->filebuf);
+    g_free (map);
+}
+
+static void
+kbd_model_map_index_array_free (GArray *array)
+{
+    if (array != NULL)
+        g_array_free (array, TRUE);
+}
+
+/* Splits the next whitespace-separated field off *p in place */
+static gchar *
+kbd_model_map_next_field (gchar **p)
+{
+    gchar *field;
+
+    while (g_ascii_isspace (**p))
+        (*p)++;
+    if (**p == '\0')
+        return NULL;
+    field = *p;
+    while (**p != '\0' && !g_ascii_isspace (**p))
+        (*p)++;
+    if (**p != '\0')
+        *(*p)++ = '\0';
+    /* "-" in the map file stands for an empty string */
+    if (field[0] == '-' && field[1] == '\0')
+        field[0] = '\0';
+    return field;
+}
+
+static guint
+kbd_model_map_intern (GHashTable *tokens,
+                      const gchar *token,
+                      gsize length)
+{
+    gchar *key;
+    guint id;
+
+    key = g_strndup (token, length);
+    if ((id = GPOINTER_TO_UINT (g_hash_table_lookup (tokens, key))) == 0) {
+        id = g_hash_table_size (tokens) + 1;
+        g_hash_table_insert (tokens, key, GUINT_TO_POINTER (id));
+    } else
+        g_free (key);
+    return id;
+}
+
+/* Appends the ids of the tokens of a comma-separated list; an empty list
+ * has no tokens, as with g_strsplit */
+static guint
+kbd_model_map_intern_list (GHashTable *tokens,
+                           const gchar *list,
+                           GArray *ids)
+{
+    const gchar *start, *end;
+    guint n = 0, id;
+
+    if (list[0] == '\0')
+        return 0;
+    for (start = list; ; start = end + 1) {
+        if ((end = strchr (start, ',')) == NULL)
+            end = start + strlen (start);
+        id = kbd_model_map_intern (tokens, start, end - start);
+        g_array_append_val (ids, id);
+        n++;
+        if (*end == '\0')
+            break;
     }
-    if (separator_regex != NULL) {
-        g_regex_unref (separator_regex);
-        separator_regex = NULL;
+    return n;
+}
+
+/* Checks whether the file is the one the compiled-in table was built from.
+ * This reads and checksums the whole file, which kbd_model_map_get only
+ * does when the file's identity has changed since the last load. */
+static gboolean
+kbd_model_map_is_builtin (const gchar *contents,
+                          gsize length)
+{
+    gchar *checksum;
+    gboolean ret;
+
+    if (length != kbd_model_map_builtin_size)
+        return FALSE;
+    checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA256, (const guchar *)contents, length);
+    ret = !g_strcmp0 (checksum, kbd_model_map_builtin_sha256);
+    g_free (checksum);
+    return ret;
+}
+
+static void
+kbd_model_map_load_builtin (struct kbd_model_map *map)
+{
+    guint i;
+
+    map->builtin = TRUE;
+    map->n_entries = kbd_model_map_builtin_n_entries;
+    map->entries = g_new0 (struct kbd_model_map_entry, map->n_entries);
+    for (i = 0; i < map->n_entries; i++) {
+        map->entries[i].vconsole_keymap = kbd_model_map_builtin_entries[i].vconsole_keymap;
+        map->entries[i].x11_layout = kbd_model_map_builtin_entries[i].x11_layout;
+        map->entries[i].x11_model = kbd_model_map_builtin_entries[i].x11_model;
+        map->entries[i].x11_variant = kbd_model_map_builtin_entries[i].x11_variant;
+        map->entries[i].x11_options = kbd_model_map_builtin_entries[i].x11_options;
     }
-    if (var_equals_regex != NULL) {
-        g_regex_unref (var_equals_regex);
-        var_equals_regex = NULL;
+}
+
+static gboolean
+kbd_model_map_parse (struct kbd_model_map *map,
+                     const gchar *filename,
+                     GError **error)
+{
+    GArray *entries;
+    gchar *line, *newline;
+    guint line_number = 0;
+
+    g_debug ("Parsing keyboard model map file file: '%s'", filename);
+
+    entries = g_array_new (FALSE, TRUE, sizeof (struct kbd_model_map_entry));
+    for (line = map->filebuf; line != NULL; line = newline) {
+        struct kbd_model_map_entry entry = { NULL };
+        gchar *p, *fields[5];
+        guint n;
+
+        if ((newline = strchr (line, '\n')) != NULL)
+            *newline++ = '\0';
+        line_number++;
+
+        p = line;
+        while (g_ascii_isspace (*p))
+            p++;
+        if (*p == '\0' || *p == '#')
+            continue;
+
+        for (n = 0; n < G_N_ELEMENTS (fields); n++)
+            if ((fields[n] = kbd_model_map_next_field (&p)) == NULL)
+                break;
+        if (n < G_N_ELEMENTS (fields)) {
+            g_propagate_error (error,
+                               g_error_new (G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                                            "Failed to parse line %u in '%s'", line_number, filename));
+            g_array_free (entries, TRUE);
+            return FALSE;
+        }
+        entry.vconsole_keymap = fields[0];
+        entry.x11_layout = fields[1];
+        entry.x11_model = fields[2];
+        entry.x11_variant = fields[3];
+        entry.x11_options = fields[4];
+        g_array_append_val (entries, entry);
     }
-    if (single_quoted_regex != NULL) {
-        g_regex_unref (single_quoted_regex);
-        single_quoted_regex = NULL;
+    map->n_entries = entries->len;
+    map->entries = (struct kbd_model_map_entry *) g_array_free (entries, FALSE);
+    return TRUE;
+}
+
+struct kbd_model_map *
+kbd_model_map_load (GFile *file,
+                    GError **error)
+{
+    struct kbd_model_map *map;
+    GArray *token_ids;
+    gchar *filename;
+    gsize length = 0;
+    guint i, j;
+
+    filename = g_file_get_path (file);
+    map = g_new0 (struct kbd_model_map, 1);
+    map->refcount = 1;
+    if (!file_identity_stat (filename, &map->identity))
+        map->identity.valid = FALSE;
+    if (!g_file_load_contents (file, NULL, &map->filebuf, &length, NULL, error)) {
+        g_prefix_error (error, "Unable to read '%s':", filename);
+        g_free (map);
+        map = NULL;
+        goto out;
     }
-    if (double_quoted_regex != NULL) {
-        g_regex_unref (double_quoted_regex);
-        double_quoted_regex = NULL;
+
+    if (kbd_model_map_is_builtin (map->filebuf, length)) {
+        g_debug ("Using compiled-in keyboard model map for '%s'", filename);
+        g_free (map->filebuf);
+        map->filebuf = NULL;
+        kbd_model_map_load_builtin (map);
+    } else if (!kbd_model_map_parse (map, filename, error)) {
+        g_free (map->filebuf);
+        g_free (map);
+        map = NULL;
+        goto out;
+    } else
+        map->by_vconsole = g_hash_table_new (g_str_hash, g_str_equal);
+
+    map->tokens = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    token_ids = g_array_new (FALSE, FALSE, sizeof (guint));
+    map->by_layout = g_ptr_array_new_with_free_func ((GDestroyNotify)kbd_model_map_index_array_free);
+    for (i = 0; i < map->n_entries; i++) {
+        struct kbd_model_map_entry *entry = &map->entries[i];
+
+        /* The first entry for a keymap wins */
+        if (map->by_vconsole != NULL && g_hash_table_lookup (map->by_vconsole, entry->vconsole_keymap) == NULL)
+            g_hash_table_insert (map->by_vconsole, (gpointer)entry->vconsole_keymap, GUINT_TO_POINTER (i + 1));
+
+        entry->model_id = kbd_model_map_intern (map->tokens, entry->x11_model, strlen (entry->x11_model));
+        entry->variant_id = kbd_model_map_intern (map->tokens, entry->x11_variant, strlen (entry->x11_variant));
+        entry->layouts = token_ids->len;
+        entry->n_layouts = kbd_model_map_intern_list (map->tokens, entry->x11_layout, token_ids);
+        entry->options = token_ids->len;
+        entry->n_options = kbd_model_map_intern_list (map->tokens, entry->x11_options, token_ids);
+
+        for (j = 0; j < entry->n_layouts; j++) {
+            guint id = g_array_index (token_ids, guint, entry->layouts + j);
+            GArray *indices;
+
+            if (map->by_layout->len <= id)
+                g_ptr_array_set_size (map->by_layout, id + 1);
+            if ((indices = g_ptr_array_index (map->by_layout, id)) == NULL) {
+                indices = g_array_new (FALSE, FALSE, sizeof (guint));
+                g_ptr_array_index (map->by_layout, id) = indices;
+            }
+            /* A layout may repeat a token */
+            if (indices->len == 0 || g_array_index (indices, guint, indices->len - 1) != i)
+                g_array_append_val (indices, i);
+        }
     }
-    if (unquoted_regex != NULL) {
-        g_regex_unref (unquoted_regex);
-        unquoted_regex = NULL;
+    map->token_ids = (guint *) g_array_free (token_ids, FALSE);
+    g_debug ("Loaded %u keyboard model map entries with %u distinct tokens", map->n_entries, g_hash_table_size (map->tokens));
+
+  out:
+    g_free (filename);
+    return map;
+}
+
+static guint
+kbd_model_map_lookup_token (const struct kbd_model_map *map,
+                            const gchar *token)
+{
+    if (token == NULL)
+        return 0;
+    return GPOINTER_TO_UINT (g_hash_table_lookup (map->tokens, token));
+}
+
+static guint *
+kbd_model_map_lookup_list (const struct kbd_model_map *map,
+                           const gchar *list,
+                           guint *n_ids)
+{
+    gchar **tokens;
+    guint *ids, i;
+
+    if (list == NULL || list[0] == '\0') {
+        *n_ids = 0;
+        return NULL;
     }
+    tokens = g_strsplit (list, ",", 0);
+    *n_ids = g_strv_length (tokens);
+    ids = g_new (guint, *n_ids);
+    for (i = 0; i < *n_ids; i++)
+        ids[i] = kbd_model_map_lookup_token (map, tokens[i]);
+    g_strfreev (tokens);
+    return ids;
 }
 
+/* Interns xkb settings once, so that they can be scored against any number
+ * of entries */
 void
-utils_init (void)
+kbd_model_map_query_init (struct kbd_model_map_query *query,
+                          const struct kbd_model_map *map,
+                          const gchar *_x11_layout,
+                          const gchar *_x11_model,
+                          const gchar *_x11_variant,
+                          const gchar *_x11_options)
 {
-    if (indent_regex == NULL) {
-        indent_regex = g_regex_new ("^[ \\t]+", G_REGEX_ANCHORED, 0, NULL);
-        g_assert (indent_regex != NULL);
-    }
-    if (comment_regex == NULL) {
-        comment_regex = g_regex_new ("^#[^\\n]*\\n", G_REGEX_ANCHORED|G_REGEX_MULTILINE, 0, NULL);
-        g_assert (comment_regex != NULL);
-    }
-    if (separator_regex == NULL) {
-        separator_regex = g_regex_new ("^[ \\t;\\n\\r]*[;\\n][ \\t;\\n\\r]*", G_REGEX_ANCHORED|G_REGEX_MULTILINE, 0, NULL);
-        g_assert (separator_regex != NULL);
+    query->model_id = kbd_model_map_lookup_token (map, _x11_model);
+    query->variant_id = kbd_model_map_lookup_token (map, _x11_variant);
+    query->layouts = kbd_model_map_lookup_list (map, _x11_layout, &query->n_layouts);
+    query->options = kbd_model_map_lookup_list (map, _x11_options, &query->n_options);
+}
+
+void
+kbd_model_map_query_clear (struct kbd_model_map_query *query)
+{
+    g_free (query->layouts);
+    g_free (query->options);
+}
+
+const struct kbd_model_map_entry *
+kbd_model_map_lookup_vconsole (const struct kbd_model_map *map,
+                               const gchar *_vconsole_keymap)
+{
+    gint builtin_index;
+    guint index;
+
+    if (_vconsole_keymap == NULL)
+        return NULL;
+    if (map->builtin) {
+        builtin_index = kbd_model_map_builtin_lookup (_vconsole_keymap);
+        return builtin_index >= 0 ? &map->entries[builtin_index] : NULL;
     }
-    if (var_equals_regex == NULL) {
-        var_equals_regex = g_regex_new ("^([a-zA-Z_][a-zA-Z0-9_]*)(?:(?:\\\\\\n)*)=(?:(?:\\\\\\n)*)", G_REGEX_ANCHORED|G_REGEX_MULTILINE, 0, NULL);
-        g_assert (var_equals_regex != NULL);
+    index = GPOINTER_TO_UINT (g_hash_table_lookup (map->by_vconsole, _vconsole_keymap));
+    return index > 0 ? &map->entries[index - 1] : NULL;
+}
+
+static gint
+kbd_model_map_index_compare (gconstpointer a,
+                             gconstpointer b)
+{
+    guint ia = *(const guint *)a, ib = *(const guint *)b;
+
+    return ia < ib ? -1 : ia > ib;
+}
+
+/* Finds the entry that best matches the given xkb settings. Only entries
+ * sharing a layout token with the query can match, so only those are
+ * scored; they are visited in file order, so that the first of several
+ * equally good entries wins. */
+const struct kbd_model_map_entry *
+kbd_model_map_lookup_x11 (const struct kbd_model_map *map,
+                          const struct kbd_model_map_query *query)
+{
+    const struct kbd_model_map_entry *best_entry = NULL;
+    unsigned int best_failure_score = UINT_MAX;
+    GArray *candidates;
+    guint i, last = G_MAXUINT;
+
+    candidates = g_array_new (FALSE, FALSE, sizeof (guint));
+    for (i = 0; i < query->n_layouts; i++) {
+        guint id = query->layouts[i];
+        GArray *indices;
+
+        if (id != 0 && id < map->by_layout->len && (indices = g_ptr_array_index (map->by_layout, id)) != NULL)
+            g_array_append_vals (candidates, indices->data, indices->len);
     }
-    if (single_quoted_regex == NULL) {
-        single_quoted_regex = g_regex_new ("^'[^']*'", G_REGEX_ANCHORED|G_REGEX_MULTILINE, 0, NULL);
-        g_assert (single_quoted_regex != NULL);
+    g_array_sort (candidates, kbd_model_map_index_compare);
+
+    for (i = 0; i < candidates->len; i++) {
+        const struct kbd_model_map_entry *entry;
+        unsigned int failure_score = 0;
+        guint index = g_array_index (candidates, guint, i);
+
+        if (index == last)
+            continue;
+        last = index;
+        entry = &map->entries[index];
+        if (kbd_model_map_entry_matches_x11 (map, entry, query, &failure_score) &&
+            failure_score < best_failure_score) {
+            best_entry = entry;
+            best_failure_score = failure_score;
+        }
     }
-    /* We do not want to allow $(...) or `...` constructs in double-quoted
-     * strings because they might have side effects, but ${...} is OK */
-    if (double_quoted_regex == NULL) {
-        double_quoted_regex = g_regex_new ("^\"(?:[^\"`\\$]|\\\\[\"`\\$]|\\$\\{)*\"", G_REGEX_ANCHORED|G_REGEX_MULTILINE, 0, NULL);
-        g_assert (double_quoted_regex != NULL);
+    g_array_free (candidates, TRUE);
+    return best_entry;
+}
+
+/* Trivial /etc/X11/xorg.conf.d/30-keyboard.conf line classifier */
+
+static const gchar *
+xorg_confd_skip_space (const gchar *p)
+{
+    while (g_ascii_isspace (*p))
+        p++;
+    return p;
+}
+
+/* Scans a quoted string at p, setting *start and *length to its contents
+ * and returning the position after the closing quote, or NULL */
+static const gchar *
+xorg_confd_scan_quoted (const gchar *p,
+                        const gchar **start,
+                        gsize *length)
+{
+    const gchar *end;
+
+    if (*p != '"' || (end = strchr (p + 1, '"')) == NULL)
+        return NULL;
+    *start = p + 1;
+    *length = end - p - 1;
+    return end + 1;
+}
+
+static gboolean
+xorg_confd_token_equal (const gchar *token,
+                        gsize length,
+                        const gchar *keyword)
+{
+    return strlen (keyword) == length && !g_ascii_strncasecmp (token, keyword, length);
+}
+
+/* Classifies a line in a single pass. Keywords and option names are case
+ * insensitive; for the Xkb options we are interested in, *value_offset and
+ * *value_length are set to the quoted value. */
+enum XORG_CONFD_LINE_TYPE
+xorg_confd_line_classify (const gchar *line,
+                          gsize *value_offset,
+                          gsize *value_length)
+{
+    const gchar *p, *keyword, *name, *value;
+    gsize keyword_length, name_length;
+
+    p = xorg_confd_skip_space (line);
+    if (*p == '#')
+        return XORG_CONFD_LINE_TYPE_COMMENT;
+
+    for (keyword = p; g_ascii_isalpha (*p); p++)
+        ;
+    keyword_length = p - keyword;
+    if (keyword_length == 0)
+        return XORG_CONFD_LINE_TYPE_UNKNOWN;
+
+    switch (g_ascii_tolower (keyword[0])) {
+    case 's':
+        if (!xorg_confd_token_equal (keyword, keyword_length, "Section") || !g_ascii_isspace (*p))
+            break;
+        if (xorg_confd_scan_quoted (xorg_confd_skip_space (p), &name, &name_length) == NULL)
+            break;
+        if (xorg_confd_token_equal (name, name_length, "InputClass"))
+            return XORG_CONFD_LINE_TYPE_SECTION_INPUT_CLASS;
+        return XORG_CONFD_LINE_TYPE_SECTION_OTHER;
+    case 'e':
+        if (xorg_confd_token_equal (keyword, keyword_length, "EndSection"))
+            return XORG_CONFD_LINE_TYPE_END_SECTION;
+        break;
+    case 'm':
+        if (!xorg_confd_token_equal (keyword, keyword_length, "MatchIsKeyboard"))
+            break;
+        /* With no value, or with a true one */
+        if (*xorg_confd_skip_space (p) == '\0')
+            return XORG_CONFD_LINE_TYPE_MATCH_IS_KEYBOARD;
+        if (!g_ascii_isspace (*p) || xorg_confd_scan_quoted (xorg_confd_skip_space (p), &value, value_length) == NULL)
+            break;
+        if (xorg_confd_token_equal (value, *value_length, "1") ||
+            xorg_confd_token_equal (value, *value_length, "on") ||
+            xorg_confd_token_equal (value, *value_length, "true") ||
+            xorg_confd_token_equal (value, *value_length, "yes"))
+            return XORG_CONFD_LINE_TYPE_MATCH_IS_KEYBOARD;
+        break;
+    case 'o':
+        if (!xorg_confd_token_equal (keyword, keyword_length, "Option") || !g_ascii_isspace (*p))
+            break;
+        if ((p = xorg_confd_scan_quoted (xorg_confd_skip_space (p), &name, &name_length)) == NULL || !g_ascii_isspace (*p))
+            break;
+        p = xorg_confd_skip_space (p);
+        if (xorg_confd_scan_quoted (p, &value, value_length) == NULL)
+            break;
+        *value_offset = p - line;
+        if (xorg_confd_token_equal (name, name_length, "XkbLayout"))
+            return XORG_CONFD_LINE_TYPE_XKB_LAYOUT;
+        else if (xorg_confd_token_equal (name, name_length, "XkbModel"))
+            return XORG_CONFD_LINE_TYPE_XKB_MODEL;
+        else if (xorg_confd_token_equal (name, name_length, "XkbVariant"))
+            return XORG_CONFD_LINE_TYPE_XKB_VARIANT;
+        else if (xorg_confd_token_equal (name, name_length, "XkbOptions"))
+            return XORG_CONFD_LINE_TYPE_XKB_OPTIONS;
+        break;
     }
-    if (unquoted_regex == NULL) {
-        unquoted_regex = g_regex_new ("^(?:[^\\s\"'`\\$\\|&<>;]|\\\\[\\s\"'`\\$\\|&<>;]|\\$\\{)+", G_REGEX_ANCHORED|G_REGEX_MULTILINE, 0, NULL);
-        g_assert (unquoted_regex != NULL);
+    return XORG_CONFD_LINE_TYPE_UNKNOWN;
+}
+
+void
+utils_destroy (void)
+{
+    G_LOCK (shell_parser_cache);
+    if (shell_parser_cache != NULL)
+        g_hash_table_destroy (shell_parser_cache);
+    shell_parser_cache = NULL;
+    G_UNLOCK (shell_parser_cache);
+
+    G_LOCK (polkit_authority);
+    g_clear_object (&polkit_authority);
+    G_UNLOCK (polkit_authority);
+
+    G_LOCK (polkit_cache);
+    if (polkit_cache != NULL)
+        g_hash_table_destroy (polkit_cache);
+    polkit_cache = NULL;
+    G_UNLOCK (polkit_cache);
+
+    G_LOCK (peer_credentials);
+    if (peer_credentials != NULL)
+        g_hash_table_destroy (peer_credentials);
+    peer_credentials = NULL;
+    G_UNLOCK (peer_credentials);
+
+    G_LOCK (admission);
+    if (admission_log_id != 0)
+        g_source_remove (admission_log_id);
+    admission_log_id = 0;
+    if (admission_senders != NULL)
+        g_hash_table_destroy (admission_senders);
+    admission_senders = NULL;
+    G_UNLOCK (admission);
+}
+
+void
+utils_log_stats (void)
+{
+    G_LOCK (polkit_cache);
+    g_message ("polkit cache: %s, %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses, %u senders",
+               polkit_cache_ttl > 0 ? "enabled" : "disabled",
+               polkit_cache_hits, polkit_cache_misses,
+               polkit_cache != NULL ? g_hash_table_size (polkit_cache) : 0);
+    G_UNLOCK (polkit_cache);
+
+    G_LOCK (admission);
+    g_message ("requests: %u active, %u queued, %" G_GUINT64_FORMAT " rejected for exceeding limits, %" G_GUINT64_FORMAT " joined to identical requests",
+               admission_active, admission_queue.length, admission_rejected, bus_invocation_join_count ());
+    G_UNLOCK (admission);
+
+    G_LOCK (polkit_breaker);
+    g_message ("polkit circuit breaker: %s, %" G_GUINT64_FORMAT " timeouts, %" G_GUINT64_FORMAT " trips, %" G_GUINT64_FORMAT " rejected checks",
+               polkit_breaker_threshold > 0 ? polkit_breaker_state_names[polkit_breaker_state] : "disabled",
+               polkit_timeouts, polkit_breaker_trips, polkit_breaker_rejections);
+    G_UNLOCK (polkit_breaker);
+}
+
+void
+utils_init (FileFsyncPolicy fsync_policy,
+            guint _polkit_cache_ttl,
+            gboolean local_auth,
+            const gchar *trusted_group,
+            guint _polkit_timeout,
+            guint breaker_threshold,
+            guint breaker_probe_interval)
+{
+    guint n_backends = 0;
+
+    file_fsync_policy = fsync_policy;
+    polkit_cache_ttl = _polkit_cache_ttl;
+    polkit_timeout = _polkit_timeout;
+    /* Without a deadline there are no timeouts to count */
+    polkit_breaker_threshold = polkit_timeout > 0 ? breaker_threshold : 0;
+    polkit_breaker_probe_interval = breaker_probe_interval;
+
+    if (trusted_group != NULL) {
+        struct group grp, *gr = NULL;
+        gchar buf[4096];
+
+        if (getgrnam_r (trusted_group, &grp, buf, sizeof (buf), &gr) == 0 && gr != NULL) {
+            auth_local_trusted_gid = gr->gr_gid;
+            auth_local_have_trusted_gid = TRUE;
+        } else
+            g_warning ("Unknown trusted group '%s'", trusted_group);
+        local_auth = TRUE;
     }
+    auth_local_enabled = local_auth;
+
+    if (auth_local_enabled)
+        auth_backends[n_backends++] = &auth_backend_local;
+    if (polkit_cache_ttl > 0)
+        auth_backends[n_backends++] = &auth_backend_polkit_cache;
+    auth_backends[n_backends++] = &auth_backend_polkit;
+    auth_backends[n_backends] = NULL;
+
+    /* Connect to polkitd now rather than on the first method call */
+    G_LOCK (polkit_authority);
+    polkit_authority_fetch ();
+    G_UNLOCK (polkit_authority);
 }
@@ -27,13 +27,98 @@
 #include <glib.h>
 #include <gio/gio.h>
 
+typedef struct _FileIdentity FileIdentity;
+
+/* Identifies one version of a file's contents */
+struct _FileIdentity
+{
+  gboolean valid;
+  guint64 dev;
+  guint64 ino;
+  gint64 size;
+  gint64 mtime_ns;
+};
+
+typedef enum {
+  FILE_FSYNC_POLICY_NONE, /* leave flushing to the kernel */
+  FILE_FSYNC_POLICY_FILE, /* fsync the new file before renaming it into place */
+  FILE_FSYNC_POLICY_DIR, /* also fsync the directory after the rename */
+} FileFsyncPolicy;
+
 typedef struct _ShellParser ShellParser;
 
 struct _ShellParser
 {
   GFile *file;
   gchar *filename;
-  GList *entry_list;
+  gchar *filebuf;
+  GArray *entries;
+  GHashTable *variables; /* variable name -> 1 + index of its last assignment */
+  guint removed_entries;
+  FileIdentity identity; /* of the file when it was read or last saved */
+  gboolean dirty; /* entries differ from what was read or last saved */
+};
+
+typedef struct _WorkQueue WorkQueue;
+
+/* Entries point into the map's buffer. For scoring, the comma-separated
+ * layout and option lists and the model and variant are also interned into
+ * token ids, which are never 0. */
+struct kbd_model_map_entry {
+  const gchar *vconsole_keymap;
+  const gchar *x11_layout;
+  const gchar *x11_model;
+  const gchar *x11_variant;
+  const gchar *x11_options;
+
+  guint model_id;
+  guint variant_id;
+  guint layouts; /* index of the first layout id in the map's token_ids */
+  guint n_layouts;
+  guint options; /* index of the first option id in the map's token_ids */
+  guint n_options;
+};
+
+/* The map is parsed once and kept while the file is unchanged. A loaded map
+ * is immutable and reference counted, so it can be used without a lock.
+ * When the file is the one the daemon was built with, the entries point
+ * into the compiled-in table instead, and keymaps are looked up with its
+ * perfect hash. */
+struct kbd_model_map {
+  gint refcount;
+  FileIdentity identity;
+  gboolean builtin;
+  gchar *filebuf;
+  struct kbd_model_map_entry *entries;
+  guint n_entries;
+  GHashTable *tokens; /* token -> id */
+  guint *token_ids; /* the entries' layout and option ids */
+  GHashTable *by_vconsole; /* vconsole keymap -> 1 + index of its first entry, unless builtin */
+  GPtrArray *by_layout; /* layout token id -> GArray of indices of entries with that token, or NULL */
+};
+
+/* xkb settings to match against the map, interned with its tokens; ids of
+ * tokens that the map does not know are 0 */
+struct kbd_model_map_query {
+  guint model_id;
+  guint variant_id;
+  guint *layouts;
+  guint n_layouts;
+  guint *options;
+  guint n_options;
+};
+
+enum XORG_CONFD_LINE_TYPE {
+  XORG_CONFD_LINE_TYPE_UNKNOWN,
+  XORG_CONFD_LINE_TYPE_COMMENT,
+  XORG_CONFD_LINE_TYPE_SECTION_INPUT_CLASS,
+  XORG_CONFD_LINE_TYPE_SECTION_OTHER,
+  XORG_CONFD_LINE_TYPE_END_SECTION,
+  XORG_CONFD_LINE_TYPE_MATCH_IS_KEYBOARD,
+  XORG_CONFD_LINE_TYPE_XKB_LAYOUT,
+  XORG_CONFD_LINE_TYPE_XKB_MODEL,
+  XORG_CONFD_LINE_TYPE_XKB_VARIANT,
+  XORG_CONFD_LINE_TYPE_XKB_OPTIONS,
 };
 
 /* Always return TRUE */
@@ -43,10 +128,22 @@ _g_match_info_clear (GMatchInfo **match_info);
 gchar *
 strstr0 (const char *haystack, const char *needle);
 
+WorkQueue *
+work_queue_new (const gchar *name);
+
+void
+work_queue_push (WorkQueue *queue,
+                 GFunc func,
+                 gpointer data);
+
 void
-check_polkit_async (const gchar *unique_name,
+work_queue_free (WorkQueue *queue);
+
+void
+check_polkit_async (GDBusMethodInvocation *invocation,
                     const gchar *action_id,
                     const gboolean user_interaction,
+                    WorkQueue *queue,
                     GAsyncReadyCallback callback,
                     gpointer user_data);
 
@@ -54,6 +151,26 @@ gboolean
 check_polkit_finish (GAsyncResult *res,
                      GError **error);
 
+gboolean
+file_identity_stat (const gchar *filename,
+                    FileIdentity *identity);
+
+gboolean
+file_identity_equal (const FileIdentity *a,
+                     const FileIdentity *b);
+
+gboolean
+file_fsync_policy_parse (const gchar *name,
+                         FileFsyncPolicy *policy);
+
+gboolean
+file_write_atomic (const gchar *filename,
+                   const gchar *contents,
+                   gsize length,
+                   FileIdentity *identity,
+                   GCancellable *cancellable,
+                   GError **error);
+
 gchar *
 shell_source_var (GFile *file,
                   const gchar *variable,
@@ -65,7 +182,7 @@ shell_parser_new (GFile *file,
 
 ShellParser *
 shell_parser_new_from_string (GFile *file,
-                              gchar *filebuf,
+                              const gchar *filebuf,
                               GError **error);
 
 void
@@ -74,6 +191,9 @@ shell_parser_free (ShellParser *parser);
 gboolean
 shell_parser_is_empty (ShellParser *parser);
 
+gboolean
+shell_parser_is_dirty (ShellParser *parser);
+
 gboolean
 shell_parser_set_variable (ShellParser *parser,
                                   const gchar *variable,
@@ -86,10 +206,12 @@ shell_parser_clear_variable (ShellParser *parser,
 
 gboolean
 shell_parser_save (ShellParser *parser,
+                   GCancellable *cancellable,
                    GError **error);
 
 gboolean
 shell_parser_set_and_save (GFile *file,
+                           GCancellable *cancellable,
                            GError **error,
                            const gchar *first_var_name,
                            const gchar *first_alt_var_name,
@@ -101,10 +223,61 @@ shell_parser_source_var_list (GFile *file,
                               const gchar * const *var_names,
                               GError **error);
 
+enum XORG_CONFD_LINE_TYPE
+xorg_confd_line_classify (const gchar *line,
+                          gsize *value_offset,
+                          gsize *value_length);
+
+struct kbd_model_map *
+kbd_model_map_load (GFile *file,
+                    GError **error);
+
 void
-utils_init (void);
+kbd_model_map_unref (struct kbd_model_map *map);
+
+void
+kbd_model_map_query_init (struct kbd_model_map_query *query,
+                          const struct kbd_model_map *map,
+                          const gchar *_x11_layout,
+                          const gchar *_x11_model,
+                          const gchar *_x11_variant,
+                          const gchar *_x11_options);
+
+void
+kbd_model_map_query_clear (struct kbd_model_map_query *query);
+
+gboolean
+kbd_model_map_entry_matches_x11 (const struct kbd_model_map *map,
+                                 const struct kbd_model_map_entry *entry,
+                                 const struct kbd_model_map_query *query,
+                                 unsigned int *failure_score);
+
+const struct kbd_model_map_entry *
+kbd_model_map_lookup_vconsole (const struct kbd_model_map *map,
+                               const gchar *_vconsole_keymap);
+
+const struct kbd_model_map_entry *
+kbd_model_map_lookup_x11 (const struct kbd_model_map *map,
+                          const struct kbd_model_map_query *query);
+
+void
+utils_init (FileFsyncPolicy fsync_policy,
+            guint polkit_cache_ttl,
+            gboolean local_auth,
+            const gchar *trusted_group,
+            guint polkit_timeout,
+            guint breaker_threshold,
+            guint breaker_probe_interval);
+
+void
+utils_set_admission_limits (guint max_active,
+                            guint max_queued,
+                            guint max_per_sender);
 
 void
 utils_destroy (void);
 
+void
+utils_log_stats (void);
+
 #endif